@@ -0,0 +1,305 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <syslog.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "util.h"
+
+/* where the daemon was placed, for ut ctl */
+static char placed_cpus[AFFINITY_MAX_LIST];
+static int placed_node = -1;
+
+/* a list as the kernel writes them, 0-3,8,10-11 */
+int cpulist_parse(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    while (*text && *text != '\n')
+    {
+	char *end;
+	long lo = strtol(text, &end, 10), hi = lo;
+
+	if (end == text)
+	    return -1;
+
+	if (*end == '-')
+	{
+	    text = end + 1;
+	    hi = strtol(text, &end, 10);
+
+	    if (end == text)
+		return -1;
+	}
+
+	if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+	    return -1;
+
+	for (long cpu = lo; cpu <= hi; cpu++)
+	    CPU_SET(cpu, set);
+
+	if (*(text = end) == ',')
+	    text++;
+	else if (*text && *text != '\n')
+	    return -1;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+static void cpulist_format(cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+    {
+	int last = cpu;
+
+	if (!CPU_ISSET(cpu, set))
+	    continue;
+
+	while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+	    last++;
+
+	if (last > cpu)
+	    len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+	else
+	    len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+
+	cpu = last;
+    }
+}
+
+static int read_line(const char *path, char *buf, size_t size)
+{
+    FILE *f;
+    int ret;
+
+    if (!(f = fopen(path, "r")))
+	return -1;
+
+    ret = fgets(buf, size, f) ? 0 : -1;
+    fclose(f);
+
+    return ret;
+}
+
+/* the interface packets to a partition leave through */
+static int route_dev(struct sockaddr_in *to, char *dev, size_t size)
+{
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    struct ifaddrs *ifs, *ifa;
+    int sock, ret = -1;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	return -1;
+
+    /* connecting a datagram socket sends nothing, it only picks the route */
+    if (connect(sock, (struct sockaddr *)to, sizeof(*to)) < 0 ||
+	getsockname(sock, (struct sockaddr *)&local, &len) < 0)
+    {
+	close(sock);
+	return -1;
+    }
+
+    close(sock);
+
+    if (getifaddrs(&ifs) < 0)
+	return -1;
+
+    for (ifa = ifs; ifa; ifa = ifa->ifa_next)
+	if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+	    ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr == local.sin_addr.s_addr)
+	{
+	    snprintf(dev, size, "%s", ifa->ifa_name);
+	    ret = 0;
+	    break;
+	}
+
+    freeifaddrs(ifs);
+
+    return ret;
+}
+
+/* the cpus every interrupt vector of an interface is delivered to, its receive queues among them */
+static void irq_cpus(const char *dev, cpu_set_t *set)
+{
+    char path[PATH_MAX], line[1024];
+    struct dirent *d;
+    DIR *dir;
+
+    CPU_ZERO(set);
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", dev);
+
+    if (!(dir = opendir(path)))
+	return;
+
+    while ((d = readdir(dir)))
+    {
+	cpu_set_t cpus;
+
+	if (!isdigit((unsigned char)d->d_name[0]))
+	    continue;
+
+	/* older kernels only have the mask asked for, not the one in effect */
+	snprintf(path, sizeof(path), "/proc/irq/%s/effective_affinity_list", d->d_name);
+
+	if (read_line(path, line, sizeof(line)) < 0 || line[0] == '\n')
+	{
+	    snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list", d->d_name);
+
+	    if (read_line(path, line, sizeof(line)) < 0)
+		continue;
+	}
+
+	if (!cpulist_parse(line, &cpus))
+	    CPU_OR(set, set, &cpus);
+    }
+
+    closedir(dir);
+}
+
+/* the node a cpu belongs to, -1 without NUMA */
+static int cpu_node(int cpu)
+{
+    char path[PATH_MAX];
+    struct dirent *d;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    if (!(dir = opendir(path)))
+	return -1;
+
+    while ((d = readdir(dir)))
+	if (sscanf(d->d_name, "node%d", &node) == 1)
+	    break;
+
+    closedir(dir);
+
+    return node;
+}
+
+/* the cpus attached to an interface and their node, -1 for a virtual interface */
+static int dev_place(const char *dev, cpu_set_t *cpus, int *node)
+{
+    char path[PATH_MAX], line[1024];
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", dev);
+
+    if (read_line(path, line, sizeof(line)) < 0 || cpulist_parse(line, cpus) < 0)
+	return -1;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", dev);
+
+    /* without NUMA the node is -1 and every cpu is local */
+    *node = read_line(path, line, sizeof(line)) < 0 ? -1 : atoi(line);
+
+    return 0;
+}
+
+/* run the daemon on the cpus next to the interface its partitions are reached through,
+ * or on the cpus given, and take memory it touches from here on from their node.  the
+ * interrupts of the interface are left where they are, they only show where its
+ * packets are received
+ */
+void volume_affinity(struct volume_t *vol, struct volume_opts_t *opts)
+{
+    char dev[IFNAMSIZ] = "";
+    char irqs[AFFINITY_MAX_LIST] = "";
+    cpu_set_t cpus, irq_set;
+    int node = -1, placed = -1;
+
+    if (opts->cpus)
+    {
+	cpulist_parse(opts->cpus, &cpus);
+
+	for (int cpu = 0; cpu < CPU_SETSIZE && node < 0; cpu++)
+	    if (CPU_ISSET(cpu, &cpus))
+		node = cpu_node(cpu);
+    }
+    else
+    {
+	/* the interfaces given with -d, else the one the first partition is routed through */
+	for (int i = 0; i < npaths && placed < 0; i++)
+	    if (paths[i].dev)
+	    {
+		snprintf(dev, sizeof(dev), "%s", paths[i].dev);
+		placed = dev_place(dev, &cpus, &node);
+	    }
+
+	if (!dev[0] && !route_dev(&vol->members[0]->addr, dev, sizeof(dev)))
+	    placed = dev_place(dev, &cpus, &node);
+
+	if (placed < 0)
+	{
+	    syslog(LOG_NOTICE, "no placement known for %s, not pinning", dev[0] ? dev : "the partitions' interface");
+	    return;
+	}
+
+	irq_cpus(dev, &irq_set);
+	cpulist_format(&irq_set, irqs, sizeof(irqs));
+    }
+
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+    {
+	syslog(LOG_WARNING, "sched_setaffinity: %s", strerror(errno));
+	return;
+    }
+
+    /* preferred rather than bound, a full node falls back to the others */
+    if (node >= 0 && node < sizeof(unsigned long) * 8)
+    {
+	unsigned long mask = 1UL << node;
+
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) < 0)
+	    syslog(LOG_WARNING, "set_mempolicy: %s", strerror(errno));
+    }
+
+    cpulist_format(&cpus, placed_cpus, sizeof(placed_cpus));
+    placed_node = node;
+
+    if (dev[0])
+	syslog(LOG_INFO, "%s is on node %d with interrupts on cpus %s, running on cpus %s",
+	    dev, node, irqs[0] ? irqs : "unknown", placed_cpus);
+    else
+	syslog(LOG_INFO, "running on cpus %s, node %d", placed_cpus, node);
+}
+
+const char *affinity_cpus(void)
+{
+    return placed_cpus[0] ? placed_cpus : "all";
+}
+
+int affinity_node(void)
+{
+    return placed_node;
+}
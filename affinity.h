@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_AFFINITY_H__
+#define __PSAN_AFFINITY_H__
+
+#include <sched.h>
+
+#include "volume.h"
+
+/* longest cpu list shown, as 0-3,8-11 */
+#define AFFINITY_MAX_LIST 256
+
+int cpulist_parse(const char *text, cpu_set_t *set);
+void volume_affinity(struct volume_t *vol, struct volume_opts_t *opts);
+const char *affinity_cpus(void);
+int affinity_node(void);
+
+#endif /* __PSAN_AFFINITY_H__ */
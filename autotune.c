@@ -0,0 +1,268 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <syslog.h>
+#include <err.h>
+#include <errno.h>
+
+#include "autotune.h"
+#include "bench.h"
+#include "util.h"
+
+/* the request size an untuned volume sends, see volume_max_io(), a probe that only
+ * reads cannot see write errors so never goes above it
+ */
+#define AUTOTUNE_SAFE_POWER 13
+
+struct tune_t {
+    uint8_t power;
+    unsigned depth;
+};
+
+static void tune_path(char *path, size_t size, char *id)
+{
+    snprintf(path, size, AUTOTUNE_DIR "/%s.tune", id);
+}
+
+static int tune_load(char *id, struct tune_t *tune)
+{
+    char path[PATH_MAX];
+    unsigned request, depth;
+    FILE *f;
+    int n;
+
+    tune_path(path, sizeof(path), id);
+
+    if (!(f = fopen(path, "r")))
+	return -1;
+
+    n = fscanf(f, "request %u depth %u", &request, &depth);
+    fclose(f);
+
+    if (n != 2 || request < (1 << AUTOTUNE_MIN_POWER) || request > (1 << AUTOTUNE_MAX_POWER)
+	|| request & (request-1) || !depth || depth > AUTOTUNE_MAX_DEPTH)
+    {
+	syslog(LOG_WARNING, "ignoring bad tuning file %s", path);
+	return -1;
+    }
+
+    for (tune->power = AUTOTUNE_MIN_POWER; (1U << tune->power) < request; tune->power++)
+	;
+
+    tune->depth = depth;
+
+    return 0;
+}
+
+/* written aside and renamed, so an attach never reads half a file */
+static void tune_save(char *id, struct tune_t *tune)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    FILE *f;
+
+    tune_path(path, sizeof(path), id);
+    snprintf(tmp, sizeof(tmp), AUTOTUNE_DIR "/%s.tune.tmp", id);
+
+    if (mkdir(AUTOTUNE_DIR, 0755) < 0 && errno != EEXIST)
+    {
+	syslog(LOG_WARNING, "mkdir(%s): %s", AUTOTUNE_DIR, strerror(errno));
+	return;
+    }
+
+    if (!(f = fopen(tmp, "w")))
+    {
+	syslog(LOG_WARNING, "fopen(%s): %s", tmp, strerror(errno));
+	return;
+    }
+
+    fprintf(f, "request %u\ndepth %u\n", 1U << tune->power, tune->depth);
+
+    if (fclose(f) < 0 || rename(tmp, path) < 0)
+    {
+	syslog(LOG_WARNING, "saving %s: %s", path, strerror(errno));
+	unlink(tmp);
+    }
+}
+
+static double tune_run(uint8_t power, int write_pct, unsigned depth, struct bench_point_t *point)
+{
+    *point = (struct bench_point_t){
+	.power     = power,
+	.write_pct = write_pct,
+	.depth     = depth
+    };
+
+    bench_run(point, AUTOTUNE_SECONDS);
+
+    return bench_mb(point);
+}
+
+/* the request size moving the most data, then the fewest requests in flight that
+ * come close to the most, then with a scratch range the largest size writes get
+ * through at
+ */
+static void tune_probe(struct target_t *target, uint64_t size, uint64_t from, uint64_t len, struct tune_t *tune)
+{
+    struct bench_point_t point;
+    double rate[AUTOTUNE_MAX_DEPTH], best = 0;
+    uint8_t max_power = len ? AUTOTUNE_MAX_POWER : AUTOTUNE_SAFE_POWER;
+    unsigned depth;
+
+    bench_target(target, size, from, len);
+
+    tune->power = AUTOTUNE_MIN_POWER;
+
+    for (uint8_t power = AUTOTUNE_MIN_POWER; power <= max_power; power++)
+    {
+	double mb = tune_run(power, 0, AUTOTUNE_SIZE_DEPTH, &point);
+
+	if (mb > best)
+	{
+	    best = mb;
+	    tune->power = power;
+	}
+    }
+
+    best = 0;
+
+    for (depth = 1; depth <= AUTOTUNE_MAX_DEPTH; depth *= 2)
+    {
+	rate[depth-1] = tune_run(tune->power, 0, depth, &point);
+
+	if (rate[depth-1] > best)
+	    best = rate[depth-1];
+    }
+
+    for (depth = 1; depth < AUTOTUNE_MAX_DEPTH && rate[depth-1] * 100 < best * AUTOTUNE_KNEE; depth *= 2)
+	;
+
+    tune->depth = depth;
+
+    if (!len)
+	return;
+
+    while (tune->power > AUTOTUNE_MIN_POWER)
+    {
+	tune_run(tune->power, 100, tune->depth, &point);
+
+	if ((point.errors + point.retransmits) * 100 <= point.ops * AUTOTUNE_MAX_LOSS)
+	    break;
+
+	tune->power--;
+    }
+}
+
+/* choose the request size sent to each member and the requests the scheduler keeps
+ * in flight, from values stored by an earlier attach or a fresh probe.  a probe only
+ * reads unless a scratch range of each partition is given as offset,length, and
+ * always runs then so writes are measured.
+ */
+void volume_autotune(struct volume_t *vol, struct volume_opts_t *opts)
+{
+    uint64_t from = 0, len = 0;
+    uint8_t power = AUTOTUNE_MAX_POWER;
+    unsigned depth = 1;
+
+    if (opts->scratch)
+    {
+	char *comma = strchr(opts->scratch, ',');
+
+	if (!comma)
+	    errx(EXIT_FAILURE, "scratch range must be given as offset,length: %s", opts->scratch);
+
+	*comma = '\0';
+	from = parse_bytes(opts->scratch);
+	len = parse_bytes(comma + 1);
+
+	if (!len || from + len > vol->member_size)
+	    errx(EXIT_FAILURE, "scratch range must lie within every partition, %llu bytes",
+		(unsigned long long)vol->member_size);
+    }
+
+    for (unsigned i = 0; i < vol->nmembers; i++)
+    {
+	struct target_t *target = vol->members[i];
+	struct tune_t tune;
+
+	if (len || tune_load(target->id, &tune) < 0)
+	{
+	    tune_probe(target, vol->member_size, from, len, &tune);
+	    tune_save(target->id, &tune);
+	    syslog(LOG_INFO, "%s: probed %u byte requests, %u in flight", target->id, 1U << tune.power, tune.depth);
+	}
+
+	if (tune.power < power)
+	    power = tune.power;
+
+	if (tune.depth > depth)
+	    depth = tune.depth;
+    }
+
+    /* every member gets the smallest size, and the scheduler enough volume requests
+     * to keep the deepest one busy at it
+     */
+    vol->request = 1U << power;
+
+    for (unsigned i = 0; i < vol->nmembers; i++)
+	vol->members[i]->max_len = vol->request;
+
+    vol->max_io = volume_max_io(vol);
+    vol->depth = (uint64_t)depth * vol->nmembers * vol->request / vol->max_io;
+
+    if (vol->depth < 2)
+	vol->depth = 2;
+
+    syslog(LOG_INFO, "autotune: %u byte requests, volume takes %u bytes, %u in flight",
+	vol->request, vol->max_io, vol->depth);
+}
+
+static void queue_set(char *device, char *knob, unsigned value)
+{
+    char filename[PATH_MAX];
+    char buf[16];
+    int sysfs;
+
+    snprintf(filename, sizeof(filename), "/sys/block/%s/queue/%s", device, knob);
+    snprintf(buf, sizeof(buf), "%u", value);
+
+    if ((sysfs = open(filename, O_RDWR)) >= 0)
+    {
+	if (write(sysfs, buf, strlen(buf)) < 0)
+	    warn("write(%s, \"%s\")", filename, buf);
+
+	close(sysfs);
+    }
+}
+
+/* keep kernel requests within what the volume handles well, see volume_max_io(), and
+ * once tuned let read-ahead and the request queue cover the requests kept in flight
+ */
+void volume_queue_limits(struct volume_t *vol, char *device)
+{
+    queue_set(device, "max_sectors_kb", vol->max_io / 1024);
+
+    if (!vol->depth)
+	return;
+
+    queue_set(device, "read_ahead_kb", vol->depth * (vol->max_io / 1024));
+    queue_set(device, "nr_requests", vol->depth * 2);
+}
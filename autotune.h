@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_AUTOTUNE_H__
+#define __PSAN_AUTOTUNE_H__
+
+#include "volume.h"
+
+/* where the values learned for each partition are kept, one file per id */
+#define AUTOTUNE_DIR "/var/lib/ut"
+
+/* seconds each probe runs for, short enough that an attach is not held up */
+#define AUTOTUNE_SECONDS 0.2
+
+/* request sizes probed, as len_power */
+#define AUTOTUNE_MIN_POWER 12
+#define AUTOTUNE_MAX_POWER 15
+
+/* requests in flight while request sizes are compared, and the most probed */
+#define AUTOTUNE_SIZE_DEPTH 8
+#define AUTOTUNE_MAX_DEPTH 64
+
+/* percent of the best throughput a depth must reach to be chosen */
+#define AUTOTUNE_KNEE 90
+
+/* percent of writes lost or failed before a smaller request size is tried */
+#define AUTOTUNE_MAX_LOSS 1
+
+void volume_autotune(struct volume_t *vol, struct volume_opts_t *opts);
+void volume_queue_limits(struct volume_t *vol, char *device);
+
+#endif /* __PSAN_AUTOTUNE_H__ */
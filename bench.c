@@ -0,0 +1,331 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/select.h>
+#include <err.h>
+#include <errno.h>
+
+#include "bench.h"
+#include "psan.h"
+#include "engine.h"
+#include "xdp.h"
+#include "psan_wireformat.h"
+#include "util.h"
+
+/* writes in percent, and requests in flight, swept at every size */
+static const int mixes[] = { 0, 50, 100 };
+static const unsigned depths[] = { 1, 4, 16, 64 };
+
+static struct {
+    struct target_t *target;
+    uint64_t size;
+    uint64_t scratch_from;
+    uint64_t scratch_len;
+    uint8_t pattern[1 << BENCH_MAX_POWER];
+
+    struct bench_point_t *point;
+    unsigned inflight;
+    int stopping;
+    double *rtt;
+    unsigned long nrtt;
+    unsigned long rtt_size;
+} bench;
+
+static void bench_done(struct outstanding_t *out, uint8_t *buf, int len)
+{
+    struct timeval now, *started = out->ctx;
+
+    gettimeofday(&now, NULL);
+
+    if (bench.nrtt == bench.rtt_size)
+    {
+	bench.rtt_size = bench.rtt_size ? bench.rtt_size * 2 : 4096;
+
+	if (!(bench.rtt = realloc(bench.rtt, bench.rtt_size * sizeof(*bench.rtt))))
+	    err(EXIT_FAILURE, "realloc");
+    }
+
+    bench.rtt[bench.nrtt++] = tv2dbl(now) - tv2dbl(*started);
+    bench.point->ops++;
+    bench.inflight--;
+
+    free(started);
+    engine_free(out);
+}
+
+/* random() gives 31 bits, too few to reach every block of a large partition */
+static uint64_t bench_random(uint64_t n)
+{
+    return ((uint64_t)random() << 31 | random()) % n;
+}
+
+static void bench_issue(void)
+{
+    struct bench_point_t *point = bench.point;
+    uint32_t len = 1 << point->power;
+
+    while (!bench.stopping && bench.inflight < point->depth)
+    {
+	int write = random() % 100 < point->write_pct;
+	uint64_t from = write
+	    ? bench.scratch_from + bench_random(bench.scratch_len / len) * len
+	    : bench_random(bench.size / len) * len;
+
+	struct outstanding_t *out = engine_request(bench.target, write ? PSAN_PUT : PSAN_GET,
+	    from >> 9, point->power, write ? bench.pattern : NULL);
+
+	struct timeval *started = dup_struct(struct timeval, 0);
+	gettimeofday(started, NULL);
+
+	out->ctx = started;
+	out->done = bench_done;
+
+	bench.inflight++;
+	engine_submit(out);
+    }
+}
+
+static int compare_rtt(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+    unsigned long i = p / 100 * bench.nrtt;
+
+    return bench.rtt[i < bench.nrtt ? i : bench.nrtt - 1];
+}
+
+static unsigned long lost(void)
+{
+    unsigned long lost = 0;
+
+    for (int i = 0; i < npaths; i++)
+	lost += paths[i].lost;
+
+    return lost;
+}
+
+/* the partition later points run against, writes only land in the scratch range */
+void bench_target(struct target_t *target, uint64_t size, uint64_t scratch_from, uint64_t scratch_len)
+{
+    bench.target = target;
+    bench.size = size & ~(uint64_t)((1 << BENCH_MAX_POWER)-1);
+    bench.scratch_from = scratch_from;
+    bench.scratch_len = scratch_len;
+
+    for (size_t i = 0; i < sizeof(bench.pattern); i++)
+	bench.pattern[i] = random();
+}
+
+double bench_mb(struct bench_point_t *point)
+{
+    return point->seconds ? (point->ops << point->power) / point->seconds / (1 << 20) : 0;
+}
+
+/* keep depth requests in flight for the given seconds, then let them drain */
+void bench_run(struct bench_point_t *point, double seconds)
+{
+    struct timeval start, now, end;
+    unsigned long errors = bench.target->errors, retransmits = lost();
+    fd_set set;
+    int ret;
+
+    bench.point = point;
+    bench.stopping = 0;
+    bench.nrtt = 0;
+
+    gettimeofday(&start, NULL);
+    end = dbl2tv(tv2dbl(start) + seconds);
+
+    for (;;)
+    {
+	gettimeofday(&now, NULL);
+
+	if (!bench.stopping && timercmp(&now, &end, >=))
+	{
+	    bench.stopping = 1;
+	    point->seconds = tv2dbl(now) - tv2dbl(start);
+	}
+
+	if (bench.stopping && !bench.inflight)
+	    break;
+
+	bench_issue();
+
+	engine_poll(&now);
+
+	struct timeval deadline = engine_deadline();
+	double diff = tv2dbl(bench.stopping || timercmp(&deadline, &end, <) ? deadline : end) - tv2dbl(now);
+	struct timeval timeout = dbl2tv(diff < 0.001 ? 0.001 : diff);
+
+	FD_ZERO(&set);
+	int max = engine_fdset(&set);
+
+	if ((ret = _select(max+1, &set, NULL, NULL, &timeout)) < 0)
+	    err(EXIT_FAILURE, "select");
+
+	for (int i = 0; i < npaths; i++)
+	{
+	    uint8_t buf[65536];
+
+	    if (!FD_ISSET(paths[i].sock, &set))
+		continue;
+
+	    if ((ret = _recv(paths[i].sock, buf, sizeof(buf), 0)) < 0)
+		err(EXIT_FAILURE, "recv");
+
+	    gettimeofday(&now, NULL);
+
+	    engine_receive(&paths[i], buf, ret, &now);
+	}
+
+	xdp_receive(&set);
+    }
+
+    point->errors = bench.target->errors - errors;
+    point->retransmits = lost() - retransmits;
+
+    if (!bench.nrtt)
+	return;
+
+    qsort(bench.rtt, bench.nrtt, sizeof(*bench.rtt), compare_rtt);
+
+    double sum = 0;
+
+    for (unsigned long i = 0; i < bench.nrtt; i++)
+	sum += bench.rtt[i];
+
+    point->rtt_min = bench.rtt[0];
+    point->rtt_mean = sum / bench.nrtt;
+    point->rtt_p50 = percentile(50);
+    point->rtt_p90 = percentile(90);
+    point->rtt_p99 = percentile(99);
+    point->rtt_p999 = percentile(99.9);
+    point->rtt_max = bench.rtt[bench.nrtt - 1];
+}
+
+uint64_t parse_bytes(char *arg)
+{
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 0);
+
+    if (end == arg || *end || n & ((1 << BENCH_MAX_POWER)-1))
+	errx(EXIT_FAILURE, "scratch range must be in multiples of %u bytes: %s", 1 << BENCH_MAX_POWER, arg);
+
+    return n;
+}
+
+/* sweep request size, write mix and queue depth against one partition, writes only
+ * land in the scratch range, without one only reads are measured
+ */
+void psan_bench(char *id, char *scratch_from, char *scratch_len)
+{
+    struct part_addr_t *res;
+    struct part_info_t *part_info;
+
+    if (!(res = psan_resolve_id(id)))
+	errx(EXIT_FAILURE, "unable to resolve id: %s", id);
+
+    if (!(part_info = psan_query_part(&res->part_addr)))
+	errx(EXIT_FAILURE, "unable to query partition information: %s", id);
+
+    uint64_t size = part_info->size;
+    uint64_t from = 0, len = 0;
+    struct target_t *target = target_add(id, res);
+
+    free_part_info(part_info);
+    free_part_addr(res);
+
+    if (size > (uint64_t)UINT32_MAX << 9)
+	size = (uint64_t)UINT32_MAX << 9;
+
+    if (size < 1 << BENCH_MAX_POWER)
+	errx(EXIT_FAILURE, "partition too small to benchmark, %llu bytes", (unsigned long long)size);
+
+    if (scratch_from)
+    {
+	from = parse_bytes(scratch_from);
+	len = parse_bytes(scratch_len);
+
+	if (!len || from + len > size)
+	    errx(EXIT_FAILURE, "scratch range must lie within the partition, %llu bytes", (unsigned long long)size);
+    }
+
+    bench_target(target, size, from, len);
+
+    unsigned npoints = 0;
+    struct bench_point_t points[(BENCH_MAX_POWER - BENCH_MIN_POWER + 1) * 3 * 4];
+
+    fprintf(stderr, "%6s %4s %3s %8s %8s %8s %8s %8s %6s %7s\n",
+	"len", "wr%", "qd", "iops", "MB/s", "p50 ms", "p99 ms", "max ms", "err%", "rexmit%");
+
+    for (uint8_t power = BENCH_MIN_POWER; power <= BENCH_MAX_POWER; power++)
+	for (int m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++)
+	    for (int d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+	    {
+		struct bench_point_t *point = &points[npoints];
+
+		if (mixes[m] && !bench.scratch_len)
+		    continue;
+
+		*point = (struct bench_point_t){
+		    .power     = power,
+		    .write_pct = mixes[m],
+		    .depth     = depths[d]
+		};
+
+		bench_run(point, BENCH_SECONDS);
+		npoints++;
+
+		double ops = point->ops ? point->ops : 1;
+
+		fprintf(stderr, "%6u %4d %3u %8.0f %8.2f %8.3f %8.3f %8.3f %6.2f %7.2f\n",
+		    1 << power, point->write_pct, point->depth,
+		    point->ops / point->seconds, bench_mb(point),
+		    point->rtt_p50 * 1000, point->rtt_p99 * 1000, point->rtt_max * 1000,
+		    point->errors * 100 / ops, point->retransmits * 100 / ops);
+	    }
+
+    printf("{\n  \"partition\": \"%s\",\n  \"size\": %llu,\n", id, (unsigned long long)bench.size);
+
+    if (bench.scratch_len)
+	printf("  \"scratch\": { \"offset\": %llu, \"length\": %llu },\n",
+	    (unsigned long long)bench.scratch_from, (unsigned long long)bench.scratch_len);
+
+    printf("  \"seconds_per_point\": %d,\n  \"points\": [\n", BENCH_SECONDS);
+
+    for (unsigned i = 0; i < npoints; i++)
+    {
+	struct bench_point_t *p = &points[i];
+
+	printf("    { \"len\": %u, \"len_power\": %u, \"write_pct\": %d, \"depth\": %u, \"ops\": %lu, "
+	    "\"iops\": %.1f, \"mb_per_s\": %.3f, \"errors\": %lu, \"retransmits\": %lu,\n"
+	    "      \"rtt_ms\": { \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+	    "\"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f } }%s\n",
+	    1 << p->power, p->power, p->write_pct, p->depth, p->ops,
+	    p->ops / p->seconds, bench_mb(p), p->errors, p->retransmits,
+	    p->rtt_min * 1000, p->rtt_mean * 1000, p->rtt_p50 * 1000, p->rtt_p90 * 1000,
+	    p->rtt_p99 * 1000, p->rtt_p999 * 1000, p->rtt_max * 1000, i + 1 < npoints ? "," : "");
+    }
+
+    printf("  ]\n}\n");
+}
@@ -0,0 +1,51 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_BENCH_H__
+#define __PSAN_BENCH_H__
+
+#include <stdint.h>
+
+/* seconds each point of the sweep runs for */
+#define BENCH_SECONDS 1
+
+/* request sizes swept, as len_power */
+#define BENCH_MIN_POWER 9
+#define BENCH_MAX_POWER 15
+
+/* one point of a sweep, filled in by bench_run() */
+struct bench_point_t {
+    uint8_t power;
+    int write_pct;
+    unsigned depth;
+    unsigned long ops;
+    unsigned long errors;
+    unsigned long retransmits;
+    double seconds;
+    double rtt_min, rtt_mean, rtt_p50, rtt_p90, rtt_p99, rtt_p999, rtt_max;
+};
+
+struct target_t;
+
+void bench_target(struct target_t *target, uint64_t size, uint64_t scratch_from, uint64_t scratch_len);
+void bench_run(struct bench_point_t *point, double seconds);
+double bench_mb(struct bench_point_t *point);
+uint64_t parse_bytes(char *arg);
+void psan_bench(char *id, char *scratch_from, char *scratch_len);
+
+#endif /* __PSAN_BENCH_H__ */
@@ -0,0 +1,128 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "bitmap.h"
+#include "util.h"
+
+#define bitmap_bytes(nbits) (((nbits) + 7) / 8)
+
+/* open or create a bitmap file, a NULL path keeps the bitmap in memory only */
+struct bitmap_t *bitmap_open(char *path, uint64_t nbits, uint32_t region_size)
+{
+    struct bitmap_t *bitmap = dup_struct(struct bitmap_t,
+	.nbits       = nbits,
+	.region_size = region_size,
+	.fd          = -1
+    );
+
+    if (!(bitmap->bits = calloc(1, bitmap_bytes(nbits))))
+	err(EXIT_FAILURE, "calloc");
+
+    if (!path)
+	return bitmap;
+
+    if ((bitmap->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+	err(EXIT_FAILURE, "open(%s)", path);
+
+    struct bitmap_header_t header;
+
+    if (pread(bitmap->fd, &header, sizeof(header), 0) == sizeof(header))
+    {
+	if (header.magic != BITMAP_MAGIC || header.nbits != nbits || header.region_size != region_size)
+	    errx(EXIT_FAILURE, "%s: bitmap does not match this volume", path);
+
+	if (pread(bitmap->fd, bitmap->bits, bitmap_bytes(nbits), sizeof(header)) != bitmap_bytes(nbits))
+	    errx(EXIT_FAILURE, "%s: short bitmap", path);
+
+	return bitmap;
+    }
+
+    header = (struct bitmap_header_t){
+	.magic       = BITMAP_MAGIC,
+	.region_size = region_size,
+	.nbits       = nbits
+    };
+
+    if (pwrite(bitmap->fd, &header, sizeof(header), 0) != sizeof(header))
+	err(EXIT_FAILURE, "pwrite(%s)", path);
+
+    bitmap->dirty = 1;
+    bitmap_flush(bitmap);
+
+    return bitmap;
+}
+
+int bitmap_test(struct bitmap_t *bitmap, uint64_t bit)
+{
+    return bitmap->bits[bit / 8] & (1 << (bit % 8));
+}
+
+/* setting a bit is durable before this returns */
+void bitmap_set(struct bitmap_t *bitmap, uint64_t bit)
+{
+    if (bitmap_test(bitmap, bit))
+	return;
+
+    bitmap->bits[bit / 8] |= 1 << (bit % 8);
+
+    if (bitmap->fd < 0)
+	return;
+
+    if (pwrite(bitmap->fd, &bitmap->bits[bit / 8], 1, sizeof(struct bitmap_header_t) + bit / 8) != 1)
+	err(EXIT_FAILURE, "pwrite(bitmap)");
+
+    if (fdatasync(bitmap->fd) < 0)
+	err(EXIT_FAILURE, "fdatasync(bitmap)");
+}
+
+/* clearing a bit reaches the file on the next flush */
+void bitmap_clear(struct bitmap_t *bitmap, uint64_t bit)
+{
+    if (!bitmap_test(bitmap, bit))
+	return;
+
+    bitmap->bits[bit / 8] &= ~(1 << (bit % 8));
+    bitmap->dirty = 1;
+}
+
+int bitmap_empty(struct bitmap_t *bitmap)
+{
+    for (uint64_t i = 0; i < bitmap_bytes(bitmap->nbits); i++)
+	if (bitmap->bits[i])
+	    return 0;
+
+    return 1;
+}
+
+void bitmap_flush(struct bitmap_t *bitmap)
+{
+    if (bitmap->fd < 0 || !bitmap->dirty)
+	return;
+
+    if (pwrite(bitmap->fd, bitmap->bits, bitmap_bytes(bitmap->nbits), sizeof(struct bitmap_header_t)) != bitmap_bytes(bitmap->nbits))
+	err(EXIT_FAILURE, "pwrite(bitmap)");
+
+    if (fdatasync(bitmap->fd) < 0)
+	err(EXIT_FAILURE, "fdatasync(bitmap)");
+
+    bitmap->dirty = 0;
+}
@@ -0,0 +1,48 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_BITMAP_H__
+#define __PSAN_BITMAP_H__
+
+#include <stdint.h>
+
+#define BITMAP_MAGIC 0x50534e42 /* PSNB */
+
+struct bitmap_header_t {
+    uint32_t magic;
+    uint32_t region_size;
+    uint64_t nbits;
+} __attribute__((__packed__));
+
+/* one bit per region, optionally kept in a file */
+struct bitmap_t {
+    uint64_t nbits;
+    uint32_t region_size;
+    uint8_t *bits;
+    int fd;
+    int dirty;
+};
+
+struct bitmap_t *bitmap_open(char *path, uint64_t nbits, uint32_t region_size);
+int bitmap_test(struct bitmap_t *bitmap, uint64_t bit);
+void bitmap_set(struct bitmap_t *bitmap, uint64_t bit);
+void bitmap_clear(struct bitmap_t *bitmap, uint64_t bit);
+int bitmap_empty(struct bitmap_t *bitmap);
+void bitmap_flush(struct bitmap_t *bitmap);
+
+#endif /* __PSAN_BITMAP_H__ */
@@ -0,0 +1,990 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <syslog.h>
+
+#include "cache.h"
+
+#define NONE UINT32_MAX
+
+#define ENTRIES_PER_PAGE (CACHE_BLOCK / sizeof(struct cache_entry_t))
+
+/* a write waiting to be acknowledged */
+struct cache_wait_t {
+    struct io_t *io;
+    TAILQ_ENTRY(cache_wait_t) entries;
+};
+
+/* up to a full PSAN request of adjacent blocks, written back together */
+struct destage_t {
+    struct cache_t *cache;
+    uint64_t block;
+    unsigned nslots;
+    uint32_t slot[PSAN_MAX_LEN / CACHE_BLOCK];
+    uint64_t seq[PSAN_MAX_LEN / CACHE_BLOCK];
+    uint8_t *buf;
+    unsigned pending;
+    int error;
+    struct timeval started;
+};
+
+/* a read missing some blocks, answered by the volume and patched with what the cache holds */
+struct cache_read_t {
+    struct cache_t *cache;
+    struct io_t *io;
+    uint64_t seq;
+
+    /* slots kept from eviction while the volume is read */
+    unsigned npinned;
+    uint32_t pinned[VOLUME_MAX_IO / CACHE_BLOCK + 1];
+};
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    if (!crc_table[1])
+	for (uint32_t i = 0; i < 256; i++)
+	{
+	    uint32_t c = i;
+
+	    for (int k = 0; k < 8; k++)
+		c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+
+	    crc_table[i] = c;
+	}
+
+    crc = ~crc;
+
+    while (len--)
+	crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static uint32_t entry_crc(struct cache_entry_t *entry, const uint8_t *data)
+{
+    uint32_t crc = crc32(0, &entry->block, sizeof(entry->block));
+
+    crc = crc32(crc, &entry->seq, sizeof(entry->seq));
+    crc = crc32(crc, &entry->mask, sizeof(entry->mask));
+
+    return crc32(crc, data, CACHE_BLOCK);
+}
+
+static uint32_t slot_index(struct cache_t *cache, struct cache_slot_t *slot)
+{
+    return slot - cache->slots;
+}
+
+static off_t slot_offset(struct cache_t *cache, uint32_t i)
+{
+    return cache->data_offset + (off_t)i * CACHE_BLOCK;
+}
+
+static uint32_t bucket(struct cache_t *cache, uint64_t block)
+{
+    return (block * 0x9e3779b97f4a7c15ULL >> 32) & cache->hash_mask;
+}
+
+static uint32_t lookup(struct cache_t *cache, uint64_t block)
+{
+    uint32_t i;
+
+    for (i = cache->buckets[bucket(cache, block)]; i != NONE; i = cache->slots[i].next)
+	if (cache->entries[i].block == block)
+	    break;
+
+    return i;
+}
+
+static void hash_insert(struct cache_t *cache, uint32_t i)
+{
+    uint32_t *head = &cache->buckets[bucket(cache, cache->entries[i].block)];
+
+    cache->slots[i].next = *head;
+    *head = i;
+}
+
+static void hash_remove(struct cache_t *cache, uint32_t i)
+{
+    uint32_t *at = &cache->buckets[bucket(cache, cache->entries[i].block)];
+
+    while (*at != i)
+	at = &cache->slots[*at].next;
+
+    *at = cache->slots[i].next;
+}
+
+/* change an entry, it reaches the file on the next commit */
+static void set_entry(struct cache_t *cache, uint32_t i, const struct cache_entry_t *entry)
+{
+    uint32_t page = i / ENTRIES_PER_PAGE;
+
+    cache->entries[i] = *entry;
+
+    if (!cache->page_dirty[page])
+    {
+	cache->page_dirty[page] = 1;
+	cache->pages[cache->npages++] = page;
+    }
+}
+
+/* take a slot off whichever list holds it */
+static void unlist(struct cache_t *cache, uint32_t i)
+{
+    struct cache_slot_t *slot = &cache->slots[i];
+
+    switch (slot->state)
+    {
+	case SLOT_CLEAN:
+	    TAILQ_REMOVE(&cache->clean, slot, entries);
+	    break;
+	case SLOT_DIRTY:
+	    TAILQ_REMOVE(&cache->dirty, slot, entries);
+	    break;
+	case SLOT_RETIRED:
+	    TAILQ_REMOVE(&cache->retired, slot, entries);
+	    break;
+	case SLOT_RETIRING:
+	    TAILQ_REMOVE(&cache->retiring, slot, entries);
+	    break;
+    }
+}
+
+static void set_state(struct cache_t *cache, uint32_t i, enum slot_state_t state)
+{
+    struct cache_slot_t *slot = &cache->slots[i];
+    int was_dirty = slot->state == SLOT_DIRTY || slot->state == SLOT_DESTAGING || slot->state == SLOT_BLOCKED;
+    int dirty = state == SLOT_DIRTY || state == SLOT_DESTAGING || state == SLOT_BLOCKED;
+
+    unlist(cache, i);
+
+    cache->ndirty += dirty - was_dirty;
+    slot->state = state;
+
+    switch (state)
+    {
+	case SLOT_FREE:
+	    cache->free[cache->nfree++] = i;
+	    break;
+	case SLOT_CLEAN:
+	    TAILQ_INSERT_TAIL(&cache->clean, slot, entries);
+	    break;
+	case SLOT_DIRTY:
+	    TAILQ_INSERT_TAIL(&cache->dirty, slot, entries);
+	    break;
+	case SLOT_RETIRED:
+	    TAILQ_INSERT_TAIL(&cache->retired, slot, entries);
+	    break;
+	case SLOT_RETIRING:
+	    TAILQ_INSERT_TAIL(&cache->retiring, slot, entries);
+	    break;
+	default:
+	    break;
+    }
+}
+
+/* a slot stops holding its block, it is reused once nothing on disk could bring it back */
+static void retire(struct cache_t *cache, uint32_t i)
+{
+    hash_remove(cache, i);
+    set_state(cache, i, SLOT_RETIRED);
+}
+
+/* a free slot, or the least recently used clean one */
+static uint32_t alloc_slot(struct cache_t *cache)
+{
+    struct cache_slot_t *slot;
+
+    if (cache->nfree)
+	return cache->free[--cache->nfree];
+
+    TAILQ_FOREACH(slot, &cache->clean, entries)
+	if (!slot->pins)
+	{
+	    uint32_t i = slot_index(cache, slot);
+
+	    hash_remove(cache, i);
+	    unlist(cache, i);
+	    slot->state = SLOT_FREE;
+
+	    return i;
+	}
+
+    return NONE;
+}
+
+static void cache_pread(struct cache_t *cache, void *buf, size_t len, off_t offset)
+{
+    if (pread(cache->fd, buf, len, offset) != len)
+	err(EXIT_FAILURE, "pread(%s)", cache->path);
+}
+
+static void cache_pwrite(struct cache_t *cache, const void *buf, size_t len, off_t offset)
+{
+    if (pwrite(cache->fd, buf, len, offset) != len)
+	err(EXIT_FAILURE, "pwrite(%s)", cache->path);
+
+    cache->data_written = 1;
+}
+
+/* the sectors of a block an io covers */
+static uint8_t block_mask(uint64_t block, uint64_t from, uint64_t to, uint64_t *lo, uint64_t *hi)
+{
+    *lo = from > block * CACHE_BLOCK ? from : block * CACHE_BLOCK;
+    *hi = to < (block + 1) * CACHE_BLOCK ? to : (block + 1) * CACHE_BLOCK;
+
+    uint8_t first = (*lo - block * CACHE_BLOCK) / 512;
+    uint8_t count = (*hi - *lo) / 512;
+
+    return (uint8_t)(((1 << count) - 1) << first);
+}
+
+/* write every block to a fresh slot, the copies they replace stay until the new ones are durable */
+static int cache_write(struct cache_t *cache, struct io_t *io)
+{
+    uint64_t first = io->from / CACHE_BLOCK;
+    uint64_t last = (io->from + io->len - 1) / CACHE_BLOCK;
+    unsigned n = last - first + 1;
+    uint32_t slots[n];
+    uint8_t *data;
+
+    for (unsigned k = 0; k < n; k++)
+	if ((slots[k] = alloc_slot(cache)) == NONE)
+	{
+	    /* evicted slots may still be named on disk */
+	    while (k--)
+		set_state(cache, slots[k], SLOT_RETIRED);
+
+	    return -1;
+	}
+
+    if (!(data = malloc((size_t)n * CACHE_BLOCK)))
+	err(EXIT_FAILURE, "malloc");
+
+    for (unsigned k = 0; k < n; k++)
+    {
+	uint64_t block = first + k;
+	uint64_t lo, hi;
+	uint8_t mask = block_mask(block, io->from, io->from + io->len, &lo, &hi);
+	uint8_t *block_data = data + (size_t)k * CACHE_BLOCK;
+	uint32_t old = lookup(cache, block);
+	enum slot_state_t state = SLOT_DIRTY;
+
+	memset(block_data, 0, CACHE_BLOCK);
+
+	if (old != NONE)
+	{
+	    /* sectors this write leaves alone come from the copy it replaces */
+	    if (cache->entries[old].mask & ~mask)
+		cache_pread(cache, block_data, CACHE_BLOCK, slot_offset(cache, old));
+
+	    mask |= cache->entries[old].mask;
+
+	    /* an older copy still being written back must land first */
+	    if (cache->slots[old].state == SLOT_DESTAGING || cache->slots[old].state == SLOT_BLOCKED)
+		state = SLOT_BLOCKED;
+
+	    retire(cache, old);
+	}
+
+	memcpy(block_data + (lo - block * CACHE_BLOCK), io->buf + (lo - io->from), hi - lo);
+
+	struct cache_entry_t entry = {
+	    .block = block,
+	    .seq   = ++cache->seq,
+	    .mask  = mask,
+	    .flags = CACHE_VALID | CACHE_DIRTY
+	};
+
+	entry.crc = entry_crc(&entry, block_data);
+
+	set_entry(cache, slots[k], &entry);
+	hash_insert(cache, slots[k]);
+	set_state(cache, slots[k], state);
+
+	cache->written_seq[block % CACHE_GHOSTS] = entry.seq;
+    }
+
+    /* slots handed out in order are usually adjacent in the file */
+    for (unsigned k = 0, run; k < n; k += run)
+    {
+	for (run = 1; k + run < n && slots[k + run] == slots[k] + run; run++)
+	    ;
+
+	cache_pwrite(cache, data + (size_t)k * CACHE_BLOCK, (size_t)run * CACHE_BLOCK, slot_offset(cache, slots[k]));
+    }
+
+    free(data);
+
+    cache->written++;
+
+    struct cache_wait_t *wait = dup_struct(struct cache_wait_t, .io = io);
+    TAILQ_INSERT_TAIL(&cache->committing, wait, entries);
+
+    return 0;
+}
+
+/* keep blocks read twice, a single scan does not flush the cache.  what a read sent
+ * at seq returned may be older than a write since, that block is left out
+ */
+static void admit(struct cache_t *cache, struct io_t *io, uint64_t seq)
+{
+    uint64_t first = (io->from + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    uint64_t end = (io->from + io->len) / CACHE_BLOCK;
+
+    for (uint64_t block = first; block < end; block++)
+    {
+	uint64_t *ghost = &cache->ghosts[block % CACHE_GHOSTS];
+	uint8_t *data = io->buf + (block * CACHE_BLOCK - io->from);
+	uint32_t i;
+
+	if (lookup(cache, block) != NONE || cache->written_seq[block % CACHE_GHOSTS] > seq)
+	    continue;
+
+	if (*ghost != block + 1)
+	{
+	    *ghost = block + 1;
+	    continue;
+	}
+
+	if ((i = alloc_slot(cache)) == NONE)
+	    return;
+
+	struct cache_entry_t entry = {
+	    .block = block,
+	    .seq   = ++cache->seq,
+	    .mask  = 0xff,
+	    .flags = CACHE_VALID
+	};
+
+	entry.crc = entry_crc(&entry, data);
+
+	cache_pwrite(cache, data, CACHE_BLOCK, slot_offset(cache, i));
+
+	set_entry(cache, i, &entry);
+	hash_insert(cache, i);
+	set_state(cache, i, SLOT_CLEAN);
+
+	cache->admitted++;
+    }
+}
+
+/* walk the blocks of a read, copying out what the cache holds, or only pinning the slots
+ * holding them into read; returns whether it held it all
+ */
+static int cache_copy(struct cache_t *cache, struct io_t *io, struct cache_read_t *read)
+{
+    uint64_t first = io->from / CACHE_BLOCK;
+    uint64_t last = (io->from + io->len - 1) / CACHE_BLOCK;
+    int all = 1;
+
+    for (uint64_t block = first; block <= last; block++)
+    {
+	uint64_t lo, hi;
+	uint8_t mask = block_mask(block, io->from, io->from + io->len, &lo, &hi);
+	uint32_t i = lookup(cache, block);
+
+	if (i == NONE)
+	{
+	    all = 0;
+	    continue;
+	}
+
+	struct cache_slot_t *slot = &cache->slots[i];
+	uint8_t held = cache->entries[i].mask & mask;
+
+	if (held != mask)
+	    all = 0;
+
+	if (read)
+	{
+	    slot->pins++;
+	    read->pinned[read->npinned++] = i;
+	    continue;
+	}
+
+	/* runs of sectors the cache holds */
+	for (int s = 0; s < CACHE_SECTORS; s++)
+	{
+	    int run = 0;
+
+	    while (s + run < CACHE_SECTORS && held & (1 << (s + run)))
+		run++;
+
+	    if (!run)
+		continue;
+
+	    uint64_t at = block * CACHE_BLOCK + s * 512;
+
+	    cache_pread(cache, io->buf + (at - io->from), run * 512, slot_offset(cache, i) + s * 512);
+	    s += run;
+	}
+
+	if (slot->state == SLOT_CLEAN)
+	{
+	    TAILQ_REMOVE(&cache->clean, slot, entries);
+	    TAILQ_INSERT_TAIL(&cache->clean, slot, entries);
+	}
+    }
+
+    return all;
+}
+
+/* the slots pinned are released, not those holding the blocks now */
+static void unpin(struct cache_t *cache, struct cache_read_t *read)
+{
+    for (unsigned k = 0; k < read->npinned; k++)
+	cache->slots[read->pinned[k]].pins--;
+}
+
+static void read_done(struct io_t *inner)
+{
+    struct cache_read_t *read = inner->ctx;
+    struct cache_t *cache = read->cache;
+    struct io_t *io = read->io;
+
+    /* what the cache holds is newer than anything being written back */
+    cache_copy(cache, io, NULL);
+    unpin(cache, read);
+
+    if (!(io->error = inner->error))
+	admit(cache, io, read->seq);
+
+    free(inner);
+    free(read);
+
+    io->done(io);
+}
+
+static void cache_read(struct cache_t *cache, struct io_t *io)
+{
+    struct cache_read_t *read = dup_struct(struct cache_read_t,
+	.cache = cache,
+	.io    = io,
+	.seq   = cache->seq
+    );
+
+    /* only the blocks named are looked at, so a whole hit costs no more than those */
+    if (cache_copy(cache, io, read))
+    {
+	cache_copy(cache, io, NULL);
+	unpin(cache, read);
+	free(read);
+	cache->hits++;
+	io->done(io);
+	return;
+    }
+
+    cache->misses++;
+
+    struct io_t *inner = dup_struct(struct io_t,
+	.type = IO_READ,
+	.from = io->from,
+	.len  = io->len,
+	.buf  = io->buf,
+	.ctx  = read,
+	.done = read_done
+    );
+
+    volume_submit(cache->vol, inner);
+}
+
+void cache_submit(struct cache_t *cache, struct io_t *io)
+{
+    io->vol = cache->vol;
+    io->error = 0;
+
+    if (io->len & (512-1) || io->from & (512-1) || !io->len || io->from + io->len > cache->vol->size)
+    {
+	io->error = EINVAL;
+	io->done(io);
+	return;
+    }
+
+    if (io->type == IO_READ)
+	cache_read(cache, io);
+    else if (cache_write(cache, io) < 0)
+    {
+	struct cache_wait_t *wait = dup_struct(struct cache_wait_t, .io = io);
+
+	cache->stalls++;
+	TAILQ_INSERT_TAIL(&cache->stalled, wait, entries);
+    }
+}
+
+/* make every write since the last commit durable, then acknowledge them */
+static void commit(struct cache_t *cache)
+{
+    static const struct cache_entry_t cleared;
+    struct cache_slot_t *slot;
+    struct cache_wait_t *wait;
+
+    /* the entries superseding these were made durable by the last commit */
+    TAILQ_FOREACH(slot, &cache->retiring, entries)
+	set_entry(cache, slot_index(cache, slot), &cleared);
+
+    for (uint32_t k = 0; k < cache->npages; k++)
+    {
+	uint32_t page = cache->pages[k];
+	uint64_t n = cache->nslots - (uint64_t)page * ENTRIES_PER_PAGE;
+
+	if (n > ENTRIES_PER_PAGE)
+	    n = ENTRIES_PER_PAGE;
+
+	cache_pwrite(cache, &cache->entries[(uint64_t)page * ENTRIES_PER_PAGE], n * sizeof(struct cache_entry_t),
+	    CACHE_BLOCK + (off_t)page * CACHE_BLOCK);
+
+	cache->page_dirty[page] = 0;
+    }
+
+    cache->npages = 0;
+
+    if (cache->data_written && fdatasync(cache->fd) < 0)
+	err(EXIT_FAILURE, "fdatasync(%s)", cache->path);
+
+    cache->data_written = 0;
+    cache->commits++;
+
+    while ((slot = TAILQ_FIRST(&cache->retiring)))
+	set_state(cache, slot_index(cache, slot), SLOT_FREE);
+
+    /* retired since the last commit, cleared once this commit is known durable */
+    while ((slot = TAILQ_FIRST(&cache->retired)))
+	set_state(cache, slot_index(cache, slot), SLOT_RETIRING);
+
+    while ((wait = TAILQ_FIRST(&cache->committing)))
+    {
+	TAILQ_REMOVE(&cache->committing, wait, entries);
+	wait->io->done(wait->io);
+	free(wait);
+    }
+}
+
+static void retry_stalled(struct cache_t *cache)
+{
+    struct cache_wait_t *wait;
+
+    while ((wait = TAILQ_FIRST(&cache->stalled)))
+    {
+	if (cache_write(cache, wait->io) < 0)
+	    return;
+
+	TAILQ_REMOVE(&cache->stalled, wait, entries);
+	free(wait);
+    }
+}
+
+static void destage(struct cache_t *cache);
+
+static void destage_done(struct io_t *io)
+{
+    struct destage_t *unit = io->ctx;
+    struct cache_t *cache = unit->cache;
+    struct timeval now;
+
+    if (io->error)
+	unit->error = io->error;
+
+    free(io);
+
+    if (--unit->pending)
+	return;
+
+    gettimeofday(&now, NULL);
+
+    double latency = tv2dbl(now) - tv2dbl(unit->started);
+
+    cache->destaging--;
+
+    /* the fastest write back seen creeps up, so one lucky sample does not hold the window down for good */
+    if (!cache->fastest || latency < cache->fastest)
+	cache->fastest = latency;
+    else
+	cache->fastest += (latency - cache->fastest) / 1024;
+
+    /* grow by one per window while the device keeps up, halve at most once a round trip when it slows */
+    if (unit->error || latency > cache->fastest * CACHE_LATENCY_FACTOR)
+    {
+	if (tv2dbl(now) >= cache->backoff_until)
+	{
+	    cache->window = cache->window / 2 < 1 ? 1 : cache->window / 2;
+	    cache->backoff_until = tv2dbl(now) + latency;
+	}
+    }
+    else if ((cache->window += 1 / cache->window) > cache->destage_max)
+	cache->window = cache->destage_max;
+
+    if (unit->error)
+	syslog(LOG_WARNING, "%s: write back of block %llu failed: %s",
+	    cache->path, (unsigned long long)unit->block, strerror(unit->error));
+
+    for (unsigned k = 0; k < unit->nslots; k++)
+    {
+	uint32_t i = unit->slot[k];
+	uint32_t newer;
+
+	/* unless it was replaced meanwhile */
+	if (cache->entries[i].seq == unit->seq[k] && cache->slots[i].state == SLOT_DESTAGING)
+	{
+	    if (unit->error)
+		set_state(cache, i, SLOT_DIRTY);
+	    else
+	    {
+		struct cache_entry_t entry = cache->entries[i];
+
+		entry.flags &= ~CACHE_DIRTY;
+		set_entry(cache, i, &entry);
+		set_state(cache, i, SLOT_CLEAN);
+
+		cache->destaged++;
+	    }
+	}
+
+	/* a newer copy may be waiting for this one to land */
+	if ((newer = lookup(cache, unit->block + k)) != NONE && cache->slots[newer].state == SLOT_BLOCKED)
+	    set_state(cache, newer, SLOT_DIRTY);
+    }
+
+    free(unit->buf);
+    free(unit);
+
+    retry_stalled(cache);
+    destage(cache);
+}
+
+/* whether a block may join a neighbour's write back */
+static int joinable(struct cache_t *cache, uint64_t block)
+{
+    uint32_t i = lookup(cache, block);
+
+    return i != NONE && cache->slots[i].state == SLOT_DIRTY && cache->entries[i].mask == 0xff;
+}
+
+static int by_block(const void *a, const void *b)
+{
+    const struct destage_t *x = *(const struct destage_t **)a, *y = *(const struct destage_t **)b;
+
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* write back the oldest dirty blocks, with their dirty neighbours, as many as the window allows */
+static void destage(struct cache_t *cache)
+{
+    struct destage_t *batch[CACHE_DESTAGE_MAX];
+    struct cache_slot_t *slot;
+    unsigned max = PSAN_MAX_LEN / CACHE_BLOCK;
+    unsigned window = cache->ndirty > cache->nslots * cache->dirty_high ? cache->destage_max : (unsigned)cache->window;
+    unsigned n = 0;
+
+    while (cache->destaging + n < window && (slot = TAILQ_FIRST(&cache->dirty)))
+    {
+	uint32_t i = slot_index(cache, slot);
+	uint64_t start = cache->entries[i].block;
+	uint64_t end = start + 1;
+
+	if (cache->entries[i].mask == 0xff)
+	{
+	    while (start > 0 && end - start < max && joinable(cache, start - 1))
+		start--;
+
+	    while (end - start < max && joinable(cache, end))
+		end++;
+	}
+
+	struct destage_t *unit = dup_struct(struct destage_t,
+	    .cache  = cache,
+	    .block  = start,
+	    .nslots = end - start
+	);
+
+	if (!(unit->buf = malloc((size_t)unit->nslots * CACHE_BLOCK)))
+	    err(EXIT_FAILURE, "malloc");
+
+	for (unsigned k = 0; k < unit->nslots; k++)
+	{
+	    uint32_t j = lookup(cache, start + k);
+
+	    unit->slot[k] = j;
+	    unit->seq[k] = cache->entries[j].seq;
+	    set_state(cache, j, SLOT_DESTAGING);
+
+	    cache_pread(cache, unit->buf + (size_t)k * CACHE_BLOCK, CACHE_BLOCK, slot_offset(cache, j));
+	}
+
+	batch[n++] = unit;
+    }
+
+    /* in order of sector, as an elevator would send them */
+    qsort(batch, n, sizeof(*batch), by_block);
+
+    for (unsigned b = 0; b < n; b++)
+    {
+	struct destage_t *unit = batch[b];
+	uint8_t mask = unit->nslots > 1 ? 0xff : cache->entries[unit->slot[0]].mask;
+	int runs[CACHE_SECTORS][2];
+	int nruns = 0;
+
+	/* a partly written block goes back a run of sectors at a time */
+	for (int s = 0; s < CACHE_SECTORS; s++)
+	    if (mask & (1 << s))
+	    {
+		if (nruns && runs[nruns - 1][0] + runs[nruns - 1][1] == s)
+		    runs[nruns - 1][1]++;
+		else
+		{
+		    runs[nruns][0] = s;
+		    runs[nruns++][1] = 1;
+		}
+	    }
+
+	gettimeofday(&unit->started, NULL);
+	unit->pending = nruns;
+	cache->destaging++;
+
+	for (int r = 0; r < nruns; r++)
+	{
+	    uint32_t len = unit->nslots > 1 ? unit->nslots * CACHE_BLOCK : runs[r][1] * 512;
+	    uint32_t offset = unit->nslots > 1 ? 0 : runs[r][0] * 512;
+
+	    struct io_t *io = dup_struct(struct io_t,
+		.type = IO_WRITE,
+		.from = unit->block * CACHE_BLOCK + offset,
+		.len  = len,
+		.buf  = unit->buf + offset,
+		.ctx  = unit,
+		.done = destage_done
+	    );
+
+	    volume_submit(cache->vol, io);
+	}
+    }
+}
+
+void cache_poll(struct cache_t *cache, struct timeval *now)
+{
+    retry_stalled(cache);
+    destage(cache);
+
+    /* acknowledging may let the scheduler send more writes, they are committed along */
+    while (!TAILQ_EMPTY(&cache->committing) || cache->npages || cache->data_written ||
+	!TAILQ_EMPTY(&cache->retired) || !TAILQ_EMPTY(&cache->retiring))
+    {
+	commit(cache);
+	retry_stalled(cache);
+
+	if (TAILQ_EMPTY(&cache->committing))
+	    break;
+    }
+
+    if (timercmp(&cache->next_report, now, >))
+	return;
+
+    if (cache->hits || cache->misses || cache->written)
+	cache_report(cache);
+
+    cache->next_report = *now;
+    cache->next_report.tv_sec += CACHE_REPORT_INTERVAL;
+}
+
+void cache_report(struct cache_t *cache)
+{
+    syslog(LOG_INFO, "cache: %lu hits, %lu misses, %lu admitted, %lu written, %lu written back, "
+	"%llu of %llu blocks dirty, %lu commits, %lu stalls, window %.1f",
+	cache->hits, cache->misses, cache->admitted, cache->written, cache->destaged,
+	(unsigned long long)cache->ndirty, (unsigned long long)cache->nslots,
+	cache->commits, cache->stalls, cache->window);
+
+    cache->hits = cache->misses = cache->admitted = cache->written = 0;
+    cache->destaged = cache->commits = cache->stalls = 0;
+}
+
+/* keep the newest intact dirty copy of every block, everything else is forgotten */
+static void recover(struct cache_t *cache)
+{
+    uint8_t data[CACHE_BLOCK];
+    uint64_t blocks = (cache->vol->size + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    uint64_t recovered = 0;
+
+    for (uint64_t i = 0; i < cache->nslots; i++)
+    {
+	struct cache_entry_t *entry = &cache->entries[i];
+	uint32_t j;
+
+	if (!(entry->flags & CACHE_VALID) || !(entry->flags & CACHE_DIRTY) || entry->block >= blocks || !entry->mask)
+	{
+	    memset(entry, 0, sizeof(*entry));
+	    continue;
+	}
+
+	/* torn by a crash, so never acknowledged */
+	cache_pread(cache, data, CACHE_BLOCK, slot_offset(cache, i));
+
+	if (entry_crc(entry, data) != entry->crc)
+	{
+	    memset(entry, 0, sizeof(*entry));
+	    continue;
+	}
+
+	if (entry->seq > cache->seq)
+	    cache->seq = entry->seq;
+
+	if ((j = lookup(cache, entry->block)) != NONE)
+	{
+	    if (cache->entries[j].seq > entry->seq)
+	    {
+		memset(entry, 0, sizeof(*entry));
+		continue;
+	    }
+
+	    hash_remove(cache, j);
+	    memset(&cache->entries[j], 0, sizeof(cache->entries[j]));
+	    recovered--;
+	}
+
+	hash_insert(cache, i);
+	recovered++;
+    }
+
+    if (recovered)
+	syslog(LOG_NOTICE, "%s: %llu blocks not yet written back", cache->path, (unsigned long long)recovered);
+}
+
+/* open a cache file or device, recovering what it held for this volume */
+struct cache_t *cache_open(struct volume_t *vol, char *path)
+{
+    struct cache_t *cache = dup_struct(struct cache_t,
+	.vol    = vol,
+	.path        = path,
+	.window      = 4,
+	.destage_max = CACHE_DESTAGE_MAX,
+	.dirty_high  = CACHE_DIRTY_HIGH
+    );
+    struct stat sb;
+    uint64_t size;
+
+    if ((cache->fd = open(path, O_RDWR)) < 0)
+	err(EXIT_FAILURE, "open(%s)", path);
+
+    if (flock(cache->fd, LOCK_EX | LOCK_NB) < 0)
+	errx(EXIT_FAILURE, "%s: cache in use", path);
+
+    if (fstat(cache->fd, &sb) < 0)
+	err(EXIT_FAILURE, "fstat(%s)", path);
+
+    if (S_ISBLK(sb.st_mode))
+    {
+	if (ioctl(cache->fd, BLKGETSIZE64, &size) < 0)
+	    err(EXIT_FAILURE, "ioctl(BLKGETSIZE64)");
+    }
+    else
+	size = sb.st_size;
+
+    /* a header, then a page of entries for every 128 slots, then the slots */
+    uint64_t nslots = size > CACHE_BLOCK ? (size - CACHE_BLOCK) / (CACHE_BLOCK + sizeof(struct cache_entry_t)) : 0;
+    uint64_t meta_pages;
+
+    while (nslots && CACHE_BLOCK * (1 + (nslots + ENTRIES_PER_PAGE - 1) / ENTRIES_PER_PAGE + nslots) > size)
+	nslots--;
+
+    if (nslots < CACHE_MIN_SLOTS)
+	errx(EXIT_FAILURE, "%s: cache too small, at least %u Mb are needed", path,
+	    (unsigned)((CACHE_MIN_SLOTS * (CACHE_BLOCK + sizeof(struct cache_entry_t)) >> 20) + 1));
+
+    meta_pages = (nslots + ENTRIES_PER_PAGE - 1) / ENTRIES_PER_PAGE;
+
+    cache->nslots = nslots;
+    cache->data_offset = CACHE_BLOCK * (1 + meta_pages);
+
+    for (cache->hash_mask = 1; cache->hash_mask < nslots; cache->hash_mask <<= 1)
+	;
+
+    if (!(cache->entries = calloc(meta_pages, CACHE_BLOCK)) ||
+	!(cache->slots = calloc(nslots, sizeof(*cache->slots))) ||
+	!(cache->buckets = malloc(cache->hash_mask * sizeof(*cache->buckets))) ||
+	!(cache->free = malloc(nslots * sizeof(*cache->free))) ||
+	!(cache->page_dirty = calloc(meta_pages, 1)) ||
+	!(cache->pages = malloc(meta_pages * sizeof(*cache->pages))))
+	err(EXIT_FAILURE, "malloc");
+
+    memset(cache->buckets, 0xff, cache->hash_mask * sizeof(*cache->buckets));
+    cache->hash_mask--;
+
+    TAILQ_INIT(&cache->clean);
+    TAILQ_INIT(&cache->dirty);
+    TAILQ_INIT(&cache->retired);
+    TAILQ_INIT(&cache->retiring);
+    TAILQ_INIT(&cache->committing);
+    TAILQ_INIT(&cache->stalled);
+
+    struct cache_header_t header, expected = {
+	.magic       = CACHE_MAGIC,
+	.version     = CACHE_VERSION,
+	.nslots      = nslots,
+	.volume_size = vol->size,
+	.layout      = vol->layout,
+	.unit        = vol->unit,
+	.nmembers    = vol->nmembers
+    };
+
+    snprintf(expected.id, sizeof(expected.id), "%s", vol->members[0]->id);
+
+    if (pread(cache->fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == CACHE_MAGIC)
+    {
+	if (header.version != CACHE_VERSION || header.nslots != nslots)
+	    errx(EXIT_FAILURE, "%s: cache was made with another size or version", path);
+
+	cache_pread(cache, cache->entries, meta_pages * CACHE_BLOCK, CACHE_BLOCK);
+
+	if (memcmp(&header, &expected, sizeof(header)))
+	{
+	    for (uint64_t i = 0; i < nslots; i++)
+		if (cache->entries[i].flags & CACHE_DIRTY)
+		    errx(EXIT_FAILURE, "%s: cache holds data not yet written to another volume", path);
+
+	    syslog(LOG_NOTICE, "%s: cache was used by another volume, starting empty", path);
+	    memset(cache->entries, 0, meta_pages * CACHE_BLOCK);
+	}
+
+	recover(cache);
+    }
+
+    /* handed out from the start of the file, so writes land in runs */
+    for (uint64_t i = nslots; i-- > 0; )
+	set_state(cache, i, cache->entries[i].flags ? SLOT_DIRTY : SLOT_FREE);
+
+    cache_pwrite(cache, &expected, sizeof(expected), 0);
+    cache_pwrite(cache, cache->entries, meta_pages * CACHE_BLOCK, CACHE_BLOCK);
+
+    if (fdatasync(cache->fd) < 0)
+	err(EXIT_FAILURE, "fdatasync(%s)", path);
+
+    cache->data_written = 0;
+
+    syslog(LOG_INFO, "%s: caching %llu Mb", path, (unsigned long long)(nslots * CACHE_BLOCK >> 20));
+
+    return cache;
+}
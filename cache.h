@@ -0,0 +1,155 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_CACHE_H__
+#define __PSAN_CACHE_H__
+
+#include "volume.h"
+
+#define CACHE_MAGIC 0x50534e43 /* PSNC */
+#define CACHE_VERSION 1
+
+/* the cache works in blocks of 8 sectors, each kept in a slot of the cache file */
+#define CACHE_BLOCK 4096
+#define CACHE_SECTORS (CACHE_BLOCK / 512)
+
+/* smallest cache accepted, far more than the blocks of the largest io */
+#define CACHE_MIN_SLOTS 1024
+
+/* destage writes in flight, the window adapts between 1 and this, or a lower cap set at run time */
+#define CACHE_DESTAGE_MAX 32
+
+/* destage writes slower than this multiple of the fastest seen shrink the window */
+#define CACHE_LATENCY_FACTOR 2.0
+
+/* beyond this fraction of dirty slots destage ignores latency */
+#define CACHE_DIRTY_HIGH 0.75
+
+/* blocks remembered after a read miss, a second miss keeps them */
+#define CACHE_GHOSTS 4096
+
+/* seconds between reports of cache statistics */
+#define CACHE_REPORT_INTERVAL 60
+
+struct cache_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nslots;
+    uint64_t volume_size;
+    uint32_t layout;
+    uint32_t unit;
+    uint32_t nmembers;
+    char id[64];
+} __attribute__((__packed__));
+
+#define CACHE_VALID 0x01
+#define CACHE_DIRTY 0x02
+
+/* one per slot, the newest valid dirty entry of a block is recovered after a crash */
+struct cache_entry_t {
+    uint64_t block;
+    uint64_t seq;
+    uint32_t crc;
+    uint8_t mask;
+    uint8_t flags;
+    uint8_t reserved[10];
+} __attribute__((__packed__));
+
+enum slot_state_t {
+    SLOT_FREE,
+    SLOT_CLEAN,
+    SLOT_DIRTY,
+    SLOT_DESTAGING,
+    SLOT_BLOCKED,   /* dirty, behind an older copy still being destaged */
+    SLOT_RETIRED,   /* superseded, its entry is cleared once the newer one is durable */
+    SLOT_RETIRING
+};
+
+struct cache_slot_t {
+    uint32_t next;
+    uint8_t state;
+    uint16_t pins;
+    TAILQ_ENTRY(cache_slot_t) entries;
+};
+
+struct cache_wait_t;
+
+struct cache_t {
+    struct volume_t *vol;
+    char *path;
+    int fd;
+    uint64_t nslots;
+    off_t data_offset;
+
+    struct cache_entry_t *entries;
+    struct cache_slot_t *slots;
+    uint64_t seq;
+
+    /* block to slot */
+    uint32_t *buckets;
+    uint32_t hash_mask;
+
+    uint32_t *free;
+    uint64_t nfree;
+    uint64_t ndirty;
+
+    TAILQ_HEAD(, cache_slot_t) clean;
+    TAILQ_HEAD(, cache_slot_t) dirty;
+    TAILQ_HEAD(, cache_slot_t) retired;
+    TAILQ_HEAD(, cache_slot_t) retiring;
+
+    /* metadata pages changed since the last commit */
+    uint8_t *page_dirty;
+    uint32_t *pages;
+    uint32_t npages;
+    int data_written;
+
+    /* writes waiting for the next commit, and for free slots */
+    TAILQ_HEAD(, cache_wait_t) committing;
+    TAILQ_HEAD(, cache_wait_t) stalled;
+
+    unsigned destaging;
+    double window;
+
+    /* the largest destage window, and the dirty fraction past which it is used regardless */
+    unsigned destage_max;
+    double dirty_high;
+    double fastest;
+    double backoff_until;
+
+    uint64_t ghosts[CACHE_GHOSTS];
+
+    /* seq of the last write to blocks sharing a ghost, a read admits nothing written since it was sent */
+    uint64_t written_seq[CACHE_GHOSTS];
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long admitted;
+    unsigned long written;
+    unsigned long destaged;
+    unsigned long commits;
+    unsigned long stalls;
+    struct timeval next_report;
+};
+
+struct cache_t *cache_open(struct volume_t *vol, char *path);
+void cache_submit(struct cache_t *cache, struct io_t *io);
+void cache_poll(struct cache_t *cache, struct timeval *now);
+void cache_report(struct cache_t *cache);
+
+#endif /* __PSAN_CACHE_H__ */
@@ -0,0 +1,593 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <err.h>
+#include <errno.h>
+
+#include "ctl.h"
+#include "cache.h"
+#include "affinity.h"
+#include "util.h"
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE SO_RCVBUF
+#endif
+
+#ifndef SO_SNDBUFFORCE
+#define SO_SNDBUFFORCE SO_SNDBUF
+#endif
+
+/* knobs one request may name */
+#define CTL_MAX_ARGS 64
+
+#define KNOB_INTEGER      0x01
+#define KNOB_POWER_OF_TWO 0x02
+#define KNOB_CACHE        0x04	/* only with a cache */
+
+/* a knob takes a number from min to max, or the word naming one of them.  one without
+ * set only reports, as text when it has show
+ */
+struct knob_t {
+    const char *name;
+    int flags;
+    double min;
+    double max;
+    const char *const *words;
+    double (*get)(void);
+    void (*set)(double value);
+    const char *(*show)(void);
+};
+
+static struct sched_t *ctl_sched;
+static int ctl_sock = -1;
+static struct sockaddr_un ctl_addr;
+static int log_level = LOG_DEBUG;
+
+static char reply[CTL_MAX_MSG];
+static size_t reply_len;
+
+static const char *const policy_words[] = { "roundrobin", "outstanding", NULL };
+static const char *const level_words[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug", NULL };
+
+static double get_depth(void)
+{
+    return ctl_sched->depth;
+}
+
+static void set_depth(double value)
+{
+    ctl_sched->depth = value;
+}
+
+static double get_read_reserve(void)
+{
+    return ctl_sched->read_reserve;
+}
+
+static void set_read_reserve(double value)
+{
+    ctl_sched->read_reserve = value;
+}
+
+static double get_read_expire(void)
+{
+    return ctl_sched->expire[IO_READ];
+}
+
+static void set_read_expire(double value)
+{
+    ctl_sched->expire[IO_READ] = value;
+}
+
+static double get_write_expire(void)
+{
+    return ctl_sched->expire[IO_WRITE];
+}
+
+static void set_write_expire(double value)
+{
+    ctl_sched->expire[IO_WRITE] = value;
+}
+
+static double get_timeout(void)
+{
+    return request_timeout;
+}
+
+static void set_timeout(double value)
+{
+    engine_set_timeout(value);
+}
+
+static double get_hedge(void)
+{
+    return hedge_percentile;
+}
+
+static void set_hedge(double value)
+{
+    hedge_percentile = value;
+}
+
+static double get_policy(void)
+{
+    return path_policy;
+}
+
+static void set_policy(double value)
+{
+    path_policy = value;
+}
+
+/* the largest request sent to a member, the path may hold it lower still, see engine_max_len() */
+static double get_request(void)
+{
+    struct target_t *target = ctl_sched->vol->members[0];
+
+    return target->max_len ? target->max_len : PSAN_MAX_LEN;
+}
+
+static void set_request(double value)
+{
+    struct volume_t *vol = ctl_sched->vol;
+
+    for (unsigned i = 0; i < vol->nmembers; i++)
+	vol->members[i]->max_len = value;
+}
+
+/* the kernel reports twice what was asked for, the rest is its bookkeeping */
+static double get_sockbuf(void)
+{
+    socklen_t len = sizeof(int);
+    int size;
+
+    if (!npaths || getsockopt(paths[0].sock, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0)
+	return 0;
+
+    return size / 2;
+}
+
+static void set_sockbuf(double value)
+{
+    int size = value;
+
+    /* without CAP_NET_ADMIN the size is capped by net.core.rmem_max and wmem_max */
+    for (int i = 0; i < npaths; i++)
+    {
+	if (setsockopt(paths[i].sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+	    setsockopt(paths[i].sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+	    syslog(LOG_WARNING, "%s: setsockopt(SO_RCVBUF, %d): %s", path_name(&paths[i]), size, strerror(errno));
+
+	if (setsockopt(paths[i].sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0 &&
+	    setsockopt(paths[i].sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+	    syslog(LOG_WARNING, "%s: setsockopt(SO_SNDBUF, %d): %s", path_name(&paths[i]), size, strerror(errno));
+    }
+}
+
+static double get_log_level(void)
+{
+    return log_level;
+}
+
+static void set_log_level(double value)
+{
+    log_level = value;
+    setlogmask(LOG_UPTO(log_level));
+}
+
+static double get_destage(void)
+{
+    return ctl_sched->vol->cache->destage_max;
+}
+
+static void set_destage(double value)
+{
+    struct cache_t *cache = ctl_sched->vol->cache;
+
+    cache->destage_max = value;
+
+    if (cache->window > value)
+	cache->window = value;
+}
+
+static double get_dirty_high(void)
+{
+    return ctl_sched->vol->cache->dirty_high;
+}
+
+static void set_dirty_high(double value)
+{
+    ctl_sched->vol->cache->dirty_high = value;
+}
+
+static double get_node(void)
+{
+    return affinity_node();
+}
+
+static const struct knob_t knobs[] = {
+    { "depth",        KNOB_INTEGER,                     1,     4096,              NULL,         get_depth,        set_depth },
+    { "read_reserve", KNOB_INTEGER,                     0,     4095,              NULL,         get_read_reserve, set_read_reserve },
+    { "read_expire",  0,                                0.001, 60,                NULL,         get_read_expire,  set_read_expire },
+    { "write_expire", 0,                                0.001, 60,                NULL,         get_write_expire, set_write_expire },
+    { "timeout",      0,                                0.05,  60,                NULL,         get_timeout,      set_timeout },
+    { "hedge",        0,                                0,     99.9,              NULL,         get_hedge,        set_hedge },
+    { "policy",       KNOB_INTEGER,                     0,     1,                 policy_words, get_policy,       set_policy },
+    { "request",      KNOB_INTEGER | KNOB_POWER_OF_TWO, 512,   PSAN_MAX_LEN,      NULL,         get_request,      set_request },
+    { "sockbuf",      KNOB_INTEGER,                     65536, 1 << 30,           NULL,         get_sockbuf,      set_sockbuf },
+    { "log_level",    KNOB_INTEGER,                     0,     7,                 level_words,  get_log_level,    set_log_level },
+    { "destage",      KNOB_INTEGER | KNOB_CACHE,        1,     CACHE_DESTAGE_MAX, NULL,         get_destage,      set_destage },
+    { "dirty_high",   KNOB_CACHE,                       0.05,  1,                 NULL,         get_dirty_high,   set_dirty_high },
+    { "cpus",         0,                                0,     0,                 NULL,         NULL,             NULL,             affinity_cpus },
+    { "node",         0,                                0,     0,                 NULL,         get_node,         NULL },
+    { NULL }
+};
+
+static void say(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (reply_len >= sizeof(reply))
+	return;
+
+    va_start(ap, fmt);
+    reply_len += vsnprintf(reply + reply_len, sizeof(reply) - reply_len, fmt, ap);
+    va_end(ap);
+
+    if (reply_len > sizeof(reply))
+	reply_len = sizeof(reply);
+}
+
+/* an answer that is only an error, nothing was changed */
+static void refuse(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    reply_len = snprintf(reply, sizeof(reply), "error: ");
+    reply_len += vsnprintf(reply + reply_len, sizeof(reply) - reply_len, fmt, ap);
+    va_end(ap);
+
+    if (reply_len > sizeof(reply))
+	reply_len = sizeof(reply);
+}
+
+/* a knob of this volume, or why there is none */
+static const struct knob_t *knob_find(const char *name)
+{
+    for (const struct knob_t *knob = knobs; knob->name; knob++)
+	if (!strcmp(knob->name, name))
+	{
+	    if (knob->flags & KNOB_CACHE && !ctl_sched->vol->cache)
+	    {
+		refuse("%s needs a cache, attach with -c\n", name);
+		return NULL;
+	    }
+
+	    return knob;
+	}
+
+    refuse("no such setting: %s\n", name);
+    return NULL;
+}
+
+static int knob_parse(const struct knob_t *knob, const char *text, double *value)
+{
+    char *end;
+
+    for (int i = 0; knob->words && knob->words[i]; i++)
+	if (!strcmp(knob->words[i], text))
+	{
+	    *value = knob->min + i;
+	    return 0;
+	}
+
+    *value = strtod(text, &end);
+
+    /* written this way round so not a number is refused too */
+    if (end == text || *end || !(*value >= knob->min && *value <= knob->max))
+	return -1;
+
+    if (knob->flags & KNOB_INTEGER && *value != (long)*value)
+	return -1;
+
+    if (knob->flags & KNOB_POWER_OF_TWO && (long)*value & ((long)*value - 1))
+	return -1;
+
+    return 0;
+}
+
+static const char *knob_value(const struct knob_t *knob)
+{
+    static char text[32];
+    double value;
+
+    if (knob->show)
+	return knob->show();
+
+    value = knob->get();
+
+    if (knob->words)
+	return knob->words[(int)(value - knob->min)];
+
+    snprintf(text, sizeof(text), "%.15g", value);
+
+    return text;
+}
+
+static void ctl_get(char **names, int n)
+{
+    const struct knob_t *knob;
+
+    for (int i = 0; i < n; i++)
+	if (!knob_find(names[i]))
+	    return;
+
+    if (!n)
+	for (knob = knobs; knob->name; knob++)
+	    if (!(knob->flags & KNOB_CACHE) || ctl_sched->vol->cache)
+		say("%s %s\n", knob->name, knob_value(knob));
+
+    for (int i = 0; i < n; i++)
+	say("%s %s\n", names[i], knob_value(knob_find(names[i])));
+}
+
+/* every value is checked before any is changed, and all of them are changed between
+ * two turns of the event loop, so nothing in flight sees half a request applied
+ */
+static void ctl_set(char **assigns, int n)
+{
+    const struct knob_t *set[CTL_MAX_ARGS];
+    double values[CTL_MAX_ARGS];
+    char *texts[CTL_MAX_ARGS];
+
+    if (!n)
+    {
+	refuse("nothing to set, expected name=value\n");
+	return;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+	if (!(texts[i] = strchr(assigns[i], '=')))
+	{
+	    refuse("expected name=value: %s\n", assigns[i]);
+	    return;
+	}
+
+	*texts[i]++ = 0;
+
+	if (!(set[i] = knob_find(assigns[i])))
+	    return;
+
+	if (!set[i]->set)
+	{
+	    refuse("%s cannot be changed\n", set[i]->name);
+	    return;
+	}
+
+	if (knob_parse(set[i], texts[i], &values[i]) < 0)
+	{
+	    refuse("%s cannot be %s\n", set[i]->name, texts[i]);
+	    return;
+	}
+    }
+
+    for (int i = 0; i < n; i++)
+	set[i]->set(values[i]);
+
+    /* writes keep a slot whichever order depth and reserve were changed in */
+    if (ctl_sched->read_reserve >= ctl_sched->depth)
+	ctl_sched->read_reserve = ctl_sched->depth - 1;
+
+    /* a deeper queue may start requests straight away */
+    sched_plug(ctl_sched);
+    sched_unplug(ctl_sched);
+
+    for (int i = 0; i < n; i++)
+    {
+	syslog(LOG_NOTICE, "%s set to %s", set[i]->name, knob_value(set[i]));
+	say("%s %s\n", set[i]->name, knob_value(set[i]));
+    }
+}
+
+static void ctl_request(char *req)
+{
+    char *args[CTL_MAX_ARGS + 1];
+    int n = 0;
+
+    reply_len = 0;
+
+    for (char *arg = strtok(req, " \t\n"); arg; arg = strtok(NULL, " \t\n"))
+    {
+	if (n == CTL_MAX_ARGS + 1)
+	{
+	    refuse("too many arguments, at most %d\n", CTL_MAX_ARGS);
+	    return;
+	}
+
+	args[n++] = arg;
+    }
+
+    if (!n || !strcmp(args[0], "get"))
+	ctl_get(args + 1, n ? n - 1 : 0);
+    else if (!strcmp(args[0], "set"))
+	ctl_set(args + 1, n - 1);
+    else
+	refuse("unknown command %s, expected get or set\n", args[0]);
+}
+
+static void ctl_close(void)
+{
+    unlink(ctl_addr.sun_path);
+}
+
+/* make the control socket of an attached device, -1 if it cannot be, the device works without one */
+int ctl_open(char *device, struct sched_t *sched)
+{
+    mode_t mask;
+    int ret;
+
+    ctl_sched = sched;
+    ctl_addr.sun_family = AF_UNIX;
+
+    if (snprintf(ctl_addr.sun_path, sizeof(ctl_addr.sun_path), CTL_DIR "/%s.ctl", device) >= sizeof(ctl_addr.sun_path))
+    {
+	syslog(LOG_WARNING, "control socket name too long: %s", device);
+	return -1;
+    }
+
+    if (mkdir(CTL_DIR, 0755) < 0 && errno != EEXIST)
+    {
+	syslog(LOG_WARNING, "mkdir(%s): %s", CTL_DIR, strerror(errno));
+	return -1;
+    }
+
+    if ((ctl_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+    {
+	syslog(LOG_WARNING, "socket(AF_UNIX): %s", strerror(errno));
+	return -1;
+    }
+
+    /* one left by a daemon that did not exit cleanly */
+    unlink(ctl_addr.sun_path);
+
+    /* only root may change how a device runs */
+    mask = umask(077);
+    ret = bind(ctl_sock, (struct sockaddr *)&ctl_addr, sizeof(ctl_addr));
+    umask(mask);
+
+    if (ret < 0)
+    {
+	syslog(LOG_WARNING, "bind(%s): %s", ctl_addr.sun_path, strerror(errno));
+	close(ctl_sock);
+	return ctl_sock = -1;
+    }
+
+    atexit(ctl_close);
+
+    return ctl_sock;
+}
+
+int ctl_fdset(fd_set *set, int max)
+{
+    if (ctl_sock < 0)
+	return max;
+
+    FD_SET(ctl_sock, set);
+
+    return ctl_sock > max ? ctl_sock : max;
+}
+
+/* answer every request waiting, a NULL set checks without one, returns whether there were any */
+int ctl_receive(fd_set *set)
+{
+    char req[CTL_MAX_MSG];
+    struct sockaddr_un from;
+    socklen_t from_len;
+    ssize_t len;
+    int busy = 0;
+
+    if (ctl_sock < 0 || (set && !FD_ISSET(ctl_sock, set)))
+	return 0;
+
+    for (;;)
+    {
+	from_len = sizeof(from);
+
+	if ((len = recvfrom(ctl_sock, req, sizeof(req) - 1, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) < 0)
+	{
+	    if (errno != EAGAIN && errno != EINTR)
+		syslog(LOG_WARNING, "%s: recvfrom: %s", ctl_addr.sun_path, strerror(errno));
+
+	    return busy;
+	}
+
+	req[len] = 0;
+	busy = 1;
+
+	ctl_request(req);
+
+	if (sendto(ctl_sock, reply, reply_len, MSG_DONTWAIT, (struct sockaddr *)&from, from_len) < 0)
+	    syslog(LOG_WARNING, "%s: sendto: %s", ctl_addr.sun_path, strerror(errno));
+    }
+}
+
+/* ut ctl: send one request to the daemon of a device and print its answer */
+void psan_ctl(char *device, char **args, int nargs)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sockaddr_un self = { .sun_family = AF_UNIX };
+    struct timeval timeout = { .tv_sec = CTL_TIMEOUT };
+    char msg[CTL_MAX_MSG];
+    char *name = strrchr(device, '/') ? strrchr(device, '/') + 1 : device;
+    struct stat sb;
+    size_t len = 0;
+    ssize_t ret;
+    int sock;
+
+    /* the socket itself, or the device it controls as nbd0 or /dev/nbd0 */
+    if (!stat(device, &sb) && S_ISSOCK(sb.st_mode))
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", device);
+    else
+	snprintf(addr.sun_path, sizeof(addr.sun_path), CTL_DIR "/%s.ctl", name);
+
+    for (int i = 0; i < nargs; i++)
+    {
+	if (len + strlen(args[i]) + 1 >= sizeof(msg))
+	    errx(EXIT_FAILURE, "request too long");
+
+	len += sprintf(msg + len, "%s%s", i ? " " : "", args[i]);
+    }
+
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+	err(EXIT_FAILURE, "socket");
+
+    /* an address of only the family is given a unique one, for the answer to come back to */
+    if (bind(sock, (struct sockaddr *)&self, sizeof(sa_family_t)) < 0)
+	err(EXIT_FAILURE, "bind");
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	err(EXIT_FAILURE, "%s", addr.sun_path);
+
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+	err(EXIT_FAILURE, "setsockopt(SO_RCVTIMEO)");
+
+    if (send(sock, msg, len, 0) < 0)
+	err(EXIT_FAILURE, "send");
+
+    if ((ret = _recv(sock, msg, sizeof(msg) - 1, 0)) < 0)
+	err(EXIT_FAILURE, "no answer from %s", addr.sun_path);
+
+    msg[ret] = 0;
+    close(sock);
+
+    if (!strncmp(msg, "error: ", 7))
+    {
+	msg[strcspn(msg, "\n")] = 0;
+	errx(EXIT_FAILURE, "%s", msg + 7);
+    }
+
+    fputs(msg, stdout);
+}
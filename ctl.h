@@ -0,0 +1,40 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_CTL_H__
+#define __PSAN_CTL_H__
+
+#include <sys/select.h>
+
+#include "sched.h"
+
+/* where each attached device's control socket is made, as <device>.ctl */
+#define CTL_DIR "/var/run/ut"
+
+/* longest request or answer on the control socket */
+#define CTL_MAX_MSG 4096
+
+/* seconds ut ctl waits for the daemon to answer */
+#define CTL_TIMEOUT 5
+
+int ctl_open(char *device, struct sched_t *sched);
+int ctl_fdset(fd_set *set, int max);
+int ctl_receive(fd_set *set);
+void psan_ctl(char *device, char **args, int nargs);
+
+#endif /* __PSAN_CTL_H__ */
@@ -0,0 +1,408 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dump.h"
+#include "sched.h"
+#include "xdp.h"
+#include "xor.h"
+
+enum xfer_mode_t {
+    XFER_DUMP,
+    XFER_RESTORE,
+    XFER_SYNC
+};
+
+/* a slot of the window, chunks retire in order of offset whichever completes first */
+struct chunk_t {
+    uint8_t *buf;
+    uint8_t *remote;
+    uint32_t len;
+    int busy;
+    int done;
+};
+
+static struct {
+    struct volume_t *vol;
+    struct sched_t *sched;
+    char *file;
+    int fd;
+    enum xfer_mode_t mode;
+    int seekable;
+    int eof;
+
+    uint64_t issued;
+    uint64_t retired;
+    unsigned inflight;
+    struct chunk_t ring[DUMP_WINDOW_MAX];
+
+    /* additive increase, halved once per window when the engine has had to retransmit */
+    double window;
+    unsigned long lost;
+    uint64_t recover;
+
+    uint64_t skipped;
+    struct timeval next_progress;
+} xfer;
+
+static struct chunk_t *chunk_at(uint64_t offset)
+{
+    return &xfer.ring[(offset / DUMP_CHUNK) % DUMP_WINDOW_MAX];
+}
+
+static void adapt(struct io_t *io)
+{
+    unsigned long lost = 0;
+
+    for (int i = 0; i < npaths; i++)
+	lost += paths[i].lost;
+
+    if (lost > xfer.lost)
+    {
+	/* only chunks sent after the last decrease count against the window */
+	if (io->from >= xfer.recover)
+	{
+	    xfer.window = xfer.window / 2 < 1 ? 1 : xfer.window / 2;
+	    xfer.recover = xfer.issued;
+	}
+
+	xfer.lost = lost;
+    }
+    else if ((xfer.window += 1 / xfer.window) > DUMP_WINDOW_MAX)
+	xfer.window = DUMP_WINDOW_MAX;
+}
+
+static void chunk_done(struct io_t *io)
+{
+    struct chunk_t *chunk = io->ctx;
+
+    if (io->error)
+	errx(EXIT_FAILURE, "%s at byte %llu failed: %s", io->type == IO_READ ? "read" : "write",
+	    (unsigned long long)io->from, strerror(io->error));
+
+    adapt(io);
+
+    /* a block read to be compared is only written if it differs */
+    if (xfer.mode == XFER_SYNC && io->type == IO_READ)
+    {
+	if (memcmp(chunk->buf, chunk->remote, chunk->len))
+	{
+	    struct io_t *put = dup_struct(struct io_t,
+		.type = IO_WRITE,
+		.from = io->from,
+		.len  = io->len,
+		.buf  = chunk->buf,
+		.ctx  = chunk,
+		.done = chunk_done
+	    );
+
+	    free(io);
+	    sched_submit(xfer.sched, put);
+	    return;
+	}
+
+	xfer.skipped += chunk->len;
+    }
+
+    chunk->busy = 0;
+    chunk->done = 1;
+    xfer.inflight--;
+
+    free(io);
+}
+
+static void write_all(uint8_t *buf, size_t len)
+{
+    while (len)
+    {
+	ssize_t ret = write(xfer.fd, buf, len);
+
+	if (ret < 0 && errno == EINTR)
+	    continue;
+
+	if (ret < 0)
+	    err(EXIT_FAILURE, "write(%s)", xfer.file);
+
+	buf += ret;
+	len -= ret;
+    }
+}
+
+/* up to len bytes, fewer only at the end of the input */
+static size_t read_all(uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+	ssize_t ret = _read(xfer.fd, buf + got, len - got);
+
+	if (ret < 0)
+	    err(EXIT_FAILURE, "read(%s)", xfer.file);
+
+	if (!ret)
+	    break;
+
+	got += ret;
+    }
+
+    return got;
+}
+
+/* a chunk of the input, or 0 at its end */
+static uint32_t restore_fill(struct chunk_t *chunk)
+{
+    uint32_t len = read_all(chunk->buf, DUMP_CHUNK);
+
+    if (len < DUMP_CHUNK)
+	xfer.eof = 1;
+
+    if (len & (512-1))
+    {
+	warnx("%s: not a whole number of sectors, the last is padded with zeroes", xfer.file);
+
+	memset(chunk->buf + len, 0, 512 - (len & (512-1)));
+	len += 512 - (len & (512-1));
+    }
+
+    if (xfer.issued + len > xfer.vol->size)
+	errx(EXIT_FAILURE, "%s: larger than the volume, %llu bytes", xfer.file, (unsigned long long)xfer.vol->size);
+
+    return len;
+}
+
+static void issue(void)
+{
+    /* requests sent together are scheduled together */
+    sched_plug(xfer.sched);
+
+    while (xfer.inflight < (unsigned)xfer.window && !xfer.eof && !chunk_at(xfer.issued)->busy && !chunk_at(xfer.issued)->done)
+    {
+	struct chunk_t *chunk = chunk_at(xfer.issued);
+	uint32_t len;
+
+	if (xfer.mode != XFER_DUMP)
+	    len = restore_fill(chunk);
+	else
+	{
+	    len = xfer.vol->size - xfer.issued < DUMP_CHUNK ? xfer.vol->size - xfer.issued : DUMP_CHUNK;
+
+	    if (xfer.issued + len == xfer.vol->size)
+		xfer.eof = 1;
+	}
+
+	if (!len)
+	    break;
+
+	struct io_t *io = dup_struct(struct io_t,
+	    .type = xfer.mode == XFER_RESTORE ? IO_WRITE : IO_READ,
+	    .from = xfer.issued,
+	    .len  = len,
+	    .buf  = xfer.mode == XFER_SYNC ? chunk->remote : chunk->buf,
+	    .ctx  = chunk,
+	    .done = chunk_done
+	);
+
+	chunk->len = len;
+	chunk->busy = 1;
+	xfer.issued += len;
+	xfer.inflight++;
+
+	sched_submit(xfer.sched, io);
+    }
+
+    sched_unplug(xfer.sched);
+}
+
+/* completed chunks at the head of the window are written out, zeroes as holes where the output allows */
+static void retire(void)
+{
+    struct chunk_t *chunk;
+
+    while ((chunk = chunk_at(xfer.retired))->done)
+    {
+	if (xfer.mode == XFER_DUMP && xfer.seekable && is_zero(chunk->buf, chunk->len))
+	{
+	    if (lseek(xfer.fd, chunk->len, SEEK_CUR) < 0)
+		err(EXIT_FAILURE, "lseek(%s)", xfer.file);
+
+	    xfer.skipped += chunk->len;
+	}
+	else if (xfer.mode == XFER_DUMP)
+	    write_all(chunk->buf, chunk->len);
+
+	xfer.retired += chunk->len;
+	chunk->done = 0;
+    }
+}
+
+static const char *skipped_as[] = {
+    [XFER_DUMP]    = "of zeroes left as holes",
+    [XFER_RESTORE] = "",
+    [XFER_SYNC]    = "unchanged"
+};
+
+static void progress(struct timeval *now)
+{
+    if (timercmp(&xfer.next_progress, now, >))
+	return;
+
+    if (xfer.next_progress.tv_sec)
+    {
+	fprintf(stderr, "%llu of %llu bytes", (unsigned long long)xfer.retired, (unsigned long long)xfer.vol->size);
+
+	if (xfer.skipped)
+	    fprintf(stderr, ", %llu bytes %s", (unsigned long long)xfer.skipped, skipped_as[xfer.mode]);
+
+	fprintf(stderr, ", window %.0f\n", xfer.window);
+    }
+
+    xfer.next_progress = *now;
+    xfer.next_progress.tv_sec += DUMP_PROGRESS_INTERVAL;
+}
+
+static void transfer(void)
+{
+    struct timeval start, end;
+    fd_set set;
+    int ret;
+
+    xor_init();
+
+    xfer.window = DUMP_WINDOW_START;
+
+    for (int i = 0; i < DUMP_WINDOW_MAX; i++)
+	if (!(xfer.ring[i].buf = malloc(DUMP_CHUNK)) ||
+	    (xfer.mode == XFER_SYNC && !(xfer.ring[i].remote = malloc(DUMP_CHUNK))))
+	    err(EXIT_FAILURE, "malloc");
+
+    gettimeofday(&start, NULL);
+    progress(&start);
+
+    for (;;)
+    {
+	struct timeval now;
+
+	issue();
+	retire();
+
+	if (xfer.eof && !xfer.inflight && xfer.retired == xfer.issued)
+	    break;
+
+	struct timeval timeout = sched_timers(xfer.sched);
+
+	gettimeofday(&now, NULL);
+	progress(&now);
+
+	FD_ZERO(&set);
+	int max = engine_fdset(&set);
+
+	if ((ret = _select(max+1, &set, NULL, NULL, &timeout)) < 0)
+	    err(EXIT_FAILURE, "select");
+
+	for (int i = 0; i < npaths; i++)
+	{
+	    uint8_t buf[65536];
+
+	    if (!FD_ISSET(paths[i].sock, &set))
+		continue;
+
+	    if ((ret = _recv(paths[i].sock, buf, sizeof(buf), 0)) < 0)
+		err(EXIT_FAILURE, "recv");
+
+	    gettimeofday(&now, NULL);
+
+	    engine_receive(&paths[i], buf, ret, &now);
+	}
+
+	xdp_receive(&set);
+    }
+
+    /* a trailing hole still sets the size */
+    if (xfer.mode == XFER_DUMP && xfer.seekable && ftruncate(xfer.fd, xfer.retired) < 0)
+	err(EXIT_FAILURE, "ftruncate(%s)", xfer.file);
+
+    if (xfer.fd != STDIN_FILENO && xfer.fd != STDOUT_FILENO && close(xfer.fd) < 0)
+	err(EXIT_FAILURE, "close(%s)", xfer.file);
+
+    gettimeofday(&end, NULL);
+
+    double elapsed = tv2dbl(end) - tv2dbl(start);
+
+    fprintf(stderr, "%llu bytes in %.1fs, %.1f Mb/s", (unsigned long long)xfer.retired, elapsed,
+	elapsed > 0 ? xfer.retired / elapsed / (1 << 20) : 0);
+
+    if (xfer.skipped)
+	fprintf(stderr, ", %llu bytes %s", (unsigned long long)xfer.skipped, skipped_as[xfer.mode]);
+
+    fprintf(stderr, "\n");
+}
+
+/* stream the whole volume to a file, or to stdout for - */
+void psan_dump(char **ids, int nids, char *file, struct volume_opts_t *opts)
+{
+    struct stat sb;
+
+    xfer.file = file;
+
+    if (!strcmp(file, "-"))
+	xfer.fd = STDOUT_FILENO;
+    else if ((xfer.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	err(EXIT_FAILURE, "open(%s)", file);
+
+    if (fstat(xfer.fd, &sb) < 0)
+	err(EXIT_FAILURE, "fstat(%s)", file);
+
+    xfer.seekable = S_ISREG(sb.st_mode);
+
+    xfer.vol = volume_open(ids, nids, opts);
+    xfer.sched = sched_open(xfer.vol);
+
+    transfer();
+}
+
+/* write a file, or stdin for -, over the start of the volume, or with sync only the blocks that differ */
+void psan_restore(char **ids, int nids, char *file, int sync, struct volume_opts_t *opts)
+{
+    struct stat sb;
+
+    xfer.file = file;
+    xfer.mode = sync ? XFER_SYNC : XFER_RESTORE;
+
+    if (!strcmp(file, "-"))
+	xfer.fd = STDIN_FILENO;
+    else if ((xfer.fd = open(file, O_RDONLY)) < 0)
+	err(EXIT_FAILURE, "open(%s)", file);
+
+    if (fstat(xfer.fd, &sb) < 0)
+	err(EXIT_FAILURE, "fstat(%s)", file);
+
+    xfer.vol = volume_open(ids, nids, opts);
+    xfer.sched = sched_open(xfer.vol);
+
+    /* refused before anything is written where the size is known, a pipe is stopped at the end of the volume */
+    if (S_ISREG(sb.st_mode) && sb.st_size > xfer.vol->size)
+	errx(EXIT_FAILURE, "%s: larger than the volume, %llu bytes", file, (unsigned long long)xfer.vol->size);
+
+    transfer();
+}
@@ -0,0 +1,37 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_DUMP_H__
+#define __PSAN_DUMP_H__
+
+#include "volume.h"
+
+/* bytes moved by each GET or PUT of a dump or restore */
+#define DUMP_CHUNK PSAN_MAX_LEN
+
+/* chunks in flight at most, and at first, the window moves between 1 and the most */
+#define DUMP_WINDOW_MAX 256
+#define DUMP_WINDOW_START 8
+
+/* seconds between progress lines */
+#define DUMP_PROGRESS_INTERVAL 5
+
+void psan_dump(char **ids, int nids, char *file, struct volume_opts_t *opts);
+void psan_restore(char **ids, int nids, char *file, int sync, struct volume_opts_t *opts);
+
+#endif /* __PSAN_DUMP_H__ */
@@ -0,0 +1,813 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <syslog.h>
+
+#include "engine.h"
+#include "xdp.h"
+#include "psan_wireformat.h"
+
+struct path_t paths[MAX_PATHS];
+int npaths = 0;
+enum path_policy_t path_policy = PATH_LEAST_OUTSTANDING;
+
+/* reads slower than this percentile of recent ones are duplicated, 0 is off */
+double hedge_percentile = 0;
+
+/* seconds before an unanswered request is sent again, see engine_set_timeout() for changing it */
+double request_timeout = REQUEST_TIMEOUT;
+
+static double latency[HEDGE_SAMPLES];
+static unsigned long nlatency;
+static double hedge_delay;
+static double hedge_tokens;
+
+static ssize_t plain_sendto(int sock, const void *buf, size_t len, const struct sockaddr_in *to)
+{
+    return _sendto(sock, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/* how packets leave, an event loop may queue them instead */
+ssize_t (*engine_sendto)(int sock, const void *buf, size_t len, const struct sockaddr_in *to) = plain_sendto;
+
+static SLIST_HEAD(, target_t) targets = SLIST_HEAD_INITIALIZER(targets);
+static TAILQ_HEAD(outstanding_head, outstanding_t) outstanding = TAILQ_HEAD_INITIALIZER(outstanding);
+
+void path_add(int sock, char *dev)
+{
+    if (npaths == MAX_PATHS)
+	errx(EXIT_FAILURE, "too many paths, at most %d are supported", MAX_PATHS);
+
+    paths[npaths++] = (struct path_t){ .sock = sock, .dev = dev, .up = 1, .power = PATH_MAX_POWER };
+}
+
+/* the interface a path is bound to, for messages */
+const char *path_name(struct path_t *path)
+{
+    return path->dev ? path->dev : "default";
+}
+
+struct target_t *target_add(char *id, struct part_addr_t *res)
+{
+    struct target_t *target = dup_struct(struct target_t,
+	.id            = id,
+	.root_addr     = res->root_addr,
+	.addr          = res->part_addr,
+	.resolve_after = RESOLVE_AFTER_TIMEOUTS
+    );
+
+    SLIST_INSERT_HEAD(&targets, target, entries);
+    xdp_watch(&target->addr);
+
+    return target;
+}
+
+/* pick the path for the next transmission among those in rotation */
+static struct path_t *choose_path(void)
+{
+    static int next = 0;
+    struct path_t *best = NULL;
+
+    for (int i = 0; i < npaths; i++)
+    {
+	struct path_t *path = &paths[(next + i) % npaths];
+
+	if (!path->up)
+	    continue;
+
+	if (!best || path->outstanding < best->outstanding)
+	    best = path;
+
+	if (path_policy == PATH_ROUND_ROBIN)
+	    break;
+    }
+
+    /* every path is down, keep cycling through all of them */
+    if (!best)
+	best = &paths[next % npaths];
+
+    next = (best - paths + 1) % npaths;
+
+    return best;
+}
+
+static uint8_t request_power(struct outstanding_t *out)
+{
+    return ((struct psan_ctrl_t *)out->psan)->len_power;
+}
+
+/* fragments of the larger datagram a request of 2^power bytes takes, its PUT or its answer */
+static unsigned fragments(uint8_t power)
+{
+    return ((1U << power) + sizeof(struct psan_get_response_t) + 8 + PATH_FRAGMENT - 1) / PATH_FRAGMENT;
+}
+
+/* the chance all n fragments of a datagram arrive, one lost loses it whole */
+static double arrive(double p, unsigned n)
+{
+    double kept = 1;
+
+    while (n--)
+	kept *= 1 - p;
+
+    return kept;
+}
+
+/* the fragment loss that explains the datagrams a window lost, given the sizes it sent */
+static double fragment_loss(struct path_t *path)
+{
+    double lo = 0, hi = 1;
+
+    for (int i = 0; i < 32; i++)
+    {
+	double mid = (lo + hi) / 2, expected = 0;
+
+	for (uint8_t power = 0; power <= PATH_MAX_POWER; power++)
+	    expected += path->window_at[power] * (1 - arrive(mid, fragments(power)));
+
+	if (expected < path->window_lost)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/* bytes one request slot moves per second at a size.  a lost datagram costs a timeout
+ * before it is sent again, so once enough fragments are lost smaller requests win
+ */
+static double goodput(struct path_t *path, double p, uint8_t power)
+{
+    double kept = arrive(p, fragments(power));
+    double rtt = path->srtt ? path->srtt : 0.001;
+
+    return (1U << power) * kept / (rtt + request_timeout * (1 - kept));
+}
+
+/* a request of any size joins the window a path is being judged on */
+static void path_admit(struct path_t *path, struct outstanding_t *out)
+{
+    if (out->flags & OUT_PROBE || request_power(out) > PATH_MAX_POWER || path->window_sent == PATH_LOSS_SAMPLES)
+	return;
+
+    out->flags |= OUT_SAMPLED;
+    out->window = path->window;
+    path->window_sent++;
+}
+
+/* once every request of a window has been answered or lost, the loss of its datagrams
+ * against the fragments each took gives the fragment loss of the path, which predicts
+ * the size moving the most.  a path splits straight down to it, but grows a step at a time
+ */
+static void path_sample(struct outstanding_t *out, int lost)
+{
+    struct path_t *path = out->path;
+    uint8_t power = path->power, best = power;
+    double loss, p;
+
+    if (!(out->flags & OUT_SAMPLED))
+	return;
+
+    out->flags &= ~OUT_SAMPLED;
+
+    if (out->window != path->window)
+	return;
+
+    path->window_lost += lost;
+    path->window_at[request_power(out)]++;
+
+    if (++path->window_done < PATH_LOSS_SAMPLES)
+	return;
+
+    loss = (double)path->window_lost / path->window_done;
+    p = fragment_loss(path);
+
+    path->window++;
+    path->window_sent = path->window_done = path->window_lost = 0;
+    memset(path->window_at, 0, sizeof(path->window_at));
+
+    for (uint8_t size = PATH_MIN_POWER; size <= PATH_MAX_POWER; size++)
+	if (goodput(path, p, size) > goodput(path, p, best) * PATH_SIZE_MARGIN)
+	    best = size;
+
+    if (best == power)
+	return;
+
+    path->power = best < power ? best : power + 1;
+
+    syslog(LOG_NOTICE, "path %s losing %.1f%% of requests, %.2f%% of fragments, %s them to %u bytes",
+	path_name(path), loss * 100, p * 100, best < power ? "splitting" : "growing", 1U << path->power);
+}
+
+/* keep the queue in order of timeout, so engine_poll can stop at the first one still to come */
+static void enqueue(struct outstanding_t *out)
+{
+    struct outstanding_t *prev = TAILQ_LAST(&outstanding, outstanding_head);
+
+    while (prev && timercmp(&prev->timeout, &out->timeout, >))
+	prev = TAILQ_PREV(prev, outstanding_head, entries);
+    if (prev)
+	TAILQ_INSERT_AFTER(&outstanding, prev, out, entries);
+    else
+	TAILQ_INSERT_HEAD(&outstanding, out, entries);
+}
+
+static void record(struct outstanding_t *out)
+{
+    gettimeofday(&out->timeout, NULL);
+    out->timeout = dbl2tv(tv2dbl(out->timeout) + request_timeout);
+
+    out->path->outstanding++;
+    out->target->outstanding++;
+
+    enqueue(out);
+}
+
+/* requests already sent wait no longer than the new timeout allows them from when they were sent */
+void engine_set_timeout(double timeout)
+{
+    struct outstanding_head old = TAILQ_HEAD_INITIALIZER(old);
+    struct outstanding_t *out;
+
+    request_timeout = timeout;
+    while ((out = TAILQ_FIRST(&outstanding)))
+    {
+	TAILQ_REMOVE(&outstanding, out, entries);
+	TAILQ_INSERT_TAIL(&old, out, entries);
+    }
+    while ((out = TAILQ_FIRST(&old)))
+    {
+	struct timeval limit = dbl2tv(tv2dbl(out->sent) + timeout);
+
+	TAILQ_REMOVE(&old, out, entries);
+	if (timercmp(&limit, &out->timeout, <))
+	    out->timeout = limit;
+	enqueue(out);
+    }
+}
+
+static void unrecord(struct outstanding_t *out)
+{
+    TAILQ_REMOVE(&outstanding, out, entries);
+
+    out->path->outstanding--;
+    out->target->outstanding--;
+}
+
+static void transmit(struct outstanding_t *out, struct path_t *path)
+{
+    out->path = path ? path : choose_path();
+    out->path->sent++;
+    path_admit(out->path, out);
+
+    /* a failed send is treated like a lost packet, the timeout will retry it */
+    if (engine_sendto(out->path->sock, out->psan, out->psan_len, &out->target->addr) < 0)
+	syslog(LOG_WARNING, "sendto via %s: %s", path_name(out->path), strerror(errno));
+
+    gettimeofday(&out->sent, NULL);
+
+    record(out);
+}
+
+/* build a GET or PUT of 2^power bytes, PUT data is copied into the packet */
+struct outstanding_t *engine_request(struct target_t *target, uint8_t cmd, uint32_t sector, uint8_t power, uint8_t *data)
+{
+    uint16_t seq = psan_next_seq();
+    void *ptr;
+    int ptr_len;
+
+    if (cmd == PSAN_PUT)
+    {
+	struct psan_put_t *put;
+	ptr_len = sizeof(struct psan_put_t) + (1 << power);
+	if (!(ptr = put = malloc(ptr_len)))
+	    err(EXIT_FAILURE, "malloc");
+	memset(ptr, 0, sizeof(struct psan_put_t));
+
+	put->ctrl = (struct psan_ctrl_t){ .cmd = PSAN_PUT, .seq = htons(seq), .len_power = power };
+	put->sector = htonl(sector);
+	memcpy(put->buffer, data, 1 << power);
+    }
+    else
+    {
+	struct psan_get_t *get;
+	ptr_len = sizeof(struct psan_get_t);
+	if (!(ptr = get = malloc(ptr_len)))
+	    err(EXIT_FAILURE, "malloc");
+	memset(ptr, 0, sizeof(struct psan_get_t));
+
+	get->ctrl = (struct psan_ctrl_t){ .cmd = PSAN_GET, .seq = htons(seq), .len_power = power };
+	get->sector = htonl(sector);
+    }
+
+    return dup_struct(struct outstanding_t,
+	.seq      = seq,
+	.psan     = ptr,
+	.psan_len = ptr_len,
+	.target   = target
+    );
+}
+
+void engine_submit(struct outstanding_t *out)
+{
+    out->retries = 0;
+
+    /* every read earns a fraction of a duplicate */
+    if (hedge_percentile && ((struct psan_ctrl_t *)out->psan)->cmd == PSAN_GET)
+    {
+	hedge_tokens += HEDGE_BUDGET / 100.0;
+
+	if (hedge_tokens > HEDGE_BURST)
+	    hedge_tokens = HEDGE_BURST;
+    }
+
+    transmit(out, NULL);
+}
+
+static struct outstanding_t *remove_outstanding(uint16_t seq)
+{
+    struct outstanding_t *out;
+
+    TAILQ_FOREACH(out, &outstanding, entries)
+    {
+	if (out->seq != seq && !(out->flags & OUT_HEDGED && out->hedge_seq == seq))
+	    continue;
+
+	unrecord(out);
+
+	return out;
+    }
+
+    return NULL;
+}
+
+void engine_free(struct outstanding_t *out)
+{
+    free(out->psan);
+    free(out);
+}
+
+/* the largest request worth sending, limited by the lossiest path in rotation */
+uint32_t engine_max_len(void)
+{
+    uint8_t power = PATH_MAX_POWER;
+
+    for (int i = 0; i < npaths; i++)
+	if (paths[i].up && paths[i].power < power)
+	    power = paths[i].power;
+
+    return 1U << power;
+}
+
+static void path_timeout(struct path_t *path, struct timeval *now)
+{
+    path->lost++;
+
+    /* a single path has nothing to fail over to */
+    if (++path->timeouts < PATH_DOWN_AFTER_TIMEOUTS || !path->up || npaths == 1)
+	return;
+
+    path->up = 0;
+    path->next_probe = *now;
+
+    syslog(LOG_WARNING, "path %s out of rotation after %u timeouts (srtt %.1fms, %lu of %lu lost)",
+	path_name(path), path->timeouts, path->srtt * 1000.0, path->lost, path->sent);
+}
+
+static void path_alive(struct path_t *path, struct outstanding_t *out, struct timeval *now)
+{
+    if (!path->up)
+    {
+	path->up = 1;
+
+	syslog(LOG_NOTICE, "path %s back in rotation", path_name(path));
+    }
+
+    path->timeouts = 0;
+    path->next_probe = *now;
+    path->next_probe.tv_sec += KEEPALIVE_INTERVAL;
+
+    /* only unambiguous samples feed the round trip estimate */
+    if (!out->retries)
+    {
+	double rtt = tv2dbl(*now) - tv2dbl(out->sent);
+	path->srtt = path->srtt ? 0.875 * path->srtt + 0.125 * rtt : rtt;
+    }
+}
+
+/* only an answer to a probe or a request carried out shows the partition is serving again */
+static void target_alive(struct target_t *target)
+{
+    target->timeouts = 0;
+    target->resolve_after = RESOLVE_AFTER_TIMEOUTS;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* note the round trip of a read, the hedging delay is recomputed every so often */
+static void hedge_sample(double rtt)
+{
+    double sorted[HEDGE_SAMPLES];
+    unsigned n, i;
+
+    latency[nlatency++ % HEDGE_SAMPLES] = rtt;
+
+    if (nlatency % (HEDGE_SAMPLES / 8))
+	return;
+
+    n = nlatency < HEDGE_SAMPLES ? nlatency : HEDGE_SAMPLES;
+    memcpy(sorted, latency, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_latency);
+
+    i = n * hedge_percentile / 100;
+    hedge_delay = sorted[i < n ? i : n - 1];
+}
+
+/* a read worth duplicating, once and only while it has not been retransmitted */
+static int hedgeable(struct outstanding_t *out)
+{
+    return !(out->flags & (OUT_PROBE | OUT_HEDGED)) && !out->retries
+	&& ((struct psan_ctrl_t *)out->psan)->cmd == PSAN_GET;
+}
+
+/* send a copy of a slow read under a fresh seq, whichever answer comes first is taken */
+static void hedge(struct outstanding_t *out)
+{
+    struct psan_get_t get = *(struct psan_get_t *)out->psan;
+    struct path_t *path = choose_path();
+
+    out->hedge_seq = psan_next_seq();
+    out->flags |= OUT_HEDGED;
+
+    get.ctrl.seq = htons(out->hedge_seq);
+    path->sent++;
+
+    if (engine_sendto(path->sock, &get, sizeof(get), &out->target->addr) < 0)
+	syslog(LOG_WARNING, "sendto via %s: %s", path_name(path), strerror(errno));
+}
+
+/* send a keepalive IDENTIFY through one path */
+static void probe(struct path_t *path, struct target_t *target)
+{
+    struct psan_identify_t *identify;
+    uint16_t seq = psan_next_seq();
+
+    if (!(identify = malloc(sizeof(*identify))))
+	err(EXIT_FAILURE, "malloc");
+    memset(identify, 0, sizeof(*identify));
+
+    identify->ctrl = (struct psan_ctrl_t){ .cmd = PSAN_IDENTIFY, .seq = htons(seq) };
+
+    transmit(dup_struct(struct outstanding_t,
+	.seq      = seq,
+	.flags    = OUT_PROBE,
+	.psan     = identify,
+	.psan_len = sizeof(*identify),
+	.target   = target
+    ), path);
+}
+
+/* resend everything in flight to a target straight away */
+static void resend_target(struct target_t *target)
+{
+    struct outstanding_t *out = TAILQ_FIRST(&outstanding);
+    struct outstanding_t *last = TAILQ_LAST(&outstanding, outstanding_head);
+
+    while (out)
+    {
+	struct outstanding_t *next = TAILQ_NEXT(out, entries);
+	int done = out == last;
+
+	if (out->target == target)
+	{
+	    unrecord(out);
+
+	    /* an abandoned request says nothing about loss */
+	    if (out->flags & OUT_SAMPLED && out->window == out->path->window)
+		out->path->window_sent--;
+
+	    out->flags &= ~OUT_SAMPLED;
+	    out->retries++;
+	    transmit(out, NULL);
+	}
+
+	if (done)
+	    break;
+
+	out = next;
+    }
+}
+
+void engine_poll(struct timeval *now)
+{
+    struct outstanding_t *out;
+
+    /* resubmit timed out requests, through another path if one is available */
+    while ((out = TAILQ_FIRST(&outstanding)) && timercmp(&out->timeout, now, <=))
+    {
+	int up = out->path->up;
+
+	unrecord(out);
+	path_timeout(out->path, now);
+	path_sample(out, 1);
+
+	/* a path already out of rotation says nothing about the partition,
+	 * nor does a loss the partition has answered since
+	 */
+	if (up && !timercmp(&out->sent, &out->target->last_reply, <))
+	    out->target->timeouts++;
+
+	if (out->flags & OUT_PROBE)
+	{
+	    engine_free(out);
+	    continue;
+	}
+
+	/* the owner may prefer another partition holding the same data */
+	if (out->failover)
+	    out->target = out->failover(out);
+
+	out->retries++;
+	transmit(out, NULL);
+    }
+
+    /* the queue is in order of transmission, the slowest reads come first */
+    if (hedge_delay)
+    {
+	TAILQ_FOREACH(out, &outstanding, entries)
+	{
+	    if (hedge_tokens < 1 || tv2dbl(*now) - tv2dbl(out->sent) < hedge_delay)
+		break;
+
+	    if (!hedgeable(out))
+		continue;
+
+	    hedge_tokens--;
+	    hedge(out);
+	}
+    }
+
+    struct target_t *target;
+
+    SLIST_FOREACH(target, &targets, entries)
+    {
+	if (timerisset(&target->resolve_timeout) && timercmp(&target->resolve_timeout, now, <=))
+	    timerclear(&target->resolve_timeout);
+
+	/* the partition may have a new DHCP address; ask for it without blocking the event loop */
+	if (target->timeouts >= target->resolve_after && !timerisset(&target->resolve_timeout))
+	{
+	    syslog(LOG_WARNING, "%u consecutive timeouts from %s, resolving %s",
+		target->timeouts, inet_ntoa(target->addr.sin_addr), target->id);
+
+	    target->resolve_seq = psan_next_seq();
+
+	    /* broadcast, and ask the root directly in case it is behind a router */
+	    psan_send_resolve(choose_path()->sock, NULL, target->id, target->resolve_seq);
+	    psan_send_resolve(choose_path()->sock, &target->root_addr, target->id, target->resolve_seq);
+	    target->resolve_timeout = *now;
+	    target->resolve_timeout.tv_sec++;
+	}
+    }
+
+    /* a partition that stopped answering and has nothing in flight is probed until it does */
+    SLIST_FOREACH(target, &targets, entries)
+    {
+	if (!target->timeouts || target->outstanding || timercmp(&target->next_probe, now, >))
+	    continue;
+
+	probe(choose_path(), target);
+
+	target->next_probe = *now;
+	target->next_probe.tv_sec += PATH_RETRY_INTERVAL;
+    }
+
+    /* probe idle paths so failures and address changes are noticed before the next request */
+    for (int i = 0; i < npaths; i++)
+    {
+	struct path_t *path = &paths[i];
+
+	if (timercmp(&path->next_probe, now, >) || (path->up && path->outstanding))
+	    continue;
+
+	SLIST_FOREACH(target, &targets, entries)
+	    probe(path, target);
+
+	path->next_probe = *now;
+	path->next_probe.tv_sec += path->up ? KEEPALIVE_INTERVAL : PATH_RETRY_INTERVAL;
+    }
+}
+
+/* handle a resolve response, returns non-zero if the packet was one */
+static int resolved(uint8_t *buf, int len)
+{
+    struct psan_resolve_response_t *resolve = (struct psan_resolve_response_t *)buf;
+    struct target_t *target;
+
+    SLIST_FOREACH(target, &targets, entries)
+    {
+	if (!timerisset(&target->resolve_timeout) || ntohs(resolve->ctrl.seq) != target->resolve_seq)
+	    continue;
+
+	if (resolve->ctrl.cmd != PSAN_RESOLVE_RESPONSE || len != sizeof(struct psan_resolve_response_t))
+	    return 1;
+
+	/* an answer from the root says nothing of the partition, resolve again after as many more */
+	timerclear(&target->resolve_timeout);
+	target->resolve_after = target->timeouts + RESOLVE_AFTER_TIMEOUTS;
+
+	if (resolve->ip4.s_addr == target->addr.sin_addr.s_addr)
+	    return 1;
+
+	char old[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &target->addr.sin_addr, old, sizeof(old));
+	syslog(LOG_NOTICE, "partition %s moved from %s to %s", target->id, old, inet_ntoa(resolve->ip4));
+
+	/* switch destination, take its answers on the fast path too, and resend everything in flight */
+	target->addr.sin_addr = resolve->ip4;
+	xdp_watch(&target->addr);
+	resend_target(target);
+
+	return 1;
+    }
+
+    return 0;
+}
+
+void engine_receive(struct path_t *path, uint8_t *buf, int len, struct timeval *now)
+{
+    struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)buf;
+    struct outstanding_t *out;
+
+    if (len < sizeof(struct psan_ctrl_t))
+	return;
+
+    if (resolved(buf, len))
+	return;
+
+    if (!(out = remove_outstanding(ntohs(ctrl->seq))))
+	return;
+
+    /* the copy answered, the round trip of the original is unknown */
+    if (out->flags & OUT_HEDGED && out->hedge_seq == ntohs(ctrl->seq))
+	out->retries++;
+
+    struct psan_ctrl_t *req = (struct psan_ctrl_t *)out->psan;
+
+    /* credit the path the request went out on, the reply may arrive on another */
+    path_alive(out->path, out, now);
+    path_sample(out, 0);
+    out->target->last_reply = *now;
+
+    if (!out->retries)
+    {
+	double rtt = tv2dbl(*now) - tv2dbl(out->sent);
+	out->target->srtt = out->target->srtt ? 0.875 * out->target->srtt + 0.125 * rtt : rtt;
+
+	if (hedge_percentile && req->cmd == PSAN_GET)
+	    hedge_sample(rtt);
+    }
+
+    if (out->flags & OUT_PROBE)
+    {
+	target_alive(out->target);
+	engine_free(out);
+	return;
+    }
+
+    int error = 1;
+
+    if (req->cmd == PSAN_GET
+	&& ctrl->cmd == PSAN_GET_RESPONSE
+	&& len == sizeof(struct psan_get_response_t) + (1 << req->len_power))
+	error = 0;
+    else if (req->cmd == PSAN_PUT
+	&& ctrl->cmd == PSAN_PUT_RESPONSE)
+	error = 0;
+
+    /* XXX: this is a dodgy hack.
+     * sometimes the SC101 responds with unexpected data,
+     * i find that waiting a bit and resubmitting the exact same request works.
+     * perhaps I should be doing some throttling?
+     */
+    if (error)
+    {
+	out->target->errors++;
+	record(out);
+	return;
+    }
+
+    target_alive(out->target);
+    out->done(out, buf, len);
+}
+
+/* give up on everything in flight to a target, owners see a NULL response */
+void engine_cancel(struct target_t *target)
+{
+    struct outstanding_t *out = TAILQ_FIRST(&outstanding);
+    struct outstanding_t *last = TAILQ_LAST(&outstanding, outstanding_head);
+
+    while (out)
+    {
+	struct outstanding_t *next = TAILQ_NEXT(out, entries);
+	int done = out == last;
+
+	if (out->target == target)
+	{
+	    unrecord(out);
+
+	    if (out->flags & OUT_PROBE)
+		engine_free(out);
+	    else
+		out->done(out, NULL, 0);
+	}
+
+	if (done)
+	    break;
+
+	out = next;
+    }
+}
+
+int engine_fdset(fd_set *set)
+{
+    int max = -1;
+
+    for (int i = 0; i < npaths; i++)
+    {
+	FD_SET(paths[i].sock, set);
+
+	if (paths[i].sock > max)
+	    max = paths[i].sock;
+    }
+
+    return xdp_fdset(set, max);
+}
+
+/* earliest time engine_poll() has work to do */
+struct timeval engine_deadline(void)
+{
+    struct timeval deadline;
+    struct target_t *target;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += KEEPALIVE_INTERVAL;
+
+    if (!TAILQ_EMPTY(&outstanding) && timercmp(&TAILQ_FIRST(&outstanding)->timeout, &deadline, <))
+	deadline = TAILQ_FIRST(&outstanding)->timeout;
+
+    /* the oldest read that may still be duplicated */
+    if (hedge_delay && hedge_tokens >= 1)
+    {
+	struct outstanding_t *out;
+
+	TAILQ_FOREACH(out, &outstanding, entries)
+	{
+	    if (!hedgeable(out))
+		continue;
+
+	    struct timeval hedge_at = dbl2tv(tv2dbl(out->sent) + hedge_delay);
+
+	    if (timercmp(&hedge_at, &deadline, <))
+		deadline = hedge_at;
+	    break;
+	}
+    }
+
+    /* busy paths are not probed */
+    for (int i = 0; i < npaths; i++)
+	if ((!paths[i].up || !paths[i].outstanding) && timercmp(&paths[i].next_probe, &deadline, <))
+	    deadline = paths[i].next_probe;
+
+    SLIST_FOREACH(target, &targets, entries)
+    {
+	if (timerisset(&target->resolve_timeout) && timercmp(&target->resolve_timeout, &deadline, <))
+	    deadline = target->resolve_timeout;
+
+	if (target->timeouts && !target->outstanding && timercmp(&target->next_probe, &deadline, <))
+	    deadline = target->next_probe;
+    }
+
+    return deadline;
+}
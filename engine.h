@@ -0,0 +1,153 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_ENGINE_H__
+#define __PSAN_ENGINE_H__
+
+#include <sys/select.h>
+
+#include "psan.h"
+
+/* local interfaces (sockets) a volume may send through */
+#define MAX_PATHS MAX_INTERFACES
+
+/* consecutive timeouts on a path before it is pulled from rotation */
+#define PATH_DOWN_AFTER_TIMEOUTS 3
+
+/* consecutive timeouts from a partition before its id is resolved again */
+#define RESOLVE_AFTER_TIMEOUTS 3
+
+/* seconds without traffic before an idle path is probed */
+#define KEEPALIVE_INTERVAL 5
+
+/* seconds between probes of a path that is out of rotation */
+#define PATH_RETRY_INTERVAL 1
+
+/* request sizes a path may be held to, as len_power */
+#define PATH_MIN_POWER 9
+#define PATH_MAX_POWER 15
+
+/* UDP bytes each IP fragment carries on an ethernet path */
+#define PATH_FRAGMENT 1480
+
+/* requests a loss estimate is taken over */
+#define PATH_LOSS_SAMPLES 64
+
+/* how much more a size must be expected to move before a path is moved towards it */
+#define PATH_SIZE_MARGIN 1.1
+
+/* seconds before a request without an answer is sent again, unless changed at run time */
+#define REQUEST_TIMEOUT 1
+
+/* recent read round trips the hedging delay is taken from */
+#define HEDGE_SAMPLES 256
+
+/* duplicate reads allowed, in percent of reads, and how many may be saved up */
+#define HEDGE_BUDGET 5
+#define HEDGE_BURST 8
+
+enum path_policy_t {
+    PATH_ROUND_ROBIN,
+    PATH_LEAST_OUTSTANDING
+};
+
+struct path_t {
+    int sock;
+    char *dev;
+    int up;
+    unsigned outstanding;
+    unsigned timeouts;
+    unsigned long sent;
+    unsigned long lost;
+    double srtt;
+    struct timeval next_probe;
+
+    /* the largest request size sent, and a window of requests of any size judged
+     * once every one has been answered or lost, counted by size
+     */
+    uint8_t power;
+    unsigned window;
+    unsigned window_sent;
+    unsigned window_done;
+    unsigned window_lost;
+    unsigned window_at[PATH_MAX_POWER + 1];
+};
+
+struct target_t {
+    char *id;
+    struct sockaddr_in root_addr;
+    struct sockaddr_in addr;
+    unsigned timeouts;
+    unsigned outstanding;
+    unsigned long errors;
+    uint32_t max_len;
+    double srtt;
+    struct timeval last_reply;
+    struct timeval next_probe;
+    uint16_t resolve_seq;
+    unsigned resolve_after;
+    struct timeval resolve_timeout;
+    SLIST_ENTRY(target_t) entries;
+};
+
+#define OUT_PROBE 0x01
+#define OUT_HEDGED 0x02
+#define OUT_SAMPLED 0x04
+
+struct outstanding_t {
+    void *ctx;
+    uint32_t offset;
+    uint16_t seq;
+    uint16_t hedge_seq;
+    int flags;
+    unsigned window;
+    void *psan;
+    int psan_len;
+    struct target_t *target;
+    struct path_t *path;
+    unsigned retries;
+    struct timeval sent;
+    struct timeval timeout;
+    void (*done)(struct outstanding_t *out, uint8_t *buf, int len);
+    struct target_t *(*failover)(struct outstanding_t *out);
+    TAILQ_ENTRY(outstanding_t) entries;
+};
+
+extern struct path_t paths[MAX_PATHS];
+extern int npaths;
+extern enum path_policy_t path_policy;
+extern double hedge_percentile;
+extern double request_timeout;
+extern ssize_t (*engine_sendto)(int sock, const void *buf, size_t len, const struct sockaddr_in *to);
+
+void path_add(int sock, char *dev);
+const char *path_name(struct path_t *path);
+struct target_t *target_add(char *id, struct part_addr_t *res);
+
+struct outstanding_t *engine_request(struct target_t *target, uint8_t cmd, uint32_t sector, uint8_t power, uint8_t *data);
+void engine_free(struct outstanding_t *out);
+void engine_submit(struct outstanding_t *out);
+void engine_poll(struct timeval *now);
+void engine_receive(struct path_t *path, uint8_t *buf, int len, struct timeval *now);
+void engine_cancel(struct target_t *target);
+int engine_fdset(fd_set *set);
+uint32_t engine_max_len(void);
+void engine_set_timeout(double timeout);
+struct timeval engine_deadline(void);
+
+#endif /* __PSAN_ENGINE_H__ */
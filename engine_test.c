@@ -0,0 +1,152 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* engine tests, run by make check.  the network is replaced through engine_sendto:
+ * datagrams are lost fragment by fragment, the rest are answered straight away
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+
+#include "psan.h"
+#include "engine.h"
+#include "psan_wireformat.h"
+#include "util.h"
+
+#define TEST_DEPTH 16
+
+/* ut.c's, psan.c sends discovery through it */
+int sock;
+
+static double fragment_loss;
+static uint8_t replies[TEST_DEPTH * 2][sizeof(struct psan_get_response_t) + (1 << PATH_MAX_POWER)];
+static int reply_lens[TEST_DEPTH * 2];
+static int nreplies;
+static unsigned inflight;
+
+/* drop the larger datagram of the exchange with one chance per fragment, queue the answer otherwise */
+static ssize_t lossy_sendto(int sock, const void *buf, size_t len, const struct sockaddr_in *to)
+{
+    const struct psan_ctrl_t *ctrl = buf;
+    size_t bytes = ctrl->cmd == PSAN_PUT ? len : sizeof(struct psan_get_response_t) + (1U << ctrl->len_power);
+    unsigned fragments = (bytes + 8 + PATH_FRAGMENT - 1) / PATH_FRAGMENT;
+
+    while (fragments--)
+	if (random() < fragment_loss * RAND_MAX)
+	    return len;
+
+    if (nreplies == TEST_DEPTH * 2)
+	errx(EXIT_FAILURE, "more answers queued than requests in flight");
+
+    uint8_t *reply = replies[nreplies];
+
+    if (ctrl->cmd == PSAN_GET)
+    {
+	memcpy(reply, buf, sizeof(struct psan_get_t));
+	((struct psan_ctrl_t *)reply)->cmd = PSAN_GET_RESPONSE;
+	reply_lens[nreplies++] = sizeof(struct psan_get_response_t) + (1U << ctrl->len_power);
+    }
+    else
+    {
+	memset(reply, 0, sizeof(struct psan_put_response_t));
+	*(struct psan_ctrl_t *)reply = (struct psan_ctrl_t){ .cmd = PSAN_PUT_RESPONSE, .seq = ctrl->seq, .len_power = ctrl->len_power };
+	reply_lens[nreplies++] = sizeof(struct psan_put_response_t);
+    }
+
+    return len;
+}
+
+static void test_done(struct outstanding_t *out, uint8_t *buf, int len)
+{
+    inflight--;
+    engine_free(out);
+}
+
+/* 4kb requests through a path losing 5% of fragments, far below the 32kb it starts at,
+ * must still move it to the size that loss favours
+ */
+static int test_lossy_small_requests(void)
+{
+    struct part_addr_t res = { .root_addr.sin_family = AF_INET, .part_addr.sin_family = AF_INET };
+    struct target_t *target;
+    unsigned sent = 0;
+    int socks[2];
+
+    /* the path socket is never read, resolves sent on it go nowhere */
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, socks) < 0)
+	err(EXIT_FAILURE, "socketpair");
+
+    path_add(socks[0], "test0");
+    target = target_add("test", &res);
+
+    engine_sendto = lossy_sendto;
+    engine_set_timeout(0.01);
+    fragment_loss = 0.05;
+    srandom(1);
+
+    while (sent < PATH_LOSS_SAMPLES * 20 || inflight)
+    {
+	struct timeval now;
+
+	for (; inflight < TEST_DEPTH && sent < PATH_LOSS_SAMPLES * 20; sent++, inflight++)
+	{
+	    struct outstanding_t *out = engine_request(target, sent % 4 ? PSAN_GET : PSAN_PUT, sent * 8, 12, replies[0]);
+
+	    out->done = test_done;
+	    engine_submit(out);
+	}
+
+	gettimeofday(&now, NULL);
+
+	for (int i = 0; i < nreplies; i++)
+	    engine_receive(&paths[0], replies[i], reply_lens[i], &now);
+	nreplies = 0;
+
+	engine_poll(&now);
+	usleep(1000);
+    }
+
+    if (engine_max_len() == 1U << PATH_MAX_POWER)
+    {
+	fprintf(stderr, "lossy small requests: path still at %u bytes\n", engine_max_len());
+	return 1;
+    }
+
+    printf("lossy small requests: path moved to %u bytes\n", engine_max_len());
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    openlog("engine_test", LOG_PERROR, LOG_USER);
+
+    failed += test_lossy_small_requests();
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,551 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <syslog.h>
+
+#include "volume.h"
+#include "psan_wireformat.h"
+
+/* one chunk of a write, sent to every replica */
+struct piece_t {
+    struct volume_t *vol;
+    struct io_t *io;
+    uint64_t from;
+    uint32_t len;
+    uint64_t region;
+    unsigned sent;
+    unsigned acks;
+    unsigned outstanding;
+    uint32_t sent_to;
+    uint32_t finished;
+    uint32_t acked;
+    struct outstanding_t *held[MAX_MEMBERS];
+    int completed;
+    TAILQ_ENTRY(piece_t) entries;
+};
+
+/* copy of one region from an in-sync replica to the stale ones */
+struct resync_t {
+    uint64_t region;
+    uint32_t offset;
+    uint32_t generation;
+    uint32_t targets;
+    struct io_t io;
+};
+
+/* writes still in flight to at least one replica */
+static TAILQ_HEAD(, piece_t) pieces = TAILQ_HEAD_INITIALIZER(pieces);
+
+static int member_index(struct volume_t *vol, struct target_t *target)
+{
+    for (int i = 0; i < vol->nmembers; i++)
+	if (vol->members[i] == target)
+	    return i;
+
+    errx(EXIT_FAILURE, "target %s is not a member", target->id);
+}
+
+static uint32_t in_sync(struct volume_t *vol, uint64_t region)
+{
+    uint32_t mask = 0;
+
+    for (int i = 0; i < vol->nmembers; i++)
+	if (!vol->failed[i] && !bitmap_test(vol->stale[i], region))
+	    mask |= 1 << i;
+
+    return mask;
+}
+
+/* replicas that have not yet acknowledged a completed write overlapping the range */
+static uint32_t lagging(struct volume_t *vol, uint64_t from, uint32_t len)
+{
+    struct piece_t *piece;
+    uint32_t mask = 0;
+
+    if (!vol->inflight[from / REGION_SIZE])
+	return 0;
+
+    TAILQ_FOREACH(piece, &pieces, entries)
+	if (piece->vol == vol && piece->completed && from < piece->from + piece->len && piece->from < from + len)
+	    mask |= ~piece->acked;
+
+    return mask;
+}
+
+/* replicas still working on a write queued before `before` that overlaps the range */
+static uint32_t busy(struct volume_t *vol, struct piece_t *before, uint64_t from, uint32_t len)
+{
+    struct piece_t *piece;
+    uint32_t mask = 0;
+
+    TAILQ_FOREACH(piece, &pieces, entries)
+    {
+	if (piece == before)
+	    break;
+
+	if (piece->vol == vol && from < piece->from + piece->len && piece->from < from + len)
+	    mask |= piece->sent_to & ~piece->finished;
+    }
+
+    return mask;
+}
+
+/* send writes that were waiting for an earlier one to finish on a replica */
+static void release(struct volume_t *vol, int member)
+{
+    struct piece_t *piece;
+
+    if (vol->failed[member])
+	return;
+
+    TAILQ_FOREACH(piece, &pieces, entries)
+    {
+	struct outstanding_t *out = piece->held[member];
+
+	if (!out || busy(vol, piece, piece->from, piece->len) & (1 << member))
+	    continue;
+
+	piece->held[member] = NULL;
+	engine_submit(out);
+    }
+}
+
+/* the in-sync replica expected to answer soonest */
+static struct target_t *choose_replica(struct volume_t *vol, uint64_t region, uint32_t exclude)
+{
+    struct target_t *best = NULL;
+    double best_cost = 0;
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	struct target_t *target = vol->members[i];
+
+	if (vol->failed[i] || exclude & (1 << i) || bitmap_test(vol->stale[i], region))
+	    continue;
+
+	/* unmeasured replicas are tried at 1ms, recent timeouts weigh heavily */
+	double cost = (target->srtt ? target->srtt : 0.001) * (1 + target->outstanding) * (1 + 4 * target->timeouts);
+
+	if (!best || cost < best_cost)
+	{
+	    best = target;
+	    best_cost = cost;
+	}
+    }
+
+    return best;
+}
+
+/* a read timed out, move it to a better replica if there is one */
+static struct target_t *read_failover(struct outstanding_t *out)
+{
+    struct io_t *io = out->ctx;
+    struct volume_t *vol = io->vol;
+    uint64_t from = io->from + out->offset;
+    struct target_t *target;
+
+    target = choose_replica(vol, from / REGION_SIZE, lagging(vol, from, 1 << ((struct psan_ctrl_t *)out->psan)->len_power) | 1 << member_index(vol, out->target));
+
+    if (!target || target->timeouts >= out->target->timeouts)
+	return out->target;
+
+    return target;
+}
+
+static void read_done(struct outstanding_t *out, uint8_t *buf, int len)
+{
+    struct io_t *io = out->ctx;
+    struct volume_t *vol = io->vol;
+
+    /* the replica was failed with this read in flight, try another */
+    if (!buf)
+    {
+	uint64_t from = io->from + out->offset;
+	struct target_t *target = choose_replica(vol, from / REGION_SIZE, lagging(vol, from, 1 << ((struct psan_ctrl_t *)out->psan)->len_power));
+
+	if (target)
+	{
+	    out->target = target;
+	    engine_submit(out);
+	    return;
+	}
+    }
+
+    volume_complete(out, buf, len);
+}
+
+/* requests may not cross a region, and go to every replica or to any, so the smallest limit holds */
+static uint32_t mirror_limit(struct volume_t *vol, uint64_t from)
+{
+    uint32_t limit = REGION_SIZE - from % REGION_SIZE;
+
+    for (int i = 0; i < vol->nmembers; i++)
+	if (volume_limit(vol->members[i]) < limit)
+	    limit = volume_limit(vol->members[i]);
+
+    return limit;
+}
+
+static void mirror_read(struct volume_t *vol, struct io_t *io)
+{
+    uint32_t offset = 0;
+
+    while (offset < io->len)
+    {
+	uint64_t from = io->from + offset;
+	uint8_t power = volume_power(io->len - offset, mirror_limit(vol, from));
+	struct target_t *target;
+
+	if (!(target = choose_replica(vol, from / REGION_SIZE, lagging(vol, from, 1 << power))))
+	{
+	    io->error = EIO;
+	    return;
+	}
+
+	struct outstanding_t *out = engine_request(target, PSAN_GET, from >> 9, power, NULL);
+
+	out->ctx = io;
+	out->offset = offset;
+	out->done = read_done;
+	out->failover = read_failover;
+
+	io->pending++;
+	engine_submit(out);
+
+	offset += 1 << power;
+    }
+}
+
+static void piece_done(struct piece_t *piece)
+{
+    struct volume_t *vol = piece->vol;
+
+    TAILQ_REMOVE(&pieces, piece, entries);
+    vol->inflight[piece->region]--;
+
+    free(piece);
+}
+
+static void write_done(struct outstanding_t *out, uint8_t *buf, int len)
+{
+    struct piece_t *piece = out->ctx;
+    struct volume_t *vol = piece->vol;
+    int member = member_index(vol, out->target);
+
+    engine_free(out);
+    piece->outstanding--;
+    piece->finished |= 1 << member;
+
+    if (buf)
+    {
+	piece->acks++;
+	piece->acked |= 1 << member;
+    }
+    else
+	volume_mark_stale(vol, member, piece->region);
+
+    /* the write is done once a quorum of the replicas it reached have it,
+     * one of them in sync so reads of the rest of the region can see it
+     */
+    if (!piece->completed && ((piece->acks >= vol->quorum && in_sync(vol, piece->region) & piece->acked) || !piece->outstanding))
+    {
+	if (!piece->acks)
+	    piece->io->error = EIO;
+
+	piece->completed = 1;
+	io_finish(piece->io);
+    }
+
+    if (!piece->outstanding)
+	piece_done(piece);
+
+    release(vol, member);
+}
+
+static void mirror_write(struct volume_t *vol, struct io_t *io)
+{
+    uint32_t offset = 0;
+
+    while (offset < io->len)
+    {
+	uint64_t from = io->from + offset;
+	uint8_t power = volume_power(io->len - offset, mirror_limit(vol, from));
+	uint64_t region = from / REGION_SIZE;
+
+	/* a retransmit of an earlier write could land after this one, so it waits */
+	uint32_t wait = vol->inflight[region] ? busy(vol, NULL, from, 1 << power) : 0;
+
+	struct piece_t *piece = dup_struct(struct piece_t,
+	    .vol    = vol,
+	    .io     = io,
+	    .from   = from,
+	    .len    = 1 << power,
+	    .region = region
+	);
+
+	/* the intent must be on disk before any replica can diverge */
+	bitmap_set(vol->intent, region);
+	vol->inflight[region]++;
+	vol->generation[region]++;
+
+	TAILQ_INSERT_TAIL(&pieces, piece, entries);
+
+	for (int i = 0; i < vol->nmembers; i++)
+	{
+	    if (vol->failed[i])
+	    {
+		volume_mark_stale(vol, i, region);
+		continue;
+	    }
+
+	    struct outstanding_t *out = engine_request(vol->members[i], PSAN_PUT, from >> 9, power, io->buf + offset);
+
+	    out->ctx = piece;
+	    out->done = write_done;
+
+	    piece->sent++;
+	    piece->sent_to |= 1 << i;
+	    piece->outstanding++;
+
+	    if (wait & (1 << i))
+		piece->held[i] = out;
+	    else
+		engine_submit(out);
+	}
+
+	if (piece->sent)
+	    io->pending++;
+	else
+	{
+	    io->error = EIO;
+	    piece_done(piece);
+	}
+
+	offset += 1 << power;
+    }
+}
+
+void mirror_submit(struct volume_t *vol, struct io_t *io)
+{
+    if (io->type == IO_READ)
+	mirror_read(vol, io);
+    else
+	mirror_write(vol, io);
+}
+
+void mirror_open(struct volume_t *vol, char *bitmap)
+{
+    volume_regions(vol, bitmap);
+
+    if (bitmap_empty(vol->intent))
+	return;
+
+    /* writes were in flight when we last stopped, make the replicas agree with the first
+     * one that missed none of them
+     */
+    uint64_t dirty = 0;
+
+    for (uint64_t region = 0; region < vol->nregions; region++)
+    {
+	int source;
+
+	if (!bitmap_test(vol->intent, region))
+	    continue;
+
+	for (source = 0; source < vol->nmembers; source++)
+	    if (!bitmap_test(vol->stale[source], region))
+		break;
+
+	if (source == vol->nmembers)
+	    errx(EXIT_FAILURE, "every partition missed writes to region %llu, none is known current",
+		(unsigned long long)region);
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (i != source)
+		volume_mark_stale(vol, i, region);
+
+	dirty++;
+    }
+
+    syslog(LOG_NOTICE, "write-intent bitmap has %llu dirty regions, resyncing from the replicas current in each",
+	(unsigned long long)dirty);
+}
+
+static void resync_end(struct volume_t *vol, struct resync_t *resync, int copied)
+{
+    /* a write that raced with the copy leaves the region stale for another pass */
+    if (copied && vol->generation[resync->region] == resync->generation)
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (resync->targets & (1 << i))
+		bitmap_clear(vol->stale[i], resync->region);
+
+    vol->resync_wanted = 1;
+    vol->resync = NULL;
+
+    free(resync->io.buf);
+    free(resync);
+}
+
+static void resync_read(struct io_t *io);
+
+/* read the next step of the region from an in-sync replica */
+static void resync_step(struct volume_t *vol, struct resync_t *resync)
+{
+    struct io_t *io = &resync->io;
+    uint64_t start = resync->region * REGION_SIZE;
+    uint64_t end = vol->size - start < REGION_SIZE ? vol->size : start + REGION_SIZE;
+    struct target_t *source;
+
+    if (resync->offset == end - start || !resync->targets)
+    {
+	resync_end(vol, resync, resync->targets != 0);
+	return;
+    }
+
+    if (vol->generation[resync->region] != resync->generation || !(source = choose_replica(vol, resync->region, 0)))
+    {
+	resync_end(vol, resync, 0);
+	return;
+    }
+
+    io->type = IO_READ;
+    io->from = start + resync->offset;
+    io->len = end - io->from < RESYNC_STEP ? end - io->from : RESYNC_STEP;
+    io->done = resync_read;
+    io->pending = 1;
+
+    volume_issue(io, source, io->from, 0, io->len);
+    io_finish(io);
+}
+
+static void resync_written(struct io_t *io)
+{
+    struct resync_t *resync = io->ctx;
+
+    if (io->error)
+    {
+	resync_end(io->vol, resync, 0);
+	return;
+    }
+
+    resync->offset += io->len;
+    resync_step(io->vol, resync);
+}
+
+static void resync_read(struct io_t *io)
+{
+    struct resync_t *resync = io->ctx;
+    struct volume_t *vol = io->vol;
+
+    if (io->error)
+    {
+	resync_end(vol, resync, 0);
+	return;
+    }
+
+    /* write the step to every stale replica still up */
+    io->type = IO_WRITE;
+    io->done = resync_written;
+    io->pending = 1;
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	if (!(resync->targets & (1 << i)))
+	    continue;
+
+	/* a replica failed during the copy stays stale */
+	if (vol->failed[i])
+	    resync->targets &= ~(1 << i);
+	else
+	    volume_issue(io, vol->members[i], io->from, 0, io->len);
+    }
+
+    io_finish(io);
+}
+
+/* start copying the next region some replica is missing */
+static void resync_next(struct volume_t *vol)
+{
+    for (uint64_t n = 0; n < vol->nregions; n++)
+    {
+	uint64_t region = (vol->resync_cursor + n) % vol->nregions;
+	uint32_t targets = 0;
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (!vol->failed[i] && bitmap_test(vol->stale[i], region))
+		targets |= 1 << i;
+
+	/* writes still in flight could land on top of the copy */
+	if (!targets || vol->inflight[region] || !choose_replica(vol, region, 0))
+	    continue;
+
+	vol->resync_cursor = region + 1;
+
+	struct resync_t *resync = vol->resync = dup_struct(struct resync_t,
+	    .region     = region,
+	    .generation = vol->generation[region],
+	    .targets    = targets
+	);
+
+	resync->io.vol = vol;
+	resync->io.ctx = resync;
+
+	if (!(resync->io.buf = malloc(RESYNC_STEP)))
+	    err(EXIT_FAILURE, "malloc");
+
+	resync_step(vol, resync);
+
+	return;
+    }
+
+    /* nothing left to copy until a replica falls behind again, or the next flush */
+    vol->resync_wanted = 0;
+}
+
+void mirror_poll(struct volume_t *vol, struct timeval *now)
+{
+    uint32_t failed = volume_check_members(vol);
+
+    /* writes waiting for a replica that just failed count against the quorum */
+    for (int i = 0; failed && i < vol->nmembers; i++)
+    {
+	if (!(failed & (1 << i)))
+	    continue;
+
+	struct piece_t *piece = TAILQ_FIRST(&pieces);
+
+	while (piece)
+	{
+	    struct piece_t *next = TAILQ_NEXT(piece, entries);
+	    struct outstanding_t *out = piece->held[i];
+
+	    if (out)
+	    {
+		piece->held[i] = NULL;
+		write_done(out, NULL, 0);
+	    }
+
+	    piece = next;
+	}
+    }
+
+    if (!vol->resync && vol->resync_wanted)
+	resync_next(vol);
+
+    volume_flush_intent(vol, now);
+}
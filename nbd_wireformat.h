@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __NBD_WIREFORMAT_H__
+#define __NBD_WIREFORMAT_H__
+
+#include <stdint.h>
+
+/* the newstyle protocol a server speaks, every field is big endian */
+
+#define NBD_MAGIC_INIT 0x4e42444d41474943ULL		/* "NBDMAGIC" */
+#define NBD_MAGIC_OPTS 0x49484156454f5054ULL		/* "IHAVEOPT" */
+#define NBD_MAGIC_OPT_REPLY 0x0003e889045565a9ULL
+#define NBD_MAGIC_REQUEST 0x25609513
+#define NBD_MAGIC_SIMPLE_REPLY 0x67446698
+#define NBD_MAGIC_STRUCTURED_REPLY 0x668e33ef
+
+#define NBD_DEFAULT_PORT 10809
+
+/* handshake flags, and the client's answer */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES (1 << 1)
+
+/* transmission flags of an export */
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_FUA (1 << 3)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_ERROR 0x8001
+
+/* largest request a client may send without asking, 32Mb */
+#define NBD_MAX_LEN (32 << 20)
+
+struct nbd_hello_t {
+    uint64_t magic;
+    uint64_t opts_magic;
+    uint16_t flags;
+} __attribute__((__packed__));
+
+struct nbd_option_t {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t len;
+} __attribute__((__packed__));
+
+struct nbd_option_reply_t {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t len;
+} __attribute__((__packed__));
+
+/* the answer to NBD_OPT_EXPORT_NAME, followed by 124 zeroes unless the client declined them */
+struct nbd_export_t {
+    uint64_t size;
+    uint16_t flags;
+} __attribute__((__packed__));
+
+struct nbd_info_export_t {
+    uint16_t type;
+    uint64_t size;
+    uint16_t flags;
+} __attribute__((__packed__));
+
+struct nbd_info_block_size_t {
+    uint16_t type;
+    uint32_t minimum;
+    uint32_t preferred;
+    uint32_t maximum;
+} __attribute__((__packed__));
+
+struct nbd_request_t {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t from;
+    uint32_t len;
+} __attribute__((__packed__));
+
+struct nbd_simple_reply_t {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
+} __attribute__((__packed__));
+
+struct nbd_structured_reply_t {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint32_t len;
+} __attribute__((__packed__));
+
+#endif /* __NBD_WIREFORMAT_H__ */
@@ -0,0 +1,860 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <syslog.h>
+
+#include "volume.h"
+#include "xor.h"
+#include "psan_wireformat.h"
+
+/*
+ * each row holds one stripe unit (chunk) per member, the parity chunk
+ * rotates backwards through the members and the data chunks follow it
+ * (left symmetric), so sequential io visits every member in turn.
+ */
+
+enum op_kind_t {
+    OP_READ,	/* reconstruct one chunk window from the others */
+    OP_WRITE,	/* write a window of some data chunks and update parity */
+    OP_REBUILD	/* recompute one member's window from the others */
+};
+
+/* work on a window [lo,hi) of the chunks of one row, the row is locked while it runs */
+struct stripe_op_t {
+    enum op_kind_t kind;
+    struct volume_t *vol;
+    struct io_t *io;
+    uint64_t row;
+    uint64_t region;
+    uint32_t lo;
+    uint32_t hi;
+    int target;
+    uint32_t written;
+    uint32_t io_offset[MAX_MEMBERS];
+    int retries;
+    uint32_t missed;
+    uint32_t errors;
+    uint8_t *buf;
+    unsigned pending;
+    struct io_t sub[MAX_MEMBERS];
+    void (*next)(struct stripe_op_t *op);
+    TAILQ_ENTRY(stripe_op_t) entries;
+};
+
+/* background recomputation of one region */
+struct resync_t {
+    uint64_t region;
+    int target;
+    uint32_t generation;
+    uint64_t row;
+    uint64_t end;
+    uint32_t lo;
+    unsigned inflight;
+    int error;
+};
+
+TAILQ_HEAD(op_head, stripe_op_t);
+
+static struct op_head active = TAILQ_HEAD_INITIALIZER(active);
+static struct op_head waiting = TAILQ_HEAD_INITIALIZER(waiting);
+
+static void op_plan(struct stripe_op_t *op);
+static void resync_more(struct volume_t *vol);
+
+static int parity_member(struct volume_t *vol, uint64_t row)
+{
+    return vol->nmembers - 1 - row % vol->nmembers;
+}
+
+static int data_member(struct volume_t *vol, uint64_t row, int d)
+{
+    return (parity_member(vol, row) + 1 + d) % vol->nmembers;
+}
+
+static int available(struct volume_t *vol, int member, uint64_t region)
+{
+    return !vol->failed[member] && !bitmap_test(vol->stale[member], region);
+}
+
+static uint64_t row_region(struct volume_t *vol, uint64_t row)
+{
+    return row * vol->unit / REGION_SIZE;
+}
+
+static uint8_t *window(struct stripe_op_t *op, int member)
+{
+    return op->buf + member * (op->hi - op->lo);
+}
+
+/* a member was left behind by a write, rebuild passes in progress over the region must not count */
+static void diverge(struct stripe_op_t *op, int member)
+{
+    volume_mark_stale(op->vol, member, op->region);
+    op->vol->generation[op->region]++;
+}
+
+static struct stripe_op_t *op_new(struct volume_t *vol, enum op_kind_t kind, struct io_t *io, uint64_t row, uint32_t lo, uint32_t hi)
+{
+    struct stripe_op_t *op = dup_struct(struct stripe_op_t,
+	.kind   = kind,
+	.vol    = vol,
+	.io     = io,
+	.row    = row,
+	.region = row_region(vol, row),
+	.lo     = lo,
+	.hi     = hi,
+	.target = -1
+    );
+
+    if (!(op->buf = malloc(vol->nmembers * (hi - lo))))
+	err(EXIT_FAILURE, "malloc");
+
+    if (io)
+	io->pending++;
+
+    vol->inflight[op->region]++;
+
+    return op;
+}
+
+/* run the op now if its row is free, otherwise after those queued before it */
+static void op_start(struct stripe_op_t *op)
+{
+    struct stripe_op_t *other;
+
+    TAILQ_FOREACH(other, &active, entries)
+    {
+	if (other->vol == op->vol && other->row == op->row)
+	{
+	    TAILQ_INSERT_TAIL(&waiting, op, entries);
+	    return;
+	}
+    }
+
+    TAILQ_INSERT_TAIL(&active, op, entries);
+    op_plan(op);
+}
+
+static void op_end(struct stripe_op_t *op, int error)
+{
+    struct volume_t *vol = op->vol;
+    struct stripe_op_t *next;
+
+    TAILQ_REMOVE(&active, op, entries);
+    vol->inflight[op->region]--;
+
+    if (op->io)
+    {
+	if (error)
+	    op->io->error = error;
+
+	io_finish(op->io);
+    }
+    else if (error && vol->resync)
+	vol->resync->error = 1;
+
+    /* hand the row to the next op waiting for it */
+    TAILQ_FOREACH(next, &waiting, entries)
+    {
+	if (next->vol == vol && next->row == op->row)
+	{
+	    TAILQ_REMOVE(&waiting, next, entries);
+	    TAILQ_INSERT_TAIL(&active, next, entries);
+	    op_plan(next);
+	    break;
+	}
+    }
+
+    if (!op->io)
+    {
+	vol->resync->inflight--;
+	resync_more(vol);
+    }
+
+    free(op->buf);
+    free(op);
+}
+
+static void sub_done(struct io_t *sub)
+{
+    struct stripe_op_t *op = sub->ctx;
+
+    if (sub->error)
+	op->errors |= 1 << (sub - op->sub);
+
+    if (!--op->pending)
+	op->next(op);
+}
+
+/* begin a phase of reads or writes, the op continues with next once all complete */
+static void phase_begin(struct stripe_op_t *op, void (*next)(struct stripe_op_t *op))
+{
+    op->next = next;
+    op->errors = 0;
+    op->pending = 1;
+
+    for (int i = 0; i < op->vol->nmembers; i++)
+	op->sub[i].pending = 0;
+}
+
+/* read or write [lo,hi) of a member's chunk through its window */
+static void phase_issue(struct stripe_op_t *op, int member, enum io_type_t type)
+{
+    struct io_t *sub = &op->sub[member];
+
+    *sub = (struct io_t){
+	.type    = type,
+	.buf     = window(op, member),
+	.pending = 1,
+	.vol     = op->vol,
+	.ctx     = op,
+	.done    = sub_done
+    };
+
+    op->pending++;
+
+    volume_issue(sub, op->vol->members[member], op->row * op->vol->unit + op->lo, 0, op->hi - op->lo);
+}
+
+static void phase_end(struct stripe_op_t *op)
+{
+    for (int i = 0; i < op->vol->nmembers; i++)
+	if (op->sub[i].pending)
+	    io_finish(&op->sub[i]);
+
+    if (!--op->pending)
+	op->next(op);
+}
+
+/* a read failed because a member did, plan again around it */
+static int replan(struct stripe_op_t *op)
+{
+    if (!op->errors)
+	return 0;
+
+    if (op->retries++ < 2)
+	op_plan(op);
+    else
+	op_end(op, EIO);
+
+    return 1;
+}
+
+static void read_reconstructed(struct stripe_op_t *op)
+{
+    uint32_t len = op->hi - op->lo;
+    uint8_t *out = op->io->buf + op->io_offset[op->target];
+
+    if (replan(op))
+	return;
+
+    memset(out, 0, len);
+
+    for (int i = 0; i < op->vol->nmembers; i++)
+	if (i != op->target)
+	    xor_into(out, window(op, i), len);
+
+    op_end(op, 0);
+}
+
+static void read_direct(struct stripe_op_t *op)
+{
+    if (replan(op))
+	return;
+
+    memcpy(op->io->buf + op->io_offset[op->target], window(op, op->target), op->hi - op->lo);
+
+    op_end(op, 0);
+}
+
+static void plan_read(struct stripe_op_t *op)
+{
+    struct volume_t *vol = op->vol;
+
+    /* the member may have come back while the op waited for the row */
+    if (available(vol, op->target, op->region))
+    {
+	phase_begin(op, read_direct);
+	phase_issue(op, op->target, IO_READ);
+	phase_end(op);
+	return;
+    }
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	if (i != op->target && !available(vol, i, op->region))
+	{
+	    op_end(op, EIO);
+	    return;
+	}
+    }
+
+    phase_begin(op, read_reconstructed);
+
+    for (int i = 0; i < vol->nmembers; i++)
+	if (i != op->target)
+	    phase_issue(op, i, IO_READ);
+
+    phase_end(op);
+}
+
+static void write_done(struct stripe_op_t *op)
+{
+    int parity = parity_member(op->vol, op->row);
+    uint32_t missed = op->missed | op->errors;
+
+    for (int i = 0; i < op->vol->nmembers; i++)
+	if (op->errors & (1 << i))
+	    diverge(op, i);
+
+    /* one chunk missing from the row can still be reconstructed, two can not */
+    missed &= op->written | 1 << parity;
+
+    op_end(op, missed & (missed - 1) ? EIO : 0);
+}
+
+static void write_parity(struct stripe_op_t *op)
+{
+    struct volume_t *vol = op->vol;
+    int parity = parity_member(vol, op->row);
+    uint32_t len = op->hi - op->lo;
+    uint8_t *p = window(op, parity);
+
+    if (replan(op))
+	return;
+
+    if (op->target == parity)
+    {
+	/* read-modify-write: the old data leaves the parity, the new data enters it */
+	for (int i = 0; i < vol->nmembers; i++)
+	{
+	    if (!(op->written & (1 << i)))
+		continue;
+
+	    xor_into(p, window(op, i), len);
+	    memcpy(window(op, i), op->io->buf + op->io_offset[i], len);
+	    xor_into(p, window(op, i), len);
+	}
+    }
+    else
+    {
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (op->written & (1 << i))
+		memcpy(window(op, i), op->io->buf + op->io_offset[i], len);
+
+	/* reconstruct-write, or a full stripe: parity of every data chunk */
+	if (!(op->missed & (1 << parity)))
+	{
+	    memset(p, 0, len);
+
+	    for (int i = 0; i < vol->nmembers; i++)
+		if (i != parity)
+		    xor_into(p, window(op, i), len);
+	}
+    }
+
+    /* members disagree until every piece lands */
+    bitmap_set(vol->intent, op->region);
+
+    phase_begin(op, write_done);
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	if (!(op->written & (1 << i)) && (i != parity || op->missed & (1 << parity)))
+	    continue;
+
+	if (vol->failed[i])
+	{
+	    op->missed |= 1 << i;
+	    diverge(op, i);
+	    continue;
+	}
+
+	phase_issue(op, i, IO_WRITE);
+    }
+
+    phase_end(op);
+}
+
+static void plan_write(struct stripe_op_t *op)
+{
+    struct volume_t *vol = op->vol;
+    int parity = parity_member(vol, op->row);
+    unsigned rmw_reads = 1, rcw_reads = 0;
+    int rmw_ok = available(vol, parity, op->region);
+    int rcw_ok = 1;
+
+    op->missed = 0;
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	if (i == parity)
+	    continue;
+
+	if (op->written & (1 << i))
+	{
+	    rmw_ok &= available(vol, i, op->region);
+	    rmw_reads++;
+	}
+	else
+	{
+	    rcw_ok &= available(vol, i, op->region);
+	    rcw_reads++;
+	}
+    }
+
+    op->target = -1;
+
+    /* without a parity member there is nothing to keep up to date */
+    if (vol->failed[parity])
+    {
+	op->missed |= 1 << parity;
+	diverge(op, parity);
+
+	phase_begin(op, write_parity);
+	phase_end(op);
+	return;
+    }
+
+    /* full stripe, or fewer reads than read-modify-write */
+    if (rcw_ok && (!rmw_ok || rcw_reads <= rmw_reads))
+    {
+	phase_begin(op, write_parity);
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (i != parity && !(op->written & (1 << i)))
+		phase_issue(op, i, IO_READ);
+
+	phase_end(op);
+	return;
+    }
+
+    if (rmw_ok)
+    {
+	op->target = parity;
+	phase_begin(op, write_parity);
+
+	phase_issue(op, parity, IO_READ);
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (op->written & (1 << i))
+		phase_issue(op, i, IO_READ);
+
+	phase_end(op);
+	return;
+    }
+
+    /* two members are out, the new data can not be protected */
+    op_end(op, EIO);
+}
+
+static void rebuild_done(struct stripe_op_t *op)
+{
+    op_end(op, op->errors ? EIO : 0);
+}
+
+static void rebuild_write(struct stripe_op_t *op)
+{
+    uint32_t len = op->hi - op->lo;
+    uint8_t *t = window(op, op->target);
+
+    if (op->errors)
+    {
+	op_end(op, EIO);
+	return;
+    }
+
+    memset(t, 0, len);
+
+    for (int i = 0; i < op->vol->nmembers; i++)
+	if (i != op->target)
+	    xor_into(t, window(op, i), len);
+
+    phase_begin(op, rebuild_done);
+    phase_issue(op, op->target, IO_WRITE);
+    phase_end(op);
+}
+
+static void plan_rebuild(struct stripe_op_t *op)
+{
+    struct volume_t *vol = op->vol;
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	if (vol->failed[i] || (i != op->target && !available(vol, i, op->region)))
+	{
+	    op_end(op, EIO);
+	    return;
+	}
+    }
+
+    phase_begin(op, rebuild_write);
+
+    for (int i = 0; i < vol->nmembers; i++)
+	if (i != op->target)
+	    phase_issue(op, i, IO_READ);
+
+    phase_end(op);
+}
+
+static void op_plan(struct stripe_op_t *op)
+{
+    switch (op->kind)
+    {
+	case OP_READ:
+	    plan_read(op);
+	    break;
+
+	case OP_WRITE:
+	    plan_write(op);
+	    break;
+
+	case OP_REBUILD:
+	    plan_rebuild(op);
+	    break;
+    }
+}
+
+/* position of a volume offset: row, member and offset within the member's chunk */
+static void locate(struct volume_t *vol, uint64_t from, uint64_t *row, int *member, uint32_t *within)
+{
+    uint64_t row_size = (uint64_t)vol->unit * (vol->nmembers - 1);
+
+    *row = from / row_size;
+    *member = data_member(vol, *row, from % row_size / vol->unit);
+    *within = from % vol->unit;
+}
+
+/* a direct read failed with its member, reconstruct the piece instead */
+static void read_done(struct outstanding_t *out, uint8_t *buf, int len)
+{
+    struct io_t *io = out->ctx;
+
+    if (!buf)
+    {
+	uint64_t row;
+	int member;
+	uint32_t within;
+
+	locate(io->vol, io->from + out->offset, &row, &member, &within);
+
+	struct stripe_op_t *op = op_new(io->vol, OP_READ, io, row, within, within + (1 << ((struct psan_ctrl_t *)out->psan)->len_power));
+
+	op->target = member;
+	op->io_offset[member] = out->offset;
+
+	engine_free(out);
+	io_finish(io);
+
+	op_start(op);
+	return;
+    }
+
+    volume_complete(out, buf, len);
+}
+
+static void parity_read(struct volume_t *vol, struct io_t *io)
+{
+    uint32_t offset = 0;
+
+    while (offset < io->len)
+    {
+	uint64_t row;
+	int member;
+	uint32_t within;
+
+	locate(vol, io->from + offset, &row, &member, &within);
+
+	uint32_t len = io->len - offset < vol->unit - within ? io->len - offset : vol->unit - within;
+
+	/* a chunk on a missing member is rebuilt from the rest of its row */
+	if (!available(vol, member, row_region(vol, row)))
+	{
+	    struct stripe_op_t *op = op_new(vol, OP_READ, io, row, within, within + len);
+
+	    op->target = member;
+	    op->io_offset[member] = offset;
+
+	    op_start(op);
+	    offset += len;
+	    continue;
+	}
+
+	uint64_t member_from = row * vol->unit + within;
+
+	while (len)
+	{
+	    uint8_t power = volume_power(len, volume_limit(vol->members[member]));
+	    struct outstanding_t *out = engine_request(vol->members[member], PSAN_GET, member_from >> 9, power, NULL);
+
+	    out->ctx = io;
+	    out->offset = offset;
+	    out->done = read_done;
+
+	    io->pending++;
+	    engine_submit(out);
+
+	    member_from += 1 << power;
+	    offset += 1 << power;
+	    len -= 1 << power;
+	}
+    }
+}
+
+/* split the part of a write within one row into windows written on a fixed set of members */
+static void write_row(struct volume_t *vol, struct io_t *io, uint64_t row, uint32_t offset, uint32_t len)
+{
+    uint32_t from[MAX_MEMBERS] = { 0 }, to[MAX_MEMBERS] = { 0 };
+    uint32_t io_offset[MAX_MEMBERS] = { 0 };
+    uint32_t cuts[2 * MAX_MEMBERS + 2];
+    int ncuts = 0;
+
+    while (len)
+    {
+	uint64_t r;
+	int member;
+	uint32_t within;
+
+	locate(vol, io->from + offset, &r, &member, &within);
+
+	uint32_t n = len < vol->unit - within ? len : vol->unit - within;
+
+	from[member] = within;
+	to[member] = within + n;
+	io_offset[member] = offset;
+
+	cuts[ncuts++] = within;
+	cuts[ncuts++] = within + n;
+
+	offset += n;
+	len -= n;
+    }
+
+    /* sort the window boundaries, there are only a few */
+    for (int i = 1; i < ncuts; i++)
+	for (int j = i; j > 0 && cuts[j-1] > cuts[j]; j--)
+	{
+	    uint32_t t = cuts[j];
+	    cuts[j] = cuts[j-1];
+	    cuts[j-1] = t;
+	}
+
+    for (int c = 0; c + 1 < ncuts; c++)
+    {
+	uint32_t lo = cuts[c], hi = cuts[c+1];
+
+	uint32_t written = 0;
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (from[i] < to[i] && from[i] <= lo && hi <= to[i])
+		written |= 1 << i;
+
+	/* the gap between the end and the start of a write wrapping round the row */
+	if (lo == hi || !written)
+	    continue;
+
+	struct stripe_op_t *op = op_new(vol, OP_WRITE, io, row, lo, hi);
+
+	op->written = written;
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (written & (1 << i))
+		op->io_offset[i] = io_offset[i] + lo - from[i];
+
+	op_start(op);
+    }
+}
+
+static void parity_write(struct volume_t *vol, struct io_t *io)
+{
+    uint64_t row_size = (uint64_t)vol->unit * (vol->nmembers - 1);
+    uint32_t offset = 0;
+
+    while (offset < io->len)
+    {
+	uint64_t from = io->from + offset;
+	uint32_t len = io->len - offset;
+
+	if (len > row_size - from % row_size)
+	    len = row_size - from % row_size;
+
+	write_row(vol, io, from / row_size, offset, len);
+
+	offset += len;
+    }
+}
+
+void parity_submit(struct volume_t *vol, struct io_t *io)
+{
+    if (io->type == IO_READ)
+	parity_read(vol, io);
+    else
+	parity_write(vol, io);
+}
+
+void parity_open(struct volume_t *vol, char *bitmap)
+{
+    if (vol->nmembers < 3)
+	errx(EXIT_FAILURE, "parity needs at least three partitions");
+
+    if (vol->unit > REGION_SIZE)
+	errx(EXIT_FAILURE, "parity stripe unit must be at most %u kilobytes", REGION_SIZE / 1024);
+
+    vol->member_size -= vol->member_size % vol->unit;
+    vol->size = vol->member_size * (vol->nmembers - 1);
+
+    volume_regions(vol, bitmap);
+    vol->parity_stale = bitmap_open(NULL, vol->nregions, REGION_SIZE);
+
+    syslog(LOG_INFO, "parity across %u partitions, %s xor", vol->nmembers, xor_init());
+
+    if (bitmap_empty(vol->intent))
+	return;
+
+    /* writes were in flight when we last stopped.  a member that missed writes to a region
+     * holds them only in the parity and is rebuilt from the others, otherwise every member
+     * is current and the parity of the region is recomputed
+     */
+    uint64_t recompute = 0, rebuild = 0;
+
+    for (uint64_t region = 0; region < vol->nregions; region++)
+    {
+	unsigned behind = 0;
+
+	if (!bitmap_test(vol->intent, region))
+	    continue;
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (bitmap_test(vol->stale[i], region))
+		behind++;
+
+	if (behind > 1)
+	    errx(EXIT_FAILURE, "%u partitions missed writes to region %llu, it cannot be rebuilt",
+		behind, (unsigned long long)region);
+
+	if (behind)
+	    rebuild++;
+	else
+	{
+	    bitmap_set(vol->parity_stale, region);
+	    recompute++;
+	}
+    }
+
+    vol->resync_wanted = 1;
+
+    syslog(LOG_NOTICE, "write-intent bitmap has %llu dirty regions, recomputing the parity of %llu and rebuilding a member of %llu",
+	(unsigned long long)(recompute + rebuild), (unsigned long long)recompute, (unsigned long long)rebuild);
+}
+
+/* keep up to REBUILD_DEPTH steps of the current region in flight */
+static void resync_more(struct volume_t *vol)
+{
+    struct resync_t *resync = vol->resync;
+
+    while (resync->inflight < REBUILD_DEPTH && resync->row < resync->end && !resync->error)
+    {
+	int target = resync->target < 0 ? parity_member(vol, resync->row) : resync->target;
+	uint32_t hi = resync->lo + (vol->unit < RESYNC_STEP ? vol->unit : RESYNC_STEP);
+	struct stripe_op_t *op = op_new(vol, OP_REBUILD, NULL, resync->row, resync->lo, hi);
+
+	op->target = target;
+
+	if (hi == vol->unit)
+	{
+	    resync->row++;
+	    resync->lo = 0;
+	}
+	else
+	    resync->lo = hi;
+
+	resync->inflight++;
+	op_start(op);
+
+	/* the op may have finished the region already */
+	if (vol->resync != resync)
+	    return;
+    }
+
+    if (resync->inflight)
+	return;
+
+    /* a write that left a member behind during the pass means another pass */
+    if (!resync->error && vol->generation[resync->region] == resync->generation)
+    {
+	if (resync->target < 0)
+	    bitmap_clear(vol->parity_stale, resync->region);
+	else if (!vol->failed[resync->target])
+	    bitmap_clear(vol->stale[resync->target], resync->region);
+    }
+
+    vol->resync = NULL;
+    vol->resync_wanted = 1;
+    free(resync);
+}
+
+/* start rebuilding the next region a member, or the parity, is missing */
+static void resync_next(struct volume_t *vol)
+{
+    uint64_t rows = vol->member_size / vol->unit;
+
+    for (uint64_t n = 0; n < vol->nregions; n++)
+    {
+	uint64_t region = (vol->resync_cursor + n) % vol->nregions;
+	int target = -2;
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    if (!vol->failed[i] && bitmap_test(vol->stale[i], region))
+		target = i;
+
+	if (target == -2 && bitmap_test(vol->parity_stale, region))
+	    target = -1;
+
+	if (target == -2)
+	    continue;
+
+	vol->resync_cursor = region + 1;
+
+	uint64_t first = region * (REGION_SIZE / vol->unit);
+	uint64_t end = first + REGION_SIZE / vol->unit;
+
+	vol->resync = dup_struct(struct resync_t,
+	    .region     = region,
+	    .target     = target,
+	    .generation = vol->generation[region],
+	    .row        = first,
+	    .end        = end < rows ? end : rows
+	);
+
+	resync_more(vol);
+	return;
+    }
+
+    /* nothing left to rebuild until a member falls behind again, or the next flush */
+    vol->resync_wanted = 0;
+}
+
+void parity_poll(struct volume_t *vol, struct timeval *now)
+{
+    volume_check_members(vol);
+
+    if (!vol->resync && vol->resync_wanted)
+	resync_next(vol);
+
+    volume_flush_intent(vol, now);
+}
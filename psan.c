@@ -19,6 +19,15 @@
 #include "psan.h"
 #include "psan_wireformat.h"
 
+#include <ifaddrs.h>
+#include <net/if.h>
+
+int psan_socks[MAX_INTERFACES];
+char *psan_devs[MAX_INTERFACES];
+int psan_nsocks = 0;
+
+static SLIST_HEAD(, scan_t) scans = SLIST_HEAD_INITIALIZER(scans);
+
 char *strndup_x(const char *string, size_t n)
 {
   char *ret;
@@ -31,12 +40,12 @@ char *strndup_x(const char *string, size_t n)
   return ret;
 }
 
-void psan_init(char *dev)
+/* open a PSAN socket, optionally bound to one interface */
+int psan_socket(char *dev)
 {
-    if (sock)
-	return;
+    int sock;
 
-    if (!(sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)))
+    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
 	err(EXIT_FAILURE, "socket");
 
     int bufsize = 8*1024*1024;
@@ -67,56 +76,234 @@ void psan_init(char *dev)
 
     if (bind(sock, (struct sockaddr *)&(struct sockaddr_in){ .sin_family=AF_INET, .sin_port=htons(20001) }, sizeof(struct sockaddr_in)) < 0 && errno != EADDRINUSE)
 	warn("bind(fd, {sa_family=AF_INET, sin_port=htons(20001)})");
+
+    return sock;
 }
 
-void psan_cleanup(void)
+void psan_init(char **devs, int ndevs)
 {
     if (sock)
-	close(sock);
+	return;
+
+    /* one socket per interface, or a single unbound one */
+    for (int i = 0; i < (ndevs ? ndevs : 1); i++)
+    {
+	if (psan_nsocks == MAX_INTERFACES)
+	    errx(EXIT_FAILURE, "too many interfaces, at most %d are supported", MAX_INTERFACES);
+
+	psan_devs[psan_nsocks] = ndevs ? devs[i] : NULL;
+	psan_socks[psan_nsocks] = psan_socket(psan_devs[psan_nsocks]);
+	psan_nsocks++;
+    }
+
+    sock = psan_socks[0];
+}
+
+void psan_cleanup(void)
+{
+    for (int i = 0; i < psan_nsocks; i++)
+	close(psan_socks[i]);
+}
+
+int psan_add_scan(char *cidr)
+{
+    struct scan_t *scan;
+    struct in_addr net;
+    char buf[INET_ADDRSTRLEN];
+    char *slash;
+    int bits = 32;
+
+    snprintf(buf, sizeof(buf), "%s", cidr);
+
+    if ((slash = strchr(buf, '/')))
+    {
+	*slash++ = 0;
+	bits = atoi(slash);
+    }
+
+    /* refuse to sweep more than a /16 */
+    if (!inet_aton(buf, &net) || bits < 16 || bits > 32)
+	return -1;
+
+    uint32_t mask = bits == 32 ? ~0U : ~((1U << (32 - bits)) - 1);
+    uint32_t first = ntohl(net.s_addr) & mask;
+    uint32_t count = ~mask + 1;
+
+    /* skip network and broadcast addresses of real subnets */
+    if (bits < 31)
+    {
+	first++;
+	count -= 2;
+    }
+
+    scan = dup_struct(struct scan_t, .first = first, .count = count);
+    SLIST_INSERT_HEAD(&scans, scan, entries);
+
+    return 0;
+}
+
+/* the socket to use for an interface, -1 if it was not configured */
+static int socket_for(const char *name)
+{
+    for (int i = 0; i < psan_nsocks; i++)
+	if (!psan_devs[i] || !strcmp(psan_devs[i], name))
+	    return psan_socks[i];
+
+    return -1;
+}
+
+static void add_disk(struct disks_t *disks, struct in_addr ip4)
+{
+    struct disk_t *disk;
+
+    /* several broadcasts and scans can reach the same device */
+    SLIST_FOREACH(disk, disks, entries)
+	if (disk->root_addr.sin_addr.s_addr == ip4.s_addr)
+	    return;
+
+    disk = dup_struct(struct disk_t,
+	.root_addr = (struct sockaddr_in){
+	    .sin_family = AF_INET,
+	    .sin_port = htons(20001),
+	    .sin_addr = ip4
+	}
+    );
+
+    SLIST_INSERT_HEAD(disks, disk, entries);
+}
+
+/* how long to keep listening after the latest FIND response: as long as the responses so far were spread out, at least 1/10 of a second */
+static double find_window(double first, double latest)
+{
+    return latest - first > 0.1 ? latest - first : 0.1;
+}
+
+/* collect FIND responses until the deadline, which adapts to the responses when adaptive */
+static void collect_disks(struct disks_t *disks, uint16_t seq, double deadline, double sent, int adaptive, double *first, double *latest)
+{
+    struct psan_find_response_t *pfr;
+
+    for (;;)
+    {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	double left = deadline - tv2dbl(now);
+	if (left <= 0)
+	    break;
+
+	struct timeval timeout = dbl2tv(left);
+
+	if (!(pfr = wait_for_packets(psan_socks, psan_nsocks, PSAN_FIND_RESPONSE, seq, sizeof(struct psan_find_response_t), &timeout, NULL, 0)))
+	    break;
+
+	add_disk(disks, pfr->ip4);
+
+	gettimeofday(&now, NULL);
+	*latest = tv2dbl(now);
+	if (!*first)
+	    *first = *latest;
+
+	if (adaptive)
+	{
+	    deadline = *latest + find_window(*first, *latest);
+	    if (deadline > sent + FIND_MAX_WAIT)
+		deadline = sent + FIND_MAX_WAIT;
+	}
+    }
 }
 
 struct disks_t *psan_find_disks(void)
 {
-    struct sockaddr_in broadcast = {
+    struct sockaddr_in dest = {
 	.sin_family = AF_INET,
 	.sin_port   = htons(20001),
 	.sin_addr   = { .s_addr = INADDR_BROADCAST }
     };
-    socklen_t broadcast_len = sizeof(struct sockaddr_in);
+    socklen_t dest_len = sizeof(struct sockaddr_in);
 
-    /* send broadcast FIND message */
     uint16_t expected_seq = psan_next_seq();
     struct psan_find_t find = {
 	.ctrl = { .cmd = PSAN_FIND, .seq = htons(expected_seq) }
     };
     size_t find_len = sizeof(struct psan_find_t);
-    sendto(sock, (void *)&find, find_len, 0, (struct sockaddr *)&broadcast, broadcast_len);
 
-    /* collect initial answer within 1 second */
-    struct timeval timeout = { .tv_sec = 1 };
-    struct psan_find_response_t *pfr;
-    struct disks_t *disks = NULL;
+    struct disks_t *disks;
+    if (!(disks = malloc(sizeof(struct disks_t))))
+	err(EXIT_FAILURE, "malloc");
+    SLIST_INIT(disks);
 
-    while ((pfr = wait_for_packet(sock, PSAN_FIND_RESPONSE, expected_seq, sizeof(struct psan_find_response_t), &timeout, NULL, 0)))
+    /* send FIND to the limited broadcast address on every socket */
+    for (int i = 0; i < psan_nsocks; i++)
+	sendto(psan_socks[i], (void *)&find, find_len, 0, (struct sockaddr *)&dest, dest_len);
+
+    /* and to the directed broadcast address of every configured interface */
+    struct ifaddrs *ifaddrs, *ifa;
+
+    if (getifaddrs(&ifaddrs) == 0)
     {
-	/* subsequent responses within 1/10 of a second of the fastest */
-	if (!disks)
+	for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next)
 	{
-	    disks = malloc(sizeof(struct disks_t));
-	    bzero(disks, sizeof(struct disks_t));
-	    SLIST_INIT(disks);
-	    timeout = (struct timeval){ .tv_sec = 0, .tv_usec = 100000 };
+	    int s;
+
+	    if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || !ifa->ifa_broadaddr)
+		continue;
+
+	    if (!(ifa->ifa_flags & IFF_UP) || !(ifa->ifa_flags & IFF_BROADCAST) || (ifa->ifa_flags & IFF_LOOPBACK))
+		continue;
+
+	    if ((s = socket_for(ifa->ifa_name)) < 0)
+		continue;
+
+	    dest.sin_addr = ((struct sockaddr_in *)ifa->ifa_broadaddr)->sin_addr;
+	    sendto(s, (void *)&find, find_len, 0, (struct sockaddr *)&dest, dest_len);
 	}
 
-	struct disk_t *disk = dup_struct(struct disk_t,
-	    .root_addr = (struct sockaddr_in){
-		.sin_family = AF_INET,
-		.sin_port = htons(20001),
-		.sin_addr = pfr->ip4
+	freeifaddrs(ifaddrs);
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double sent = tv2dbl(now);
+    double first = 0, latest = 0;
+
+    /* unicast sweep of the scan ranges, paced and collecting answers in between */
+    struct scan_t *scan;
+
+    SLIST_FOREACH(scan, &scans, entries)
+    {
+	for (uint32_t n = 0; n < scan->count; n++)
+	{
+	    dest.sin_addr.s_addr = htonl(scan->first + n);
+	    sendto(sock, (void *)&find, find_len, 0, (struct sockaddr *)&dest, dest_len);
+
+	    if ((n + 1) % SCAN_BURST == 0)
+	    {
+		gettimeofday(&now, NULL);
+		collect_disks(disks, expected_seq, tv2dbl(now) + (double)SCAN_BURST / SCAN_RATE, sent, 0, &first, &latest);
 	    }
-	);
+	}
+
+	gettimeofday(&now, NULL);
+	sent = tv2dbl(now);
+    }
+
+    /* collect initial answer within 1 second, then adapt to how spread out the answers are */
+    double deadline = sent + 1;
+
+    if (latest)
+    {
+	deadline = latest + find_window(first, latest);
+	if (deadline < sent + 0.1)
+	    deadline = sent + 0.1;
+    }
+
+    collect_disks(disks, expected_seq, deadline, sent, 1, &first, &latest);
 
-	SLIST_INSERT_HEAD(disks, disk, entries);
+    if (SLIST_EMPTY(disks))
+    {
+	free(disks);
+	return NULL;
     }
 
     return disks;
@@ -169,16 +356,24 @@ void free_disk_info(struct disk_info_t *disk_info)
     free(disk_info);
 }
 
-struct part_info_t *psan_query_part(struct sockaddr_in *dest)
+/* send an IDENTIFY request to a partition IP, returning its sequence number */
+uint16_t psan_send_identify(int sock, struct sockaddr_in *dest)
 {
-    /* query partition information from root IP */
-    uint16_t expected_seq = psan_next_seq();
+    uint16_t seq = psan_next_seq();
     struct psan_identify_t identify = {
-	.ctrl = { .cmd = PSAN_IDENTIFY, .seq = htons(expected_seq) },
+	.ctrl = { .cmd = PSAN_IDENTIFY, .seq = htons(seq) },
     };
     size_t identify_len = sizeof(struct psan_identify_t);
     sendto(sock, (void *)&identify, identify_len, 0, (struct sockaddr *)dest, sizeof(struct sockaddr_in));
 
+    return seq;
+}
+
+struct part_info_t *psan_query_part(struct sockaddr_in *dest)
+{
+    /* query partition information from root IP */
+    uint16_t expected_seq = psan_send_identify(sock, dest);
+
     struct timeval timeout = { .tv_sec = 1 };
     struct psan_get_response_partition_t *ret;
 
@@ -224,7 +419,8 @@ void free_part_info(struct part_info_t *part_info)
     free(part_info);
 }
 
-struct part_addr_t *psan_resolve_id(char *id)
+/* send a RESOLVE request for a partition id, broadcast unless dest is given */
+void psan_send_resolve(int sock, struct sockaddr_in *dest, char *id, uint16_t seq)
 {
     struct sockaddr_in broadcast = {
 	.sin_family = AF_INET,
@@ -233,21 +429,23 @@ struct part_addr_t *psan_resolve_id(char *id)
     };
     socklen_t broadcast_len = sizeof(struct sockaddr_in);
 
-    /* query partition information from root IP */
-    uint16_t expected_seq = psan_next_seq();
     struct psan_resolve_t resolve = {
-	.ctrl = { .cmd = PSAN_RESOLVE, .seq = htons(expected_seq) },
+	.ctrl = { .cmd = PSAN_RESOLVE, .seq = htons(seq) },
     };
     size_t resolve_len = sizeof(struct psan_resolve_t);
     strncpy(resolve.id, id, sizeof(resolve.id));
-    sendto(sock, (void *)&resolve, resolve_len, 0, (struct sockaddr *)&broadcast, broadcast_len);
+    sendto(sock, (void *)&resolve, resolve_len, 0, (struct sockaddr *)(dest ? dest : &broadcast), broadcast_len);
+}
 
+/* wait for the RESOLVE response to expected_seq */
+static struct part_addr_t *resolve_response(uint16_t expected_seq)
+{
     struct timeval timeout = { .tv_sec = 1 };
     struct psan_resolve_response_t *ret;
     struct sockaddr_in from;
     socklen_t from_len = sizeof(from);
 
-    if (!(ret = wait_for_packet(sock, PSAN_RESOLVE_RESPONSE, expected_seq, sizeof(struct psan_resolve_response_t), &timeout, (struct sockaddr *)&from, &from_len)))
+    if (!(ret = wait_for_packets(psan_socks, psan_nsocks, PSAN_RESOLVE_RESPONSE, expected_seq, sizeof(struct psan_resolve_response_t), &timeout, (struct sockaddr *)&from, &from_len)))
 	return NULL;
 
     return dup_struct(struct part_addr_t,
@@ -260,6 +458,43 @@ struct part_addr_t *psan_resolve_id(char *id)
     );
 }
 
+struct part_addr_t *psan_resolve_at(char *id, struct sockaddr_in *root)
+{
+    uint16_t expected_seq = psan_next_seq();
+
+    psan_send_resolve(sock, root, id, expected_seq);
+
+    return resolve_response(expected_seq);
+}
+
+struct part_addr_t *psan_resolve_id(char *id)
+{
+    struct part_addr_t *ret;
+
+    /* query partition information from root IP */
+    uint16_t expected_seq = psan_next_seq();
+
+    for (int i = 0; i < psan_nsocks; i++)
+	psan_send_resolve(psan_socks[i], NULL, id, expected_seq);
+
+    if ((ret = resolve_response(expected_seq)) || SLIST_EMPTY(&scans))
+	return ret;
+
+    /* partitions behind a router only hear a RESOLVE sent to their root address */
+    struct disks_t *disks;
+    struct disk_t *disk;
+
+    if (!(disks = psan_find_disks()))
+	return NULL;
+
+    SLIST_FOREACH(disk, disks, entries)
+	psan_send_resolve(sock, &disk->root_addr, id, expected_seq);
+
+    free_disks(disks);
+
+    return resolve_response(expected_seq);
+}
+
 void free_part_addr(struct part_addr_t *part_addr)
 {
     free(part_addr);
@@ -284,7 +519,7 @@ uint16_t psan_next_seq(void)
     return seq;
 }
 
-void *wait_for_packet(int sock, uint8_t cmd, uint16_t seq, uint16_t len, struct timeval *timeout, struct sockaddr *from, socklen_t *from_len)
+void *wait_for_packets(int *socks, int nsocks, uint8_t cmd, uint16_t seq, uint16_t len, struct timeval *timeout, struct sockaddr *from, socklen_t *from_len)
 {
     static char buf[65536];
     fd_set set;
@@ -292,28 +527,46 @@ void *wait_for_packet(int sock, uint8_t cmd, uint16_t seq, uint16_t len, struct
 
     for (;;)
     {
+	int max = -1;
+
 	FD_ZERO(&set);
-	FD_SET(sock, &set);
+	for (int i = 0; i < nsocks; i++)
+	{
+	    FD_SET(socks[i], &set);
+	    if (socks[i] > max)
+		max = socks[i];
+	}
 
-	if ((ret = select(sock+1, &set, NULL, NULL, timeout)) < 0)
+	if ((ret = select(max+1, &set, NULL, NULL, timeout)) < 0)
 	    err(EXIT_FAILURE, "select");
 
 	if (!ret)
 	    break;
 
-	if ((ret = recvfrom(sock, buf, sizeof(buf), 0, from, from_len)) < 0)
-	    err(EXIT_FAILURE, "recv");
+	for (int i = 0; i < nsocks; i++)
+	{
+	    if (!FD_ISSET(socks[i], &set))
+		continue;
+
+	    if ((ret = recvfrom(socks[i], buf, sizeof(buf), 0, from, from_len)) < 0)
+		err(EXIT_FAILURE, "recv");
 
-	if (ret < sizeof(struct psan_ctrl_t))
-	    continue;
+	    if (ret < sizeof(struct psan_ctrl_t))
+		continue;
 
-	struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)buf;
+	    struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)buf;
 
-	if (ret != len || ctrl->cmd != cmd || ntohs(ctrl->seq) != seq)
-	    continue;
+	    if (ret != len || ctrl->cmd != cmd || ntohs(ctrl->seq) != seq)
+		continue;
 
-	return buf;
+	    return buf;
+	}
     }
 
     return NULL;
 }
+
+void *wait_for_packet(int sock, uint8_t cmd, uint16_t seq, uint16_t len, struct timeval *timeout, struct sockaddr *from, socklen_t *from_len)
+{
+    return wait_for_packets(&sock, 1, cmd, seq, len, timeout, from, from_len);
+}
@@ -33,7 +33,21 @@
 
 #include "util.h"
 
+/* local interfaces PSAN traffic may go through */
+#define MAX_INTERFACES 8
+
+/* FIND packets per second, and per burst, of a unicast scan */
+#define SCAN_RATE 1000
+#define SCAN_BURST 50
+
+/* seconds to keep listening for FIND responses after the last request */
+#define FIND_MAX_WAIT 5
+
 extern int sock;
+extern int debug;
+extern int psan_socks[MAX_INTERFACES];
+extern char *psan_devs[MAX_INTERFACES];
+extern int psan_nsocks;
 
 SLIST_HEAD(disks_t, disk_t);
 
@@ -42,6 +56,12 @@ struct disk_t {
     SLIST_ENTRY(disk_t) entries;
 };
 
+struct scan_t {
+    uint32_t first;
+    uint32_t count;
+    SLIST_ENTRY(scan_t) entries;
+};
+
 struct disk_info_t {
     char *version;
     char *label;
@@ -61,23 +81,29 @@ struct part_info_t {
     uint64_t size;
 };
 
-void psan_init(char *dev);
+int psan_socket(char *dev);
+void psan_init(char **devs, int ndevs);
 void psan_cleanup(void);
 
+int psan_add_scan(char *cidr);
 struct disks_t *psan_find_disks(void);
 void free_disks(struct disks_t *disks);
 
 struct disk_info_t *psan_query_disk(struct sockaddr_in *dest);
 void free_disk_info(struct disk_info_t *disk_info);
 
+uint16_t psan_send_identify(int sock, struct sockaddr_in *dest);
 struct part_info_t *psan_query_part(struct sockaddr_in *dest);
 struct part_info_t *psan_query_root(struct sockaddr_in *dest, int partition);
 void free_part_info(struct part_info_t *part_info);
 
+void psan_send_resolve(int sock, struct sockaddr_in *dest, char *id, uint16_t seq);
+struct part_addr_t *psan_resolve_at(char *id, struct sockaddr_in *root);
 struct part_addr_t *psan_resolve_id(char *id);
 void free_part_addr(struct part_addr_t *part_addr);
 
 uint16_t psan_next_seq(void);
+void *wait_for_packets(int *socks, int nsocks, uint8_t cmd, uint16_t seq, uint16_t len, struct timeval *timeout, struct sockaddr *from, socklen_t *from_len);
 void *wait_for_packet(int sock, uint8_t cmd, uint16_t seq, uint16_t len, struct timeval *timeout, struct sockaddr *from, socklen_t *from_len);
 
 #endif /* __PSAN_H__ */
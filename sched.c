@@ -0,0 +1,538 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <syslog.h>
+
+#include "sched.h"
+#include "cache.h"
+#include "track.h"
+
+static const char *class_name[] = { "read", "write" };
+
+struct sched_t *sched_open(struct volume_t *vol)
+{
+    unsigned depth = vol->depth ? vol->depth : SCHED_DEPTH;
+    struct sched_t *sched = dup_struct(struct sched_t,
+	.vol          = vol,
+	.depth        = depth,
+	.read_reserve = depth * SCHED_READ_RESERVE / SCHED_DEPTH,
+	.expire       = { SCHED_READ_EXPIRE, SCHED_WRITE_EXPIRE }
+    );
+
+    for (int i = 0; i < 2; i++)
+	TAILQ_INIT(&sched->class[i].queue);
+
+    TAILQ_INIT(&sched->held);
+    TAILQ_INIT(&sched->index);
+
+    return sched;
+}
+
+static int overlap(struct io_t *a, struct io_t *b)
+{
+    return a->from < b->from + b->len && b->from < a->from + a->len;
+}
+
+/* a read may not overtake a write queued before it that it overlaps */
+static int behind_write(struct sched_t *sched, struct io_t *io)
+{
+    struct io_t *at;
+
+    TAILQ_FOREACH(at, &sched->class[IO_WRITE].queue, entries)
+    {
+	if (at->order > io->order)
+	    break;
+
+	if (overlap(at, io))
+	    return 1;
+    }
+
+    return 0;
+}
+
+static int expired(struct sched_t *sched, struct io_t *io, int type, struct timeval *now)
+{
+    return io && tv2dbl(*now) - tv2dbl(io->queued) >= sched->expire[type];
+}
+
+/* reads first, unless writes have waited too long or too many reads went ahead of them */
+static int choose(struct sched_t *sched, struct timeval *now)
+{
+    struct io_t *read = TAILQ_FIRST(&sched->class[IO_READ].queue);
+    struct io_t *write = TAILQ_FIRST(&sched->class[IO_WRITE].queue);
+    unsigned inflight = sched->class[IO_READ].inflight + sched->class[IO_WRITE].inflight;
+
+    /* the last slots are kept for reads */
+    if (write && sched->class[IO_WRITE].inflight >= sched->depth - sched->read_reserve)
+	write = NULL;
+
+    if (read && behind_write(sched, read))
+	read = NULL;
+
+    if (inflight >= sched->depth || (!read && !write))
+	return -1;
+
+    if (!write)
+	return IO_READ;
+
+    if (!read)
+	return IO_WRITE;
+
+    /* of two expired requests the one queued first goes */
+    if (expired(sched, write, IO_WRITE, now) && (!expired(sched, read, IO_READ, now) || timercmp(&write->queued, &read->queued, <)))
+	return IO_WRITE;
+
+    if (expired(sched, read, IO_READ, now) || sched->starved < SCHED_WRITES_STARVED)
+	return IO_READ;
+
+    return IO_WRITE;
+}
+
+static void dispatch(struct sched_t *sched, struct timeval *now);
+
+static void complete(struct io_t *io)
+{
+    struct sched_t *sched = io->sched;
+    struct sched_class_t *class = &sched->class[io->type];
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    if (io->type == IO_WRITE && sched->vol->track)
+	track_write(sched->vol->track, io->from, io->len);
+
+    if (io->indexed)
+	TAILQ_REMOVE(&sched->index, io, entries);
+
+    /* reads that waited on this one get the same answer, writes it superseded the same outcome */
+    struct io_t *waiter;
+
+    while ((waiter = TAILQ_FIRST(&io->waiters)))
+    {
+	TAILQ_REMOVE(&io->waiters, waiter, entries);
+
+	if (!(waiter->error = io->error) && waiter->type == IO_READ)
+	    memcpy(waiter->buf, io->buf + (waiter->from - io->from), waiter->len);
+
+	waiter->done(waiter);
+    }
+
+    class->inflight--;
+    class->completed++;
+    class->service += tv2dbl(now) - tv2dbl(io->started);
+
+    /* the owner may free the io */
+    io->done = io->complete;
+    io->done(io);
+
+    dispatch(sched, &now);
+}
+
+/* the range of an io sent to the volume stays in the index, in order of offset, until it completes */
+static void submit(struct sched_t *sched, struct io_t *io)
+{
+    struct io_t *at;
+
+    TAILQ_FOREACH_REVERSE(at, &sched->index, sched_index, entries)
+	if (at->from <= io->from)
+	    break;
+
+    if (at)
+	TAILQ_INSERT_AFTER(&sched->index, at, io, entries);
+    else
+	TAILQ_INSERT_HEAD(&sched->index, io, entries);
+
+    io->indexed = 1;
+
+    /* reads already in flight may miss this write, later ones must not share their answer */
+    if (io->type == IO_WRITE)
+	TAILQ_FOREACH(at, &sched->index, entries)
+	{
+	    if (at->from >= io->from + io->len)
+		break;
+
+	    if (at->type == IO_READ && overlap(at, io))
+		at->unshared = 1;
+	}
+
+    if (io->type == IO_WRITE && sched->vol->track)
+	track_write(sched->vol->track, io->from, io->len);
+
+    if (sched->vol->cache)
+	cache_submit(sched->vol->cache, io);
+    else
+	volume_submit(sched->vol, io);
+}
+
+/* a read in flight whose answer covers this read as well */
+static struct io_t *covering(struct sched_t *sched, struct io_t *io)
+{
+    struct io_t *at;
+
+    TAILQ_FOREACH(at, &sched->index, entries)
+    {
+	if (at->from > io->from)
+	    break;
+
+	if (at->type == IO_READ && !at->unshared && at->from + at->len >= io->from + io->len)
+	    return at;
+    }
+
+    return NULL;
+}
+
+/* an io overlapping writes in flight or held before it must wait for them, so a
+ * retransmitted PUT can never land on top of newer data and a read sees every
+ * write sent before it.  a read inside the one write it overlaps is answered
+ * from that write's payload, and a held write a newer one covers is never sent
+ * but completes with it.  a read covered by one already in flight waits for its
+ * answer instead of being sent again.
+ */
+static void start(struct sched_t *sched, struct io_t *io, int fresh)
+{
+    struct io_t *write = NULL, *read, *at, *next, *waiter;
+    unsigned writes = 0;
+
+    if (fresh && io->type == IO_WRITE)
+    {
+	for (at = TAILQ_FIRST(&sched->held); at; at = next)
+	{
+	    next = TAILQ_NEXT(at, entries);
+
+	    if (at->type != IO_WRITE || at->from < io->from || at->from + at->len > io->from + io->len)
+		continue;
+
+	    TAILQ_REMOVE(&sched->held, at, entries);
+	    sched->held_count--;
+	    sched->superseded++;
+
+	    /* along with any it superseded itself */
+	    while ((waiter = TAILQ_FIRST(&at->waiters)))
+	    {
+		TAILQ_REMOVE(&at->waiters, waiter, entries);
+		TAILQ_INSERT_TAIL(&io->waiters, waiter, entries);
+	    }
+
+	    TAILQ_INSERT_TAIL(&io->waiters, at, entries);
+	}
+    }
+
+    TAILQ_FOREACH(at, &sched->index, entries)
+    {
+	if (at->from >= io->from + io->len)
+	    break;
+
+	if (at->type == IO_WRITE && overlap(at, io))
+	    writes++, write = at;
+    }
+
+    TAILQ_FOREACH(at, &sched->held, entries)
+    {
+	if (at == io)
+	    break;
+
+	if (at->type == IO_WRITE && overlap(at, io))
+	    writes++, write = at;
+    }
+
+    int served = io->type == IO_READ && writes == 1
+	&& write->from <= io->from && write->from + write->len >= io->from + io->len;
+
+    if (writes && !served)
+    {
+	if (fresh)
+	{
+	    TAILQ_INSERT_TAIL(&sched->held, io, entries);
+	    sched->held_count++;
+	}
+
+	return;
+    }
+
+    if (!fresh)
+    {
+	TAILQ_REMOVE(&sched->held, io, entries);
+	sched->held_count--;
+    }
+
+    if (served)
+    {
+	memcpy(io->buf, write->buf + (io->from - write->from), io->len);
+	sched->served++;
+	io->done(io);
+    }
+    else if (io->type == IO_READ && (read = covering(sched, io)))
+    {
+	TAILQ_INSERT_TAIL(&read->waiters, io, entries);
+	sched->shared++;
+    }
+    else
+	submit(sched, io);
+}
+
+static void dequeue(struct sched_class_t *class, struct io_t *io, struct timeval *now)
+{
+    double wait = tv2dbl(*now) - tv2dbl(io->queued);
+
+    TAILQ_REMOVE(&class->queue, io, entries);
+    class->queued--;
+    class->dispatched++;
+    class->wait += wait;
+
+    if (wait > class->max_wait)
+	class->max_wait = wait;
+}
+
+/* reads queued together, one of them merged into others */
+struct merge_t {
+    TAILQ_HEAD(, io_t) parts;
+    unsigned nparts;
+};
+
+/* hand each merged read its part of the data */
+static void scatter(struct io_t *io)
+{
+    struct merge_t *merge = io->ctx;
+    struct io_t *part;
+
+    io->sched->class[IO_READ].completed += merge->nparts - 1;
+
+    while ((part = TAILQ_FIRST(&merge->parts)))
+    {
+	TAILQ_REMOVE(&merge->parts, part, entries);
+
+	if (!(part->error = io->error))
+	    memcpy(part->buf, io->buf + (part->from - io->from), part->len);
+
+	part->done(part);
+    }
+
+    free(merge);
+    free(io->buf);
+    free(io);
+}
+
+/* queued reads next to this one are sent with it as one request, as large as a device accepts */
+static struct io_t *merge(struct sched_t *sched, struct io_t *io, struct timeval *now)
+{
+    struct sched_class_t *class = &sched->class[IO_READ];
+    struct merge_t *merge = NULL;
+    uint64_t lo = io->from, hi = io->from + io->len;
+    struct io_t *at;
+
+    for (;;)
+    {
+	TAILQ_FOREACH(at, &class->queue, entries)
+	    if (((at->from == hi && hi + at->len - lo <= PSAN_MAX_LEN)
+		|| (at->from + at->len == lo && hi - at->from <= PSAN_MAX_LEN))
+		&& !behind_write(sched, at))
+		break;
+
+	if (!at)
+	    break;
+
+	if (!merge)
+	{
+	    merge = dup_struct(struct merge_t, .nparts = 1);
+	    TAILQ_INIT(&merge->parts);
+	    TAILQ_INSERT_TAIL(&merge->parts, io, entries);
+	}
+
+	dequeue(class, at, now);
+	TAILQ_INSERT_TAIL(&merge->parts, at, entries);
+	merge->nparts++;
+
+	if (at->from == hi)
+	    hi += at->len;
+	else
+	    lo = at->from;
+    }
+
+    if (!merge)
+	return io;
+
+    sched->merged += merge->nparts - 1;
+
+    io = dup_struct(struct io_t,
+	.type   = IO_READ,
+	.from   = lo,
+	.len    = hi - lo,
+	.ctx    = merge,
+	.done   = scatter,
+	.sched  = sched,
+	.queued = io->queued
+    );
+
+    if (!(io->buf = malloc(io->len)))
+	err(EXIT_FAILURE, "malloc");
+
+    return io;
+}
+
+/* take the next request of a class from its queue, it holds a slot until it completes */
+static struct io_t *take(struct sched_t *sched, int type, struct timeval *now)
+{
+    struct sched_class_t *class = &sched->class[type];
+    struct io_t *io = TAILQ_FIRST(&class->queue);
+
+    dequeue(class, io, now);
+    class->inflight++;
+
+    if (type == IO_READ)
+	io = merge(sched, io, now);
+
+    if (type == IO_WRITE)
+	sched->starved = 0;
+    else if (!TAILQ_EMPTY(&sched->class[IO_WRITE].queue))
+	sched->starved++;
+
+    io->started = *now;
+    io->complete = io->done;
+    io->done = complete;
+    io->indexed = 0;
+    io->unshared = 0;
+    TAILQ_INIT(&io->waiters);
+
+    return io;
+}
+
+static void dispatch(struct sched_t *sched, struct timeval *now)
+{
+    struct io_t *io, *next;
+    int type;
+
+    /* a request completing while one is started comes back here, the outer call goes round again */
+    if (sched->dispatching)
+    {
+	sched->again = 1;
+	return;
+    }
+
+    sched->dispatching = 1;
+
+    do
+    {
+	sched->again = 0;
+
+	/* held requests whose writes have completed go first, in order */
+	for (io = TAILQ_FIRST(&sched->held); io; io = next)
+	{
+	    next = TAILQ_NEXT(io, entries);
+	    start(sched, io, 0);
+	}
+
+	while ((type = choose(sched, now)) >= 0)
+	    start(sched, take(sched, type, now), 1);
+
+    } while (sched->again);
+
+    sched->dispatching = 0;
+}
+
+/* queue a request, it is passed to the volume when its turn comes */
+void sched_submit(struct sched_t *sched, struct io_t *io)
+{
+    struct sched_class_t *class = &sched->class[io->type];
+
+    io->sched = sched;
+    io->order = sched->next_order++;
+    gettimeofday(&io->queued, NULL);
+
+    TAILQ_INSERT_TAIL(&class->queue, io, entries);
+    class->queued++;
+
+    if (!sched->plugged)
+	dispatch(sched, &io->queued);
+}
+
+/* hold requests back while a batch is queued, so neighbours can be merged */
+void sched_plug(struct sched_t *sched)
+{
+    sched->plugged++;
+}
+
+void sched_unplug(struct sched_t *sched)
+{
+    struct timeval now;
+
+    if (--sched->plugged)
+	return;
+
+    gettimeofday(&now, NULL);
+    dispatch(sched, &now);
+}
+
+/* log queue depths and latencies of each class since the last report */
+void sched_report(struct sched_t *sched)
+{
+    for (int i = 0; i < 2; i++)
+    {
+	struct sched_class_t *class = &sched->class[i];
+
+	syslog(LOG_INFO, "%s: %u queued, %u in flight, %lu done, wait %.1fms avg %.1fms max, service %.1fms avg",
+	    class_name[i], class->queued, class->inflight, class->completed,
+	    class->dispatched ? class->wait / class->dispatched * 1000.0 : 0.0, class->max_wait * 1000.0,
+	    class->completed ? class->service / class->completed * 1000.0 : 0.0);
+
+	class->dispatched = class->completed = 0;
+	class->wait = class->max_wait = class->service = 0;
+    }
+
+    if (sched->held_count || sched->served || sched->superseded)
+	syslog(LOG_INFO, "overlapping: %u held, %lu reads answered from pending writes, %lu writes superseded",
+	    sched->held_count, sched->served, sched->superseded);
+
+    if (sched->merged || sched->shared)
+	syslog(LOG_INFO, "%lu reads merged into their neighbours, %lu answered by identical reads in flight",
+	    sched->merged, sched->shared);
+
+    sched->served = sched->superseded = sched->merged = sched->shared = 0;
+}
+
+void sched_poll(struct sched_t *sched, struct timeval *now)
+{
+    dispatch(sched, now);
+
+    if (timercmp(&sched->next_report, now, >))
+	return;
+
+    /* an idle volume is not reported */
+    if (sched->class[IO_READ].dispatched || sched->class[IO_WRITE].dispatched)
+	sched_report(sched);
+
+    sched->next_report = *now;
+    sched->next_report.tv_sec += SCHED_REPORT_INTERVAL;
+}
+
+/* run the timers of every layer, and work out how long the caller may wait for packets */
+struct timeval sched_timers(struct sched_t *sched)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    engine_poll(&now);
+    volume_poll(sched->vol, &now);
+    sched_poll(sched, &now);
+
+    /* setup timeout to handle resubmission, hedging and probes */
+    struct timeval deadline = engine_deadline();
+    double diff = tv2dbl(deadline) - tv2dbl(now);
+    if (diff < 0.001) diff = 0.001;
+
+    return dbl2tv(diff);
+}
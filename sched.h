@@ -0,0 +1,83 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_SCHED_H__
+#define __PSAN_SCHED_H__
+
+#include "volume.h"
+
+/* requests in flight to the volume at once, the rest wait in the scheduler, unless autotune chose otherwise */
+#define SCHED_DEPTH 32
+
+/* slots writes may not take, so a read never waits behind a full queue of them */
+#define SCHED_READ_RESERVE 8
+
+/* seconds a request may wait before it is sent ahead of the other class */
+#define SCHED_READ_EXPIRE 0.1
+#define SCHED_WRITE_EXPIRE 1.0
+
+/* reads preferred in a row while writes are waiting */
+#define SCHED_WRITES_STARVED 4
+
+/* seconds between reports of queue statistics */
+#define SCHED_REPORT_INTERVAL 60
+
+struct sched_class_t {
+    TAILQ_HEAD(, io_t) queue;
+    unsigned queued;
+    unsigned inflight;
+    unsigned long dispatched;
+    unsigned long completed;
+    double wait;
+    double max_wait;
+    double service;
+};
+
+struct sched_t {
+    struct volume_t *vol;
+    unsigned depth;
+    unsigned read_reserve;
+    double expire[2];
+    struct sched_class_t class[2];
+    unsigned starved;
+    int dispatching;
+    int again;
+    int plugged;
+    unsigned long next_order;
+    unsigned long merged;
+    unsigned long shared;
+
+    /* requests waiting for overlapping writes, and ranges sent to the volume */
+    TAILQ_HEAD(, io_t) held;
+    TAILQ_HEAD(sched_index, io_t) index;
+    unsigned held_count;
+    unsigned long served;
+    unsigned long superseded;
+
+    struct timeval next_report;
+};
+
+struct sched_t *sched_open(struct volume_t *vol);
+void sched_submit(struct sched_t *sched, struct io_t *io);
+void sched_plug(struct sched_t *sched);
+void sched_unplug(struct sched_t *sched);
+void sched_poll(struct sched_t *sched, struct timeval *now);
+struct timeval sched_timers(struct sched_t *sched);
+void sched_report(struct sched_t *sched);
+
+#endif /* __PSAN_SCHED_H__ */
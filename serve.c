@@ -0,0 +1,913 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+
+#include "serve.h"
+#include "sched.h"
+#include "xdp.h"
+#include "nbd_wireformat.h"
+
+/* addresses listened on at once */
+#define MAX_LISTEN 8
+
+/* what an export offers, writes complete only once the partitions have acknowledged them */
+#define EXPORT_FLAGS (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_CAN_MULTI_CONN)
+
+enum conn_state_t {
+    CONN_FLAGS,
+    CONN_OPTIONS,
+    CONN_TRANSMISSION
+};
+
+struct conn_t {
+    int fd;
+    char name[32];
+    enum conn_state_t state;
+    int no_zeroes;
+    int structured;
+
+    /* read nothing more and close once every reply is sent, or closed already */
+    int closing;
+    int dead;
+    unsigned inflight;
+
+    uint8_t *in;
+    size_t in_len;
+    size_t in_size;
+
+    uint8_t *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_size;
+
+    TAILQ_ENTRY(conn_t) entries;
+};
+
+struct request_t {
+    struct conn_t *conn;
+    uint64_t handle;
+    uint16_t type;
+    uint64_t from;
+    uint32_t len;
+    uint8_t *buf;
+    unsigned pending;
+    int error;
+    unsigned long seq;
+    TAILQ_ENTRY(request_t) entries;
+};
+
+static struct {
+    struct volume_t *vol;
+    struct sched_t *sched;
+    char *name;
+    int listen[MAX_LISTEN];
+    int nlisten;
+    TAILQ_HEAD(, conn_t) conns;
+    unsigned nconns;
+
+    /* writes in flight in the order they arrived, and flushes waiting for them */
+    TAILQ_HEAD(, request_t) writes;
+    TAILQ_HEAD(, request_t) flushes;
+    unsigned long next_seq;
+} server;
+
+static void conn_close(struct conn_t *conn, const char *why)
+{
+    if (conn->dead)
+	return;
+
+    syslog(LOG_INFO, "%s: %s", conn->name, why ? why : "disconnected");
+
+    close(conn->fd);
+    conn->dead = 1;
+}
+
+static void append(struct conn_t *conn, const void *data, size_t len)
+{
+    if (conn->dead)
+	return;
+
+    if (conn->out_len + len > conn->out_size)
+    {
+	conn->out_size = (conn->out_len + len) * 2;
+
+	if (!(conn->out = realloc(conn->out, conn->out_size)))
+	    err(EXIT_FAILURE, "realloc");
+    }
+
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+}
+
+/* send what the socket takes without blocking */
+static void conn_flush(struct conn_t *conn)
+{
+    while (!conn->dead && conn->out_sent < conn->out_len)
+    {
+	ssize_t ret = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+
+	if (ret < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		conn_close(conn, strerror(errno));
+
+	    break;
+	}
+
+	conn->out_sent += ret;
+    }
+
+    /* keep the unsent tail at the front */
+    if (conn->out_sent > conn->out_len / 2)
+    {
+	memmove(conn->out, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+	conn->out_len -= conn->out_sent;
+	conn->out_sent = 0;
+    }
+
+    if (conn->closing && !conn->inflight && !conn->out_len)
+	conn_close(conn, NULL);
+}
+
+/* the errors the protocol knows have the same numbers as linux */
+static int nbd_error(int error)
+{
+    switch (error)
+    {
+	case 0:
+	case EPERM:
+	case EIO:
+	case ENOMEM:
+	case EINVAL:
+	case ENOSPC:
+	case EOVERFLOW:
+	case ENOTSUP:
+	case ESHUTDOWN:
+	    return error;
+	default:
+	    return EIO;
+    }
+}
+
+static void reply(struct request_t *req)
+{
+    struct conn_t *conn = req->conn;
+    int error = nbd_error(req->error);
+
+    /* reads must be answered in chunks once structured replies are agreed, anything else may be either */
+    if (conn->structured && req->type == NBD_CMD_READ)
+    {
+	struct nbd_structured_reply_t chunk = {
+	    .magic  = htonl(NBD_MAGIC_STRUCTURED_REPLY),
+	    .flags  = htons(NBD_REPLY_FLAG_DONE),
+	    .handle = req->handle
+	};
+
+	if (!error)
+	{
+	    uint64_t from = htonll(req->from);
+
+	    chunk.type = htons(NBD_REPLY_TYPE_OFFSET_DATA);
+	    chunk.len = htonl(sizeof(from) + req->len);
+
+	    append(conn, &chunk, sizeof(chunk));
+	    append(conn, &from, sizeof(from));
+	    append(conn, req->buf, req->len);
+	}
+	else
+	{
+	    /* the error, and an empty message */
+	    uint8_t payload[6] = { 0 };
+	    uint32_t nbd_errno = htonl(error);
+
+	    memcpy(payload, &nbd_errno, sizeof(nbd_errno));
+
+	    chunk.type = htons(NBD_REPLY_TYPE_ERROR);
+	    chunk.len = htonl(sizeof(payload));
+
+	    append(conn, &chunk, sizeof(chunk));
+	    append(conn, payload, sizeof(payload));
+	}
+    }
+    else
+    {
+	struct nbd_simple_reply_t simple = {
+	    .magic  = htonl(NBD_MAGIC_SIMPLE_REPLY),
+	    .error  = htonl(error),
+	    .handle = req->handle
+	};
+
+	append(conn, &simple, sizeof(simple));
+
+	if (!error && req->type == NBD_CMD_READ)
+	    append(conn, req->buf, req->len);
+    }
+}
+
+static void flush_check(void);
+
+static void finish(struct request_t *req)
+{
+    int wrote = req->type == NBD_CMD_WRITE && req->seq;
+
+    if (wrote)
+	TAILQ_REMOVE(&server.writes, req, entries);
+
+    reply(req);
+
+    req->conn->inflight--;
+
+    free(req->buf);
+    free(req);
+
+    if (wrote)
+	flush_check();
+}
+
+/* a flush is answered once every write that arrived before it, on any connection, has completed */
+static void flush_check(void)
+{
+    struct request_t *flush, *write;
+
+    while ((flush = TAILQ_FIRST(&server.flushes)))
+    {
+	if ((write = TAILQ_FIRST(&server.writes)) && write->seq < flush->seq)
+	    return;
+
+	TAILQ_REMOVE(&server.flushes, flush, entries);
+	finish(flush);
+    }
+}
+
+static void serve_done(struct io_t *io)
+{
+    struct request_t *req = io->ctx;
+
+    if (io->error && !req->error)
+	req->error = io->error;
+
+    free(io);
+
+    if (!--req->pending)
+	finish(req);
+}
+
+static int export_known(const uint8_t *name, uint32_t len)
+{
+    /* the default export, or the volume by its first partition */
+    return !len || (len == strlen(server.name) && !memcmp(name, server.name, len));
+}
+
+static void option_reply(struct conn_t *conn, uint32_t option, uint32_t type, const void *data, uint32_t len)
+{
+    struct nbd_option_reply_t reply = {
+	.magic  = htonll(NBD_MAGIC_OPT_REPLY),
+	.option = htonl(option),
+	.type   = htonl(type),
+	.len    = htonl(len)
+    };
+
+    append(conn, &reply, sizeof(reply));
+
+    if (len)
+	append(conn, data, len);
+}
+
+static void conn_go(struct conn_t *conn, uint32_t option, const uint8_t *arg, uint32_t len)
+{
+    uint32_t name_len;
+    uint16_t ninfo;
+    int block_size = 0;
+
+    /* the name, and the information asked for */
+    if (len < sizeof(name_len) + sizeof(ninfo))
+    {
+	option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+	return;
+    }
+
+    memcpy(&name_len, arg, sizeof(name_len));
+    name_len = ntohl(name_len);
+
+    if (name_len > len - sizeof(name_len) - sizeof(ninfo))
+    {
+	option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+	return;
+    }
+
+    memcpy(&ninfo, arg + sizeof(name_len) + name_len, sizeof(ninfo));
+    ninfo = ntohs(ninfo);
+
+    if (len != sizeof(name_len) + name_len + sizeof(ninfo) + ninfo * sizeof(uint16_t))
+    {
+	option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+	return;
+    }
+
+    for (int i = 0; i < ninfo; i++)
+    {
+	uint16_t info;
+
+	memcpy(&info, arg + sizeof(name_len) + name_len + sizeof(ninfo) + i * sizeof(info), sizeof(info));
+
+	if (ntohs(info) == NBD_INFO_BLOCK_SIZE)
+	    block_size = 1;
+    }
+
+    if (!export_known(arg + sizeof(name_len), name_len))
+    {
+	option_reply(conn, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+	return;
+    }
+
+    struct nbd_info_export_t export = {
+	.type  = htons(NBD_INFO_EXPORT),
+	.size  = htonll(server.vol->size),
+	.flags = htons(EXPORT_FLAGS)
+    };
+
+    option_reply(conn, option, NBD_REP_INFO, &export, sizeof(export));
+
+    /* larger requests are split, but 4k ones never need a partial sector */
+    if (block_size)
+    {
+	struct nbd_info_block_size_t size = {
+	    .type      = htons(NBD_INFO_BLOCK_SIZE),
+	    .minimum   = htonl(512),
+	    .preferred = htonl(4096),
+	    .maximum   = htonl(NBD_MAX_LEN)
+	};
+
+	option_reply(conn, option, NBD_REP_INFO, &size, sizeof(size));
+    }
+
+    option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+
+    if (option == NBD_OPT_GO)
+    {
+	conn->state = CONN_TRANSMISSION;
+	syslog(LOG_INFO, "%s: serving %s", conn->name, server.name);
+    }
+}
+
+/* each step returns the input used, none if more is needed or the connection was closed */
+static size_t conn_flags(struct conn_t *conn, const uint8_t *data, size_t avail)
+{
+    uint32_t flags;
+
+    if (avail < sizeof(flags))
+	return 0;
+
+    memcpy(&flags, data, sizeof(flags));
+    flags = ntohl(flags);
+
+    if (flags & ~(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES))
+    {
+	conn_close(conn, "unknown client flags");
+	return 0;
+    }
+
+    conn->no_zeroes = flags & NBD_FLAG_C_NO_ZEROES;
+    conn->state = CONN_OPTIONS;
+
+    return sizeof(flags);
+}
+
+static size_t conn_option(struct conn_t *conn, const uint8_t *data, size_t avail)
+{
+    struct nbd_option_t opt;
+
+    if (avail < sizeof(opt))
+	return 0;
+
+    memcpy(&opt, data, sizeof(opt));
+
+    uint32_t option = ntohl(opt.option);
+    uint32_t len = ntohl(opt.len);
+    const uint8_t *arg = data + sizeof(opt);
+
+    if (ntohll(opt.magic) != NBD_MAGIC_OPTS || len > SERVE_MAX_OPTION)
+    {
+	conn_close(conn, "bad option");
+	return 0;
+    }
+
+    if (avail < sizeof(opt) + len)
+	return 0;
+
+    switch (option)
+    {
+	case NBD_OPT_EXPORT_NAME:
+	{
+	    static const uint8_t zeroes[124];
+	    struct nbd_export_t export = {
+		.size  = htonll(server.vol->size),
+		.flags = htons(EXPORT_FLAGS)
+	    };
+
+	    /* there is no way to refuse but hanging up */
+	    if (!export_known(arg, len))
+	    {
+		conn_close(conn, "unknown export");
+		return 0;
+	    }
+
+	    append(conn, &export, sizeof(export));
+
+	    if (!conn->no_zeroes)
+		append(conn, zeroes, sizeof(zeroes));
+
+	    conn->state = CONN_TRANSMISSION;
+	    syslog(LOG_INFO, "%s: serving %s", conn->name, server.name);
+	    break;
+	}
+	case NBD_OPT_ABORT:
+	    option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+	    conn->closing = 1;
+	    break;
+	case NBD_OPT_LIST:
+	{
+	    uint32_t name_len = strlen(server.name);
+	    uint8_t entry[sizeof(name_len) + name_len];
+	    uint32_t be_len = htonl(name_len);
+
+	    if (len)
+	    {
+		option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+		break;
+	    }
+
+	    memcpy(entry, &be_len, sizeof(be_len));
+	    memcpy(entry + sizeof(be_len), server.name, name_len);
+
+	    option_reply(conn, option, NBD_REP_SERVER, entry, sizeof(entry));
+	    option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+	    break;
+	}
+	case NBD_OPT_INFO:
+	case NBD_OPT_GO:
+	    conn_go(conn, option, arg, len);
+	    break;
+	case NBD_OPT_STRUCTURED_REPLY:
+	    if (len || conn->structured)
+	    {
+		option_reply(conn, option, NBD_REP_ERR_INVALID, NULL, 0);
+		break;
+	    }
+
+	    conn->structured = 1;
+	    option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+	    break;
+	default:
+	    option_reply(conn, option, NBD_REP_ERR_UNSUP, NULL, 0);
+    }
+
+    return sizeof(opt) + len;
+}
+
+static size_t conn_request(struct conn_t *conn, const uint8_t *data, size_t avail)
+{
+    struct nbd_request_t nbd;
+
+    if (avail < sizeof(nbd))
+	return 0;
+
+    memcpy(&nbd, data, sizeof(nbd));
+
+    uint16_t type = ntohs(nbd.type);
+    uint64_t from = ntohll(nbd.from);
+    uint32_t len = ntohl(nbd.len);
+    size_t used = sizeof(nbd) + (type == NBD_CMD_WRITE ? len : 0);
+
+    if (ntohl(nbd.magic) != NBD_MAGIC_REQUEST)
+    {
+	conn_close(conn, "wrong MAGIC");
+	return 0;
+    }
+
+    /* the payload cannot be skipped without reading it */
+    if (type == NBD_CMD_WRITE && len > NBD_MAX_LEN)
+    {
+	conn_close(conn, "write too large");
+	return 0;
+    }
+
+    if (avail < used)
+	return 0;
+
+    if (type == NBD_CMD_DISC)
+    {
+	conn->closing = 1;
+	return used;
+    }
+
+    struct request_t *req = dup_struct(struct request_t,
+	.conn   = conn,
+	.handle = nbd.handle,
+	.type   = type,
+	.from   = from,
+	.len    = len
+    );
+
+    conn->inflight++;
+
+    if (type == NBD_CMD_FLUSH)
+    {
+	req->seq = server.next_seq++;
+	TAILQ_INSERT_TAIL(&server.flushes, req, entries);
+	flush_check();
+	return used;
+    }
+
+    if ((type != NBD_CMD_READ && type != NBD_CMD_WRITE) || !len || len > NBD_MAX_LEN ||
+	(from | len) & (512-1) || from > server.vol->size || len > server.vol->size - from)
+    {
+	req->error = EINVAL;
+	finish(req);
+	return used;
+    }
+
+    if (!(req->buf = malloc(len)))
+	err(EXIT_FAILURE, "malloc");
+
+    if (type == NBD_CMD_WRITE)
+    {
+	memcpy(req->buf, data + sizeof(nbd), len);
+
+	req->seq = server.next_seq++;
+	TAILQ_INSERT_TAIL(&server.writes, req, entries);
+    }
+
+    /* split as the kernel would at the volume's largest request, see volume_max_io() */
+    uint32_t max_io = server.vol->max_io;
+
+    req->pending = (len + max_io - 1) / max_io;
+
+    for (uint32_t offset = 0; offset < len; offset += max_io)
+    {
+	struct io_t *io = dup_struct(struct io_t,
+	    .type = type == NBD_CMD_WRITE ? IO_WRITE : IO_READ,
+	    .from = from + offset,
+	    .len  = len - offset < max_io ? len - offset : max_io,
+	    .buf  = req->buf + offset,
+	    .ctx  = req,
+	    .done = serve_done
+	);
+
+	sched_submit(server.sched, io);
+    }
+
+    return used;
+}
+
+/* act on every complete message at the head of the input, keep the rest */
+static void conn_input(struct conn_t *conn)
+{
+    size_t pos = 0;
+
+    /* requests parsed together are scheduled together */
+    sched_plug(server.sched);
+
+    while (!conn->dead && !conn->closing && conn->inflight < SERVE_MAX_REQUESTS)
+    {
+	const uint8_t *data = conn->in + pos;
+	size_t avail = conn->in_len - pos;
+	size_t used = 0;
+
+	switch (conn->state)
+	{
+	    case CONN_FLAGS:
+		used = conn_flags(conn, data, avail);
+		break;
+	    case CONN_OPTIONS:
+		used = conn_option(conn, data, avail);
+		break;
+	    case CONN_TRANSMISSION:
+		used = conn_request(conn, data, avail);
+		break;
+	}
+
+	if (!used)
+	    break;
+
+	pos += used;
+    }
+
+    sched_unplug(server.sched);
+
+    if (pos < conn->in_len)
+	memmove(conn->in, conn->in + pos, conn->in_len - pos);
+
+    conn->in_len -= pos;
+
+    /* a large write needn't hold its buffer for the life of the connection */
+    if (!conn->in_len && conn->in_size > 16 * SERVE_READ)
+    {
+	free(conn->in);
+	conn->in = NULL;
+	conn->in_size = 0;
+    }
+}
+
+static void conn_read(struct conn_t *conn)
+{
+    ssize_t ret;
+
+    if (conn->in_size - conn->in_len < SERVE_READ)
+    {
+	conn->in_size = conn->in_size * 2 > conn->in_len + SERVE_READ ? conn->in_size * 2 : conn->in_len + SERVE_READ;
+
+	if (!(conn->in = realloc(conn->in, conn->in_size)))
+	    err(EXIT_FAILURE, "realloc");
+    }
+
+    if ((ret = _read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len)) < 0 &&
+	(errno == EAGAIN || errno == EWOULDBLOCK))
+	return;
+
+    if (ret <= 0)
+    {
+	conn_close(conn, ret ? strerror(errno) : NULL);
+	return;
+    }
+
+    conn->in_len += ret;
+
+    conn_input(conn);
+}
+
+/* whether a connection may take more requests */
+static int conn_wants_input(struct conn_t *conn)
+{
+    return !conn->dead && !conn->closing && conn->inflight < SERVE_MAX_REQUESTS &&
+	conn->out_len - conn->out_sent < SERVE_MAX_OUTPUT;
+}
+
+static void serve_accept(int listen_fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+
+    if ((fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_len)) < 0)
+    {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+	    syslog(LOG_WARNING, "accept: %s", strerror(errno));
+	return;
+    }
+
+    if (server.nconns == SERVE_MAX_CONNS || fd >= FD_SETSIZE)
+    {
+	syslog(LOG_WARNING, "too many connections");
+	close(fd);
+	return;
+    }
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+	err(EXIT_FAILURE, "fcntl");
+
+    struct conn_t *conn = dup_struct(struct conn_t, .fd = fd, .state = CONN_FLAGS);
+
+    if (addr.ss_family == AF_INET)
+    {
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+	int one = 1;
+
+	/* replies are whole when appended, there is nothing to wait for */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+	    syslog(LOG_WARNING, "setsockopt(TCP_NODELAY): %s", strerror(errno));
+
+	snprintf(conn->name, sizeof(conn->name), "%s:%u", inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+    }
+    else
+	snprintf(conn->name, sizeof(conn->name), "local %d", fd);
+
+    struct nbd_hello_t hello = {
+	.magic      = htonll(NBD_MAGIC_INIT),
+	.opts_magic = htonll(NBD_MAGIC_OPTS),
+	.flags      = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES)
+    };
+
+    append(conn, &hello, sizeof(hello));
+
+    TAILQ_INSERT_TAIL(&server.conns, conn, entries);
+    server.nconns++;
+
+    syslog(LOG_INFO, "%s: connected", conn->name);
+}
+
+/* a path holding a '/' is a unix socket, anything else is [address:]port or address */
+static int serve_listen(char *address)
+{
+    int fd;
+    int one = 1;
+
+    if (strchr(address, '/'))
+    {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct stat sb;
+
+	if (strlen(address) >= sizeof(sun.sun_path))
+	    errx(EXIT_FAILURE, "socket path too long: %s", address);
+
+	strcpy(sun.sun_path, address);
+
+	/* a socket left behind by an earlier run */
+	if (!stat(address, &sb) && S_ISSOCK(sb.st_mode))
+	    unlink(address);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	    err(EXIT_FAILURE, "socket");
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+	    err(EXIT_FAILURE, "bind(%s)", address);
+    }
+    else
+    {
+	struct sockaddr_in sin = {
+	    .sin_family      = AF_INET,
+	    .sin_port        = htons(NBD_DEFAULT_PORT),
+	    .sin_addr.s_addr = htonl(INADDR_ANY)
+	};
+	char *port = strrchr(address, ':');
+	char *host = address;
+
+	if (!port && strspn(address, "0123456789") == strlen(address))
+	{
+	    port = address;
+	    host = "";
+	}
+	else if (port)
+	    *port++ = '\0';
+
+	if (*host && !inet_aton(host, &sin.sin_addr))
+	    errx(EXIT_FAILURE, "bad listen address, expected a.b.c.d: %s", host);
+
+	if (port && (atoi(port) <= 0 || atoi(port) > 65535))
+	    errx(EXIT_FAILURE, "bad listen port: %s", port);
+
+	if (port)
+	    sin.sin_port = htons(atoi(port));
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	    err(EXIT_FAILURE, "socket");
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+	    err(EXIT_FAILURE, "setsockopt(SO_REUSEADDR)");
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+	    err(EXIT_FAILURE, "bind(%s:%u)", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+    }
+
+    if (listen(fd, 16) < 0)
+	err(EXIT_FAILURE, "listen");
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+	err(EXIT_FAILURE, "fcntl");
+
+    return fd;
+}
+
+static void serve_loop(void)
+{
+    fd_set rset, wset;
+    struct conn_t *conn, *next;
+    int ret;
+
+    for (;;)
+    {
+	struct timeval now;
+	struct timeval timeout = sched_timers(server.sched);
+
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+
+	int max = engine_fdset(&rset);
+
+	for (int i = 0; i < server.nlisten; i++)
+	{
+	    FD_SET(server.listen[i], &rset);
+
+	    if (server.listen[i] > max)
+		max = server.listen[i];
+	}
+
+	TAILQ_FOREACH(conn, &server.conns, entries)
+	{
+	    if (conn->dead)
+		continue;
+
+	    if (conn_wants_input(conn))
+		FD_SET(conn->fd, &rset);
+
+	    if (conn->out_sent < conn->out_len)
+		FD_SET(conn->fd, &wset);
+
+	    if (conn->fd > max)
+		max = conn->fd;
+	}
+
+	if ((ret = _select(max+1, &rset, &wset, NULL, &timeout)) < 0)
+	    err(EXIT_FAILURE, "select");
+
+	for (int i = 0; i < server.nlisten; i++)
+	    if (FD_ISSET(server.listen[i], &rset))
+		serve_accept(server.listen[i]);
+
+	TAILQ_FOREACH(conn, &server.conns, entries)
+	    if (!conn->dead && FD_ISSET(conn->fd, &rset) && conn_wants_input(conn))
+		conn_read(conn);
+
+	for (int i = 0; i < npaths; i++)
+	{
+	    uint8_t buf[65536];
+
+	    if (!FD_ISSET(paths[i].sock, &rset))
+		continue;
+
+	    if ((ret = _recv(paths[i].sock, buf, sizeof(buf), 0)) < 0)
+		err(EXIT_FAILURE, "recv");
+
+	    gettimeofday(&now, NULL);
+
+	    engine_receive(&paths[i], buf, ret, &now);
+	}
+
+	xdp_receive(&rset);
+
+	/* completions may have made room for buffered requests, and queued replies */
+	for (conn = TAILQ_FIRST(&server.conns); conn; conn = next)
+	{
+	    next = TAILQ_NEXT(conn, entries);
+
+	    if (!conn->dead && conn->in_len)
+		conn_input(conn);
+
+	    conn_flush(conn);
+
+	    if (conn->dead && !conn->inflight)
+	    {
+		TAILQ_REMOVE(&server.conns, conn, entries);
+		server.nconns--;
+
+		free(conn->in);
+		free(conn->out);
+		free(conn);
+	    }
+	}
+    }
+}
+
+void psan_serve(char *listen, char **ids, int nids, struct volume_opts_t *opts)
+{
+    TAILQ_INIT(&server.conns);
+    TAILQ_INIT(&server.writes);
+    TAILQ_INIT(&server.flushes);
+
+    /* several addresses may be given, comma separated */
+    for (char *address = strtok(listen, ","); address; address = strtok(NULL, ","))
+    {
+	if (server.nlisten == MAX_LISTEN)
+	    errx(EXIT_FAILURE, "too many listen addresses, at most %d are supported", MAX_LISTEN);
+
+	server.listen[server.nlisten++] = serve_listen(address);
+    }
+
+    /* resolve and size every partition */
+    server.vol = volume_open(ids, nids, opts);
+    server.sched = sched_open(server.vol);
+    server.name = ids[0];
+    server.next_seq = 1;
+
+    if (!debug)
+	if (daemon(0, 0) < 0)
+	    err(EXIT_FAILURE, "daemon(0, 0)");
+
+    syslog(LOG_INFO, "serving %s, %llu bytes", server.name, (unsigned long long)server.vol->size);
+
+    serve_loop();
+}
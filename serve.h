@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_SERVE_H__
+#define __PSAN_SERVE_H__
+
+#include "volume.h"
+
+/* clients served at once, each holds a descriptor of the select() loop */
+#define SERVE_MAX_CONNS 256
+
+/* requests of one connection in flight, reading stops beyond this */
+#define SERVE_MAX_REQUESTS 128
+
+/* replies of one connection waiting for a slow client, reading stops beyond this */
+#define SERVE_MAX_OUTPUT (8 << 20)
+
+/* bytes read from a connection at once */
+#define SERVE_READ 65536
+
+/* longest option accepted during negotiation */
+#define SERVE_MAX_OPTION 4096
+
+void psan_serve(char *listen, char **ids, int nids, struct volume_opts_t *opts);
+
+#endif /* __PSAN_SERVE_H__ */
@@ -0,0 +1,203 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <err.h>
+#include <syslog.h>
+
+#include "track.h"
+#include "util.h"
+
+#define map_words(nbits) (((nbits) + 63) / 64)
+#define map_len(nbits) (TRACK_MAP_OFFSET + map_words(nbits) * sizeof(uint64_t))
+
+static struct track_t *track_map(char *path, int flags)
+{
+    struct track_t *track = dup_struct(struct track_t, .path = path);
+
+    if ((track->fd = open(path, flags, 0600)) < 0)
+	err(EXIT_FAILURE, "open(%s)", path);
+
+    return track;
+}
+
+static void track_mmap(struct track_t *track, uint64_t nbits)
+{
+    uint8_t *base;
+
+    if ((base = mmap(NULL, map_len(nbits), PROT_READ | PROT_WRITE, MAP_SHARED, track->fd, 0)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(%s)", track->path);
+
+    track->nbits = nbits;
+    track->header = (struct track_header_t *)base;
+    track->map = (uint64_t *)(base + TRACK_MAP_OFFSET);
+}
+
+static void track_sync(struct track_t *track, void *from, size_t len)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)from & ~(page - 1);
+
+    if (msync((void *)start, (uintptr_t)from + len - start, MS_SYNC) < 0)
+	err(EXIT_FAILURE, "msync(%s)", track->path);
+}
+
+/* open or create the changed-block map of a volume of size bytes */
+struct track_t *track_open(char *path, uint64_t size)
+{
+    struct track_t *track = track_map(path, O_RDWR | O_CREAT);
+    uint64_t nbits = (size + TRACK_REGION - 1) / TRACK_REGION;
+    struct track_header_t header;
+
+    if (pread(track->fd, &header, sizeof(header), 0) == sizeof(header))
+    {
+	if (header.magic != TRACK_MAGIC || header.size != size || header.region_size != TRACK_REGION)
+	    errx(EXIT_FAILURE, "%s: changed-block map does not match this volume", path);
+
+	track_mmap(track, nbits);
+
+	return track;
+    }
+
+    /* nothing is known about writes before the map existed, the first backup is a full one */
+    if (ftruncate(track->fd, map_len(nbits)) < 0)
+	err(EXIT_FAILURE, "ftruncate(%s)", path);
+
+    track_mmap(track, nbits);
+
+    *track->header = (struct track_header_t){
+	.magic       = TRACK_MAGIC,
+	.region_size = TRACK_REGION,
+	.nbits       = nbits,
+	.size        = size,
+	.generation  = 1
+    };
+    snprintf(track->header->checkpoint, sizeof(track->header->checkpoint), "%s", TRACK_FIRST);
+
+    track_sync(track, track->header, map_len(nbits));
+
+    syslog(LOG_INFO, "%s: tracking changed blocks from checkpoint %s", path, TRACK_FIRST);
+
+    return track;
+}
+
+/* called as a write is sent and again as it completes, so a write in flight across
+ * a checkpoint counts on both sides of it.  a region is durably marked before its
+ * first write is sent, a crash can not lose a change
+ */
+void track_write(struct track_t *track, uint64_t from, uint32_t len)
+{
+    uint64_t first = from / TRACK_REGION;
+    uint64_t last = (from + len - 1) / TRACK_REGION;
+    uint64_t *lo = NULL, *hi = NULL;
+
+    for (uint64_t region = first; region <= last && region < track->nbits; region++)
+    {
+	uint64_t *word = &track->map[region / 64];
+	uint64_t bit = (uint64_t)1 << (region % 64);
+
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) & bit)
+	    continue;
+
+	__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL);
+
+	if (!lo)
+	    lo = word;
+	hi = word;
+    }
+
+    if (lo)
+	track_sync(track, lo, (hi - lo + 1) * sizeof(*hi));
+}
+
+/* print the extents written since checkpoint since and start checkpoint name, as one step */
+void psan_checkpoint(char *path, char *since, char *name)
+{
+    struct track_t *track = track_map(path, O_RDWR);
+    struct track_header_t header;
+
+    /* checkpoints are taken one at a time, the volume keeps writing meanwhile */
+    if (flock(track->fd, LOCK_EX) < 0)
+	err(EXIT_FAILURE, "flock(%s)", path);
+
+    if (pread(track->fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != TRACK_MAGIC)
+	errx(EXIT_FAILURE, "%s: not a changed-block map", path);
+
+    if (strncmp(header.checkpoint, since, sizeof(header.checkpoint)))
+	errx(EXIT_FAILURE, "%s: at checkpoint %.*s, not %s, a full backup is needed", path,
+	    (int)sizeof(header.checkpoint), header.checkpoint, since);
+
+    if (strlen(name) >= sizeof(header.checkpoint))
+	errx(EXIT_FAILURE, "checkpoint name too long: %s", name);
+
+    track_mmap(track, header.nbits);
+
+    uint64_t *changed;
+
+    if (!(changed = malloc(map_words(header.nbits) * sizeof(uint64_t))))
+	err(EXIT_FAILURE, "malloc");
+
+    for (uint64_t i = 0; i < map_words(header.nbits); i++)
+	changed[i] = __atomic_exchange_n(&track->map[i], 0, __ATOMIC_ACQ_REL);
+
+    /* should the extents go missing the names no longer match, and the next backup is a full one */
+    track->header->generation++;
+    memset(track->header->checkpoint, 0, sizeof(track->header->checkpoint));
+    memcpy(track->header->checkpoint, name, strlen(name));
+
+    track_sync(track, track->header, map_len(header.nbits));
+
+    uint64_t extents = 0, bytes = 0;
+
+    for (uint64_t region = 0; region < header.nbits; )
+    {
+	if (!(changed[region / 64] & ((uint64_t)1 << (region % 64))))
+	{
+	    region++;
+	    continue;
+	}
+
+	uint64_t start = region;
+
+	while (region < header.nbits && changed[region / 64] & ((uint64_t)1 << (region % 64)))
+	    region++;
+
+	uint64_t offset = start * TRACK_REGION;
+	uint64_t len = (region - start) * TRACK_REGION;
+
+	if (offset + len > header.size)
+	    len = header.size - offset;
+
+	printf("%llu %llu\n", (unsigned long long)offset, (unsigned long long)len);
+
+	extents++;
+	bytes += len;
+    }
+
+    if (fflush(stdout) == EOF)
+	err(EXIT_FAILURE, "stdout");
+
+    fprintf(stderr, "%llu bytes in %llu extents changed since %s, now at %s, generation %llu\n",
+	(unsigned long long)bytes, (unsigned long long)extents, since, name,
+	(unsigned long long)track->header->generation);
+
+    free(changed);
+}
@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_TRACK_H__
+#define __PSAN_TRACK_H__
+
+#include <stdint.h>
+
+#define TRACK_MAGIC 0x50534e54 /* PSNT */
+
+/* bytes of the volume each bit of a changed-block map stands for */
+#define TRACK_REGION 65536
+
+/* the header has a page of its own, so the map starts page aligned */
+#define TRACK_MAP_OFFSET 4096
+
+/* name of the checkpoint a new map starts from */
+#define TRACK_FIRST "start"
+
+struct track_header_t {
+    uint32_t magic;
+    uint32_t region_size;
+    uint64_t nbits;
+    uint64_t size;
+    uint64_t generation;
+    char checkpoint[64];
+} __attribute__((__packed__));
+
+/* regions written since the last checkpoint, mapped shared so a checkpoint may be
+ * taken by another process while the volume is in use
+ */
+struct track_t {
+    char *path;
+    int fd;
+    uint64_t nbits;
+    struct track_header_t *header;
+    uint64_t *map;
+};
+
+struct track_t *track_open(char *path, uint64_t size);
+void track_write(struct track_t *track, uint64_t from, uint32_t len);
+void psan_checkpoint(char *path, char *since, char *name);
+
+#endif /* __PSAN_TRACK_H__ */
@@ -0,0 +1,322 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <syslog.h>
+#include <linux/ublk_cmd.h>
+
+#include "ublk.h"
+#include "sched.h"
+#include "uring.h"
+#include "autotune.h"
+#include "ctl.h"
+#include "affinity.h"
+
+/* completion tags of the loop, below them are paths */
+#define TAG_CTL  URING_MAX_RECV
+#define TAG_UBLK (URING_MAX_RECV + 1)
+
+static struct {
+    int fd;
+    struct ublksrv_io_desc *descs;
+    uint8_t *bufs;
+    struct volume_t *vol;
+    struct sched_t *sched;
+    int stopped;
+    int ctl;
+} ublk;
+
+/* later kernels take commands encoded like ioctls, and may take nothing else */
+static int encoded;
+
+#define OP(nr, type) (encoded ? (uint32_t)_IOWR('u', (nr), type) : (nr))
+
+static int ctrl(int ctrl_fd, unsigned nr, uint32_t dev_id, void *buf, size_t len, uint64_t data)
+{
+    struct ublksrv_ctrl_cmd cmd = {
+	.dev_id   = dev_id,
+	.queue_id = (uint16_t)-1,
+	.len      = len,
+	.addr     = (uintptr_t)buf,
+	.data     = { data }
+    };
+
+    return uring_cmd_sync(ctrl_fd, OP(nr, struct ublksrv_ctrl_cmd), &cmd, sizeof(cmd));
+}
+
+/* each tag has a buffer the kernel copies data to or from */
+static uint8_t *tag_buf(unsigned n)
+{
+    return ublk.bufs + (size_t)n * VOLUME_MAX_IO;
+}
+
+/* wait for the next request on a tag, answering the previous one if this is not the first */
+static void fetch(unsigned n, unsigned nr, int result)
+{
+    struct ublksrv_io_cmd cmd = {
+	.q_id   = 0,
+	.tag    = n,
+	.result = result,
+	.addr   = (uintptr_t)tag_buf(n)
+    };
+
+    uring_cmd(ublk.fd, OP(nr, struct ublksrv_io_cmd), &cmd, sizeof(cmd), TAG_UBLK + n);
+}
+
+static void ublk_done(struct io_t *io)
+{
+    fetch((uintptr_t)io->ctx, UBLK_IO_COMMIT_AND_FETCH_REQ, io->error ? -io->error : (int)io->len);
+
+    free(io);
+}
+
+/* the request is read and written in place, no copy is made on this side */
+static void ublk_request(unsigned n)
+{
+    const struct ublksrv_io_desc *desc = &ublk.descs[n];
+    uint64_t from = desc->start_sector << 9;
+    uint32_t len = desc->nr_sectors << 9;
+    enum io_type_t type;
+
+    switch (ublksrv_get_op(desc))
+    {
+	case UBLK_IO_OP_READ:
+	    type = IO_READ;
+	    break;
+	case UBLK_IO_OP_WRITE:
+	    type = IO_WRITE;
+	    break;
+	case UBLK_IO_OP_FLUSH:
+	    /* writes complete once acknowledged by the partitions, there is no cache to flush */
+	    fetch(n, UBLK_IO_COMMIT_AND_FETCH_REQ, 0);
+	    return;
+	default:
+	    fetch(n, UBLK_IO_COMMIT_AND_FETCH_REQ, -EOPNOTSUPP);
+	    return;
+    }
+
+    if (!len || len > VOLUME_MAX_IO || from + len > ublk.vol->size)
+    {
+	syslog(LOG_ERR, "request outside the volume: %llu+%u", (unsigned long long)from, len);
+	fetch(n, UBLK_IO_COMMIT_AND_FETCH_REQ, -EINVAL);
+	return;
+    }
+
+    struct io_t *io = dup_struct(struct io_t,
+	.type = type,
+	.from = from,
+	.len  = len,
+	.buf  = tag_buf(n),
+	.ctx  = (void *)(uintptr_t)n,
+	.done = ublk_done
+    );
+
+    sched_submit(ublk.sched, io);
+}
+
+static void ublk_completion(uint32_t tag, int res, uint8_t *buf)
+{
+    struct timeval now;
+
+    if (tag < TAG_CTL)
+    {
+	gettimeofday(&now, NULL);
+	engine_receive(&paths[tag], buf, res, &now);
+    }
+    else if (tag == TAG_CTL)
+    {
+	ctl_receive(NULL);
+	uring_poll(ublk.ctl, TAG_CTL);
+    }
+    else if (res == UBLK_IO_RES_OK)
+	ublk_request(tag - TAG_UBLK);
+    else
+    {
+	/* the device is going away, the tag is not fetched again */
+	if (res != UBLK_IO_RES_ABORT)
+	    syslog(LOG_ERR, "ublk tag %u: %s", tag - TAG_UBLK, strerror(-res));
+
+	ublk.stopped++;
+    }
+}
+
+/* serve the queue from the one loop the engine runs in, until the device is stopped */
+static void ublk_serve(unsigned dev_id)
+{
+    char path[32];
+    unsigned tags = UBLK_DEPTH;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t desc_len = (UBLK_DEPTH * sizeof(struct ublksrv_io_desc) + page - 1) & ~(page - 1);
+
+    snprintf(path, sizeof(path), "/dev/ublkc%u", dev_id);
+
+    /* udev may not have created the node yet */
+    for (int tries = 0; (ublk.fd = open(path, O_RDWR)) < 0; tries++)
+    {
+	if (errno != ENOENT || tries == 100)
+	    err(EXIT_FAILURE, "open(%s)", path);
+
+	usleep(10000);
+    }
+
+    if ((ublk.descs = mmap(NULL, desc_len, PROT_READ, MAP_SHARED | MAP_POPULATE,
+	ublk.fd, UBLKSRV_CMD_BUF_OFFSET)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(%s)", path);
+
+    if ((ublk.bufs = mmap(NULL, (size_t)tags * VOLUME_MAX_IO, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap");
+
+    if (uring_init(NULL, 0) < 0)
+	err(EXIT_FAILURE, "io_uring");
+
+    engine_sendto = uring_sendto;
+
+    for (int i = 0; i < npaths; i++)
+	uring_recv(paths[i].sock, i);
+
+    for (unsigned n = 0; n < tags; n++)
+	fetch(n, UBLK_IO_FETCH_REQ, 0);
+
+    snprintf(path, sizeof(path), "ublkb%u", dev_id);
+
+    if ((ublk.ctl = ctl_open(path, ublk.sched)) >= 0)
+	uring_poll(ublk.ctl, TAG_CTL);
+
+    while (ublk.stopped < tags)
+    {
+	struct timeval timeout = sched_timers(ublk.sched);
+
+	/* requests arriving together are scheduled together */
+	sched_plug(ublk.sched);
+	uring_wait(&timeout, ublk_completion);
+	sched_unplug(ublk.sched);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+void psan_attach_ublk(char **ids, int nids, struct volume_opts_t *opts)
+{
+    int ctrl_fd;
+    int ret;
+
+    if ((ctrl_fd = open("/dev/ublk-control", O_RDWR)) < 0)
+	err(EXIT_FAILURE, "open(/dev/ublk-control)");
+
+    /* resolve and size every partition */
+    ublk.vol = volume_open(ids, nids, opts);
+    ublk.sched = sched_open(ublk.vol);
+
+    /* one queue: the engine runs in a single loop, queues for more cpus would only be
+     * drained by the same thread
+     */
+    struct ublksrv_ctrl_dev_info info = {
+	.nr_hw_queues     = 1,
+	.queue_depth      = UBLK_DEPTH,
+	.max_io_buf_bytes = VOLUME_MAX_IO,
+	.dev_id           = -1
+    };
+
+    if ((ret = ctrl(ctrl_fd, UBLK_CMD_ADD_DEV, -1, &info, sizeof(info), 0)) == -EOPNOTSUPP)
+    {
+	encoded = 1;
+	ret = ctrl(ctrl_fd, UBLK_CMD_ADD_DEV, -1, &info, sizeof(info), 0);
+    }
+
+    if (ret < 0)
+    {
+	errno = -ret;
+	err(EXIT_FAILURE, "ublk add");
+    }
+
+    /* keep kernel requests within what the volume handles well, see volume_max_io() */
+    struct ublk_params params = {
+	.len   = sizeof(params),
+	.types = UBLK_PARAM_TYPE_BASIC,
+	.basic = {
+	    .logical_bs_shift  = 9,
+	    .physical_bs_shift = 12,
+	    .max_sectors       = ublk.vol->max_io >> 9,
+	    .dev_sectors       = ublk.vol->size >> 9
+	}
+    };
+
+    if ((ret = ctrl(ctrl_fd, UBLK_CMD_SET_PARAMS, info.dev_id, &params, sizeof(params), 0)) < 0)
+    {
+	ctrl(ctrl_fd, UBLK_CMD_DEL_DEV, info.dev_id, NULL, 0, 0);
+	errno = -ret;
+	err(EXIT_FAILURE, "ublk set params");
+    }
+
+    fprintf(stdout, "/dev/ublkb%u\n", info.dev_id);
+    fflush(stdout);
+
+    if (!debug)
+	if (daemon(0, 0) < 0)
+	    err(EXIT_FAILURE, "daemon(0, 0)");
+
+    /* fork worker threads */
+    pid_t pid;
+    if ((pid = fork()) < 0)
+	err(EXIT_FAILURE, "fork");
+
+    /* child */
+    if (!pid)
+    {
+	close(ctrl_fd);
+
+	if (opts->affinity)
+	    volume_affinity(ublk.vol, opts);
+
+	ublk_serve(info.dev_id);
+    }
+
+    /* parent, starting the device waits for every tag to be fetched */
+    for (int i = 0; i < npaths; i++)
+	close(paths[i].sock);
+
+    if ((ret = ctrl(ctrl_fd, UBLK_CMD_START_DEV, info.dev_id, NULL, 0, pid)) < 0)
+    {
+	syslog(LOG_ERR, "ublk start: %s", strerror(-ret));
+	kill(pid, SIGTERM);
+    }
+    else
+    {
+	char device[32];
+
+	snprintf(device, sizeof(device), "ublkb%u", info.dev_id);
+	volume_queue_limits(ublk.vol, device);
+
+	syslog(LOG_INFO, "attached /dev/ublkb%u", info.dev_id);
+    }
+
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+	;
+
+    ctrl(ctrl_fd, UBLK_CMD_STOP_DEV, info.dev_id, NULL, 0, 0);
+
+    if ((ret = ctrl(ctrl_fd, UBLK_CMD_DEL_DEV, info.dev_id, NULL, 0, 0)) < 0)
+	syslog(LOG_WARNING, "ublk del: %s", strerror(-ret));
+
+    close(ctrl_fd);
+}
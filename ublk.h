@@ -0,0 +1,29 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_UBLK_H__
+#define __PSAN_UBLK_H__
+
+#include "volume.h"
+
+/* requests the queue holds, the scheduler only sends SCHED_DEPTH at once anyway */
+#define UBLK_DEPTH 32
+
+void psan_attach_ublk(char **ids, int nids, struct volume_opts_t *opts);
+
+#endif /* __PSAN_UBLK_H__ */
@@ -0,0 +1,435 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <syslog.h>
+
+#include "uring.h"
+
+/* what a completion belongs to, kept in the top half of its user data */
+enum {
+    KIND_RECV = 1,
+    KIND_SEND,
+    KIND_IO
+};
+
+#define USER_DATA(kind, tag) ((uint64_t)(kind) << 32 | (tag))
+
+struct send_slot_t {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in to;
+    int next_free;
+};
+
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    /* provided buffer ring the kernel picks receive buffers from */
+    struct io_uring_buf_ring *br;
+    uint16_t br_tail;
+
+    /* receive buffers, then send slots */
+    uint8_t *pool;
+    struct send_slot_t slots[URING_SEND_SLOTS];
+    int free_slot;
+
+    int recv_sock[URING_MAX_RECV];
+} ring;
+
+static int uring_register(unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, ring.fd, op, arg, n);
+}
+
+static uint8_t *slot_buf(int slot)
+{
+    return ring.pool + (size_t)(URING_RECV_BUFS + slot) * URING_SLOT;
+}
+
+/* hand a receive buffer (back) to the kernel */
+static void recycle(uint16_t bid)
+{
+    struct io_uring_buf *buf = &ring.br->bufs[ring.br_tail & (URING_RECV_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(ring.pool + (size_t)bid * URING_SLOT);
+    buf->len = URING_SLOT;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring.br->tail, ++ring.br_tail, __ATOMIC_RELEASE);
+}
+
+/* returns -1 if the kernel lacks what is needed, the caller falls back to select() */
+int uring_init(void *fixed, size_t fixed_len)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+	return -1;
+
+    /* timed waits and a single ring mapping, both linux 5.11 */
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+	close(ring.fd);
+	errno = ENOSYS;
+	return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uint8_t *rings;
+
+    if ((rings = mmap(NULL, sq_len > cq_len ? sq_len : cq_len, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(IORING_OFF_SQ_RING)");
+
+    if ((ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(IORING_OFF_SQES)");
+
+    ring.sq_head = (unsigned *)(rings + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(rings + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(rings + p.sq_off.array);
+    ring.cq_head = (unsigned *)(rings + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(rings + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    ring.sq_entries = p.sq_entries;
+
+    /* the packet pool */
+    if ((ring.pool = mmap(NULL, (size_t)(URING_RECV_BUFS + URING_SEND_SLOTS) * URING_SLOT, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap");
+
+    if ((ring.br = mmap(NULL, URING_RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap");
+
+    struct io_uring_buf_reg reg = {
+	.ring_addr    = (uintptr_t)ring.br,
+	.ring_entries = URING_RECV_BUFS,
+	.bgid         = 0
+    };
+
+    /* provided buffer rings are linux 5.19 */
+    if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+	close(ring.fd);
+	return -1;
+    }
+
+    for (int i = 0; i < URING_RECV_BUFS; i++)
+	recycle(i);
+
+    for (int i = 0; i < URING_SEND_SLOTS; i++)
+	ring.slots[i].next_free = i + 1 < URING_SEND_SLOTS ? i + 1 : -1;
+
+    ring.free_slot = 0;
+
+    /* the caller's buffer is read into without the kernel mapping it each time */
+    if (fixed)
+    {
+	struct iovec iov = { .iov_base = fixed, .iov_len = fixed_len };
+
+	if (uring_register(IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+	    err(EXIT_FAILURE, "io_uring_register(IORING_REGISTER_BUFFERS)");
+    }
+
+    return 0;
+}
+
+/* submit what has been queued, and wait for a completion if a timeout is given */
+static void enter(struct timeval *timeout)
+{
+    unsigned submit = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    int ret;
+
+    memset(&arg, 0, sizeof(arg));
+
+    if (timeout)
+    {
+	ts = (struct __kernel_timespec){ .tv_sec = timeout->tv_sec, .tv_nsec = timeout->tv_usec * 1000 };
+	arg.ts = (uintptr_t)&ts;
+    }
+
+    ret = syscall(__NR_io_uring_enter, ring.fd, submit, timeout ? 1 : 0,
+	timeout ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0,
+	timeout ? &arg : NULL, timeout ? sizeof(arg) : 0);
+
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+	err(EXIT_FAILURE, "io_uring_enter");
+}
+
+/* the kernel only looks at the queue when entered, so an entry may be published before it is filled */
+static struct io_uring_sqe *get_sqe(void)
+{
+    unsigned tail = *ring.sq_tail;
+
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries)
+	enter(NULL);
+
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries)
+	errx(EXIT_FAILURE, "io_uring submission queue full");
+
+    struct io_uring_sqe *sqe = &ring.sqes[tail & *ring.sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/* receive datagrams from a socket until told otherwise, each into a buffer of the pool */
+void uring_recv(int sock, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    ring.recv_sock[tag] = sock;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = USER_DATA(KIND_RECV, tag);
+}
+
+/* a sendto() that is only queued, the packet is copied so the caller may reuse it */
+ssize_t uring_sendto(int sock, const void *buf, size_t len, const struct sockaddr_in *to)
+{
+    /* out of slots, send it straight away */
+    if (ring.free_slot < 0 || len > URING_SLOT)
+	return _sendto(sock, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
+
+    int slot = ring.free_slot;
+    struct send_slot_t *s = &ring.slots[slot];
+
+    ring.free_slot = s->next_free;
+
+    memcpy(slot_buf(slot), buf, len);
+
+    s->to = *to;
+    s->iov = (struct iovec){ .iov_base = slot_buf(slot), .iov_len = len };
+    s->msg = (struct msghdr){
+	.msg_name    = &s->to,
+	.msg_namelen = sizeof(s->to),
+	.msg_iov     = &s->iov,
+	.msg_iovlen  = 1
+    };
+
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t)&s->msg;
+    sqe->len = 1;
+    sqe->user_data = USER_DATA(KIND_SEND, slot);
+
+    return len;
+}
+
+/* read into the buffer given to uring_init() */
+void uring_read_fixed(int fd, void *buf, unsigned len, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = -1;
+    sqe->buf_index = 0;
+    sqe->user_data = USER_DATA(KIND_IO, tag);
+}
+
+/* the buffer must stay untouched until the completion */
+void uring_send(int fd, const void *buf, unsigned len, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = USER_DATA(KIND_IO, tag);
+}
+
+/* completes once fd is readable, the caller arms it again after each */
+void uring_poll(int fd, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = USER_DATA(KIND_IO, tag);
+}
+
+/* a command to the driver behind fd, completed like a read */
+void uring_cmd(int fd, uint32_t op, const void *cmd, size_t len, uint32_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    /* the payload shares the tail of an ordinary 64 byte entry */
+    if (len > sizeof(*sqe) - offsetof(struct io_uring_sqe, cmd))
+	errx(EXIT_FAILURE, "io_uring command too long: %u", (unsigned)len);
+
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = fd;
+    sqe->cmd_op = op;
+    memcpy(sqe->cmd, cmd, len);
+    sqe->user_data = USER_DATA(KIND_IO, tag);
+}
+
+/* issue one command with a payload of up to 80 bytes and wait for its result,
+ * through a ring of its own so it may block without holding up the loop
+ */
+int uring_cmd_sync(int fd, uint32_t op, const void *cmd, size_t len)
+{
+    struct io_uring_params p;
+    int rfd, res;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQE128;
+
+    if ((rfd = syscall(__NR_io_uring_setup, 1, &p)) < 0)
+	return -errno;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t rings_len = sq_len > cq_len ? sq_len : cq_len;
+    size_t sqes_len = p.sq_entries * 2 * sizeof(struct io_uring_sqe);
+    uint8_t *rings;
+    struct io_uring_sqe *sqe;
+
+    if ((rings = mmap(NULL, rings_len, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(IORING_OFF_SQ_RING)");
+
+    if ((sqe = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(IORING_OFF_SQES)");
+
+    if (len > 2 * sizeof(*sqe) - offsetof(struct io_uring_sqe, cmd))
+	errx(EXIT_FAILURE, "io_uring command too long: %u", (unsigned)len);
+
+    memset(sqe, 0, 2 * sizeof(*sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = fd;
+    sqe->cmd_op = op;
+    memcpy(sqe->cmd, cmd, len);
+
+    unsigned *sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    unsigned *cq_head = (unsigned *)(rings + p.cq_off.head);
+    unsigned *cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    unsigned submit = 1;
+
+    ((unsigned *)(rings + p.sq_off.array))[0] = 0;
+    __atomic_store_n(sq_tail, 1, __ATOMIC_RELEASE);
+
+    /* a wait interrupted by a signal is resumed, the command was already submitted */
+    while (*cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    {
+	int ret = syscall(__NR_io_uring_enter, rfd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+	if (ret < 0 && errno != EINTR)
+	    err(EXIT_FAILURE, "io_uring_enter");
+
+	if (ret > 0)
+	    submit = 0;
+    }
+
+    res = ((struct io_uring_cqe *)(rings + p.cq_off.cqes))[*cq_head & *(unsigned *)(rings + p.cq_off.ring_mask)].res;
+
+    munmap(sqe, sqes_len);
+    munmap(rings, rings_len);
+    close(rfd);
+
+    return res;
+}
+
+/* submit everything queued, wait up to timeout for completions and hand them out */
+void uring_wait(struct timeval *timeout, uring_handler_t handler)
+{
+    unsigned head = *ring.cq_head;
+
+    enter(timeout);
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+	struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+	uint64_t data = cqe->user_data;
+	uint32_t tag = data & 0xffffffff;
+	unsigned flags = cqe->flags;
+	int res = cqe->res;
+
+	/* the entry is copied, the kernel may reuse it while the handler runs */
+	__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+	switch (data >> 32)
+	{
+	    case KIND_RECV:
+		if (flags & IORING_CQE_F_BUFFER)
+		{
+		    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		    if (res > 0)
+			handler(tag, res, ring.pool + (size_t)bid * URING_SLOT);
+
+		    recycle(bid);
+		}
+		else if (res < 0 && res != -ENOBUFS)
+		    syslog(LOG_WARNING, "io_uring recv: %s", strerror(-res));
+
+		/* the kernel stops receiving when it runs out of buffers */
+		if (!(flags & IORING_CQE_F_MORE))
+		    uring_recv(ring.recv_sock[tag], tag);
+		break;
+
+	    case KIND_SEND:
+		/* like a failed sendto(), the timeout will retry it */
+		if (res < 0)
+		    syslog(LOG_WARNING, "io_uring sendmsg: %s", strerror(-res));
+
+		ring.slots[tag].next_free = ring.free_slot;
+		ring.free_slot = tag;
+		break;
+
+	    case KIND_IO:
+		handler(tag, res, NULL);
+		break;
+	}
+    }
+}
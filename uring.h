@@ -0,0 +1,52 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_URING_H__
+#define __PSAN_URING_H__
+
+#include "psan.h"
+
+/* submission queue entries, sends beyond this are submitted in more than one batch */
+#define URING_ENTRIES 256
+
+/* buffers the kernel receives datagrams into, and slots sends are copied to,
+ * each large enough for any PSAN packet
+ */
+#define URING_RECV_BUFS 128
+#define URING_SEND_SLOTS 256
+#define URING_SLOT 36864
+
+/* sockets receiving at once */
+#define URING_MAX_RECV MAX_INTERFACES
+
+/* called for every received datagram, with the tag its socket was armed with,
+ * and for every completed read, send or command, with a NULL buffer
+ */
+typedef void (*uring_handler_t)(uint32_t tag, int res, uint8_t *buf);
+
+int uring_init(void *fixed, size_t fixed_len);
+void uring_recv(int sock, uint32_t tag);
+ssize_t uring_sendto(int sock, const void *buf, size_t len, const struct sockaddr_in *to);
+void uring_read_fixed(int fd, void *buf, unsigned len, uint32_t tag);
+void uring_send(int fd, const void *buf, unsigned len, uint32_t tag);
+void uring_poll(int fd, uint32_t tag);
+void uring_cmd(int fd, uint32_t op, const void *cmd, size_t len, uint32_t tag);
+int uring_cmd_sync(int fd, uint32_t op, const void *cmd, size_t len);
+void uring_wait(struct timeval *timeout, uring_handler_t handler);
+
+#endif /* __PSAN_URING_H__ */
@@ -17,6 +17,7 @@
  */
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -30,7 +31,23 @@
 #include "nbd.h"
 #endif
 
+#if USE_UBLK
+#include "ublk.h"
+#endif
+
 #include "psan.h"
+#include "engine.h"
+#include "volume.h"
+#include "sched.h"
+#include "uring.h"
+#include "serve.h"
+#include "dump.h"
+#include "track.h"
+#include "bench.h"
+#include "autotune.h"
+#include "xdp.h"
+#include "ctl.h"
+#include "affinity.h"
 #include "psan_wireformat.h"
 #include "util.h"
 
@@ -39,88 +56,27 @@
     err(EXIT_FAILURE, __VA_ARGS__); \
 } while (0)
 
-#ifndef TEMP_FAILURE_RETRY
-#define TEMP_FAILURE_RETRY(expression) expression
-#endif
-
-#define _select(...) TEMP_FAILURE_RETRY(select(__VA_ARGS__))
-#define _read(...) TEMP_FAILURE_RETRY(read(__VA_ARGS__))
-#define _recv(...) TEMP_FAILURE_RETRY(recv(__VA_ARGS__))
-#define _sendmsg(...) TEMP_FAILURE_RETRY(sendmsg(__VA_ARGS__))
-#define _sendto(...) TEMP_FAILURE_RETRY(sendto(__VA_ARGS__))
-
 int sock;
 int debug = 0;
 
-struct outstanding_t {
-    struct nbd_request *nbd;
-    uint16_t seq;
-    void *psan;
-    int psan_len;
-    struct timeval timeout;
-    TAILQ_ENTRY(outstanding_t) entries;
-};
-
-static TAILQ_HEAD(, outstanding_t) outstanding = TAILQ_HEAD_INITIALIZER(outstanding);
-
-void record_outstanding(struct outstanding_t *out)
-{
-    gettimeofday(&out->timeout, NULL);
-
-    /* 1 second timeout */
-    out->timeout.tv_sec++;
-
-    TAILQ_INSERT_TAIL(&outstanding, out, entries);
-}
-
-struct outstanding_t *remove_outstanding(uint16_t seq)
-{
-    struct outstanding_t *out;
-
-    TAILQ_FOREACH(out, &outstanding, entries)
-    {
-	if (out->seq != seq)
-	    continue;
-
-	TAILQ_REMOVE(&outstanding, out, entries);
-
-	return out;
-    }
-
-    return NULL;
-}
-
-void resubmit_outstanding(int sock, struct sockaddr_in *dest)
-{
-    struct timeval now, timeout;
-    gettimeofday(&now, NULL);
-
-    /* 1 second timeout */
-    timeout = now;
-    timeout.tv_sec++;
-
-    struct outstanding_t *out = TAILQ_FIRST(&outstanding);
-
-    while (out)
-    {
-	struct outstanding_t *next = TAILQ_NEXT(out, entries);
-
-	/* stop at first future timeout */
-	if (timercmp(&out->timeout, &now, >))
-	    break;
-
-	/* resubmit original request */
-	if (_sendto(sock, out->psan, out->psan_len, 0, (struct sockaddr *)dest, sizeof(struct sockaddr_in)) < 0)
-	    err(EXIT_FAILURE, "sendto");
+#if USE_UBLK
+/* attach through ublk rather than an NBD device */
+static int attach_ublk;
+#endif
 
-	/* update timeout and move entry to end of list */
-	out->timeout = timeout;
-	TAILQ_REMOVE(&outstanding, out, entries);
-	TAILQ_INSERT_TAIL(&outstanding, out, entries);
+#if USE_XDP
+/* take PSAN answers from AF_XDP sockets rather than the kernel's UDP stack */
+static int use_xdp;
+#endif
 
-	out = next;
-    }
-}
+static struct option long_options[] = {
+#if USE_UBLK
+    { "ublk", no_argument, &attach_ublk, 1 },
+#endif
+    { "autotune", optional_argument, NULL, 'A' },
+    { "affinity", optional_argument, NULL, 'a' },
+    { NULL, 0, NULL, 0 }
+};
 
 void usage(void)
 {
@@ -164,7 +120,7 @@ void psan_listall(void)
 	    if (!(part_info = psan_query_root(&disk->root_addr, i)))
 		goto cleanup_part;
 
-	    if (!(part = psan_resolve_id(part_info->id)))
+	    if (!(part = psan_resolve_at(part_info->id, &disk->root_addr)))
 		goto cleanup_part;
 
 	    fprintf(stdout, "%-40s %-15s %-15s %6.0f\n",
@@ -291,309 +247,678 @@ void psan_write(char *id, long long offset, char *file)
 }
 
 #if USE_NBD
-void psan_attach_nbd(char *id, char *path)
-{
-    /* open NBD device */
-    int nbd_fd;
+static int nbd_sock;
 
-    if ((nbd_fd = open(path, O_RDWR)) < 0)
-	err(EXIT_FAILURE, "open");
+/* the daemon's control socket, -1 without one */
+static int nbd_ctl = -1;
+
+/* how the attach loop waits for and moves data */
+enum nbd_loop_t {
+    LOOP_SELECT,
+    LOOP_URING,
+    LOOP_POLL
+};
+
+static enum nbd_loop_t nbd_loop = LOOP_SELECT;
+
+/* microseconds the kernel may busy wait in each receive of the poll loop */
+#define POLL_BUSY 50
+
+/* packets taken from one path before the others get a turn */
+#define POLL_BUDGET 64
+
+/* longest the poll loop spins without work before sleeping, in microseconds (-P) */
+#define POLL_IDLE 200
+
+static long poll_idle = POLL_IDLE;
+
+/* requests read from the kernel, a write may straddle two reads */
+static char nbd_buf[2 * VOLUME_MAX_IO];
+static int nbd_len;
+
+/* replies queued for io_uring, one batch is sent while the next fills */
+struct reply_batch_t {
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+};
 
-    /* when the kernel does readahead or combines requests into blocks larger than 8kb, errors increase */
+static struct reply_batch_t replies[2];
+static int reply_fill;
+static int reply_sending;
+static size_t reply_sent;
+
+static void reply_append(const void *data, size_t len)
+{
+    struct reply_batch_t *r = &replies[reply_fill];
+
+    if (r->len + len > r->size)
     {
-	char filename[PATH_MAX];
-	char *device = rindex(path, '/');
-	snprintf(filename, sizeof(filename), "/sys/block/%s/queue/max_sectors_kb", device);
-	int sysfs;
-	if ((sysfs = open(filename, O_RDWR)) >= 0)
-	{
-	    if (write(sysfs, "8", sizeof("8")-1) < 0)
-	      warn("write(sysfs, \"8\", %u)", sizeof("8")-1);
+	r->size = (r->len + len) * 2;
 
-	    close(sysfs);
-	}
+	if (!(r->buf = realloc(r->buf, r->size)))
+	    err(EXIT_FAILURE, "realloc");
     }
 
-    /* resolve id to IP */
-    struct part_addr_t *res;
+    memcpy(r->buf + r->len, data, len);
+    r->len += len;
+}
 
-    if (!(res = psan_resolve_id(id)))
-	errx(EXIT_FAILURE, "unable to resolve id: %s", id);
+/* answer the kernel once every piece of a request has completed */
+static void nbd_done(struct io_t *io)
+{
+    struct nbd_request *nbd = io->ctx;
+    int ret;
 
-    /* fetch capacity information */
-    struct part_info_t *part_info;
+    struct nbd_reply reply = {
+	.magic  = htonl(NBD_REPLY_MAGIC),
+	.error  = htonl(io->error)
+    };
+    memcpy(reply.handle, nbd->handle, sizeof(nbd->handle));
 
-    if (!(part_info = psan_query_part(&res->part_addr)))
-	errx(EXIT_FAILURE, "unable to query partition information");
+    if (nbd_loop == LOOP_URING)
+    {
+	reply_append(&reply, sizeof(reply));
 
-    /* set size info on NBD device */
-    int blocksize_power = 12;
-    uint32_t size = (uint32_t)(part_info->size >> blocksize_power);
+	if (!io->error && io->type == IO_READ)
+	    reply_append(io->buf, io->len);
+    }
+    else
+    {
+	struct iovec iov[2];
+	int iov_len = 0;
 
-    if (ioctl(nbd_fd, NBD_SET_BLKSIZE, (unsigned long)(1 << blocksize_power)) < 0)
-	err(EXIT_FAILURE, "ioctl(NBD_SET_BLKSIZE)");
+	iov[iov_len++] = (struct iovec){ .iov_base = &reply, .iov_len = sizeof(reply) };
 
-    if (ioctl(nbd_fd, NBD_SET_SIZE_BLOCKS, size) < 0)
-	err(EXIT_FAILURE, "ioctl(NBD_SET_SIZE_BLOCKS)");
+	if (!io->error && io->type == IO_READ)
+	    iov[iov_len++] = (struct iovec){ .iov_base = io->buf, .iov_len = io->len };
 
-    /* setup NBD proxy socket */
-    int socks[2];
+	struct msghdr msghdr = {
+	    .msg_iov     = iov,
+	    .msg_iovlen  = iov_len
+	};
 
-    if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, socks) < 0)
-	err(EXIT_FAILURE, "socketpair");
+	if ((ret = _sendmsg(nbd_sock, &msghdr, 0)) < 0)
+	    err(EXIT_FAILURE, "sendmsg");
+    }
 
-    if (ioctl(nbd_fd, NBD_SET_SOCK, socks[0]) < 0)
-	err(EXIT_FAILURE, "ioctl(NBD_SET_SOCK)");
+    free(nbd);
+    free(io->buf);
+    free(io);
+}
 
-    if (!debug)
-	if (daemon(0, 0) < 0)
-	    err(EXIT_FAILURE, "daemon(0, 0)");
+/* hand the complete requests at the head of the input buffer to the scheduler, keep the rest */
+static void nbd_requests(struct volume_t *vol, struct sched_t *sched)
+{
+    int pos = 0;
 
-    /* fork worker threads */
-    pid_t pid;
-    if ((pid = fork()) < 0)
-	err(EXIT_FAILURE, "fork");
+    /* requests parsed together are scheduled together */
+    sched_plug(sched);
 
-    /* parent */
-    if (pid)
+    while (nbd_len - pos >= sizeof(struct nbd_request))
     {
-	close(sock);
-	close(socks[0]);
-	close(socks[1]);
+	struct nbd_request *nbd = copy(&nbd_buf[pos], sizeof(struct nbd_request));
+	nbd->magic = ntohl(nbd->magic);
+	nbd->type = ntohl(nbd->type);
+	nbd->from = ntohll(nbd->from);
+	nbd->len = ntohl(nbd->len);
 
-	if (ioctl(nbd_fd, NBD_DO_IT) < 0)
-	    err(EXIT_FAILURE, "ioctl(NBD_DO_IT)");
+	/* sanity check the request */
+	if (nbd->magic != 0x25609513)
+	    DIE("wrong MAGIC");
 
-	if (ioctl(nbd_fd, NBD_CLEAR_QUE) < 0)
-	    warn("ioctl(NBD_CLEAR_QUE)");
+	if (nbd->from & (512-1) || nbd->from + nbd->len > vol->size)
+	    DIE("offset must be a 512b sector within the volume %llu", nbd->from);
 
-	if (ioctl(nbd_fd, NBD_CLEAR_SOCK) < 0)
-	    warn("ioctl(NBD_CLEAR_SOCK)");
+	if (nbd->len < 512 || nbd->len > VOLUME_MAX_IO || nbd->len & (512-1))
+	    DIE("size must be a multiple of 512 between 512 and %u: %u", VOLUME_MAX_IO, nbd->len);
 
-	return;
+	struct io_t *io = dup_struct(struct io_t,
+	    .from = nbd->from,
+	    .len  = nbd->len,
+	    .ctx  = nbd,
+	    .done = nbd_done
+	);
+
+	if (!(io->buf = malloc(nbd->len)))
+	    err(EXIT_FAILURE, "malloc");
+
+	if (nbd->type == NBD_CMD_WRITE)
+	{
+	    if (nbd_len - pos < sizeof(struct nbd_request) + nbd->len)
+	    {
+		free(io->buf);
+		free(io);
+		free(nbd);
+		break;
+	    }
+
+	    io->type = IO_WRITE;
+	    memcpy(io->buf, &nbd_buf[pos+sizeof(struct nbd_request)], nbd->len);
+
+	    pos += sizeof(struct nbd_request) + nbd->len;
+	}
+	else if (nbd->type == NBD_CMD_READ)
+	{
+	    io->type = IO_READ;
+
+	    pos += sizeof(struct nbd_request);
+	}
+	else
+	    DIE("unknown operation");
+
+	sched_submit(sched, io);
     }
 
-    /* child */
-    close(socks[0]);
-    close(nbd_fd);
+    sched_unplug(sched);
+
+    /* move leftover fragment to beginning of buffer */
+    if (pos < nbd_len)
+	memmove(&nbd_buf[0], &nbd_buf[pos], nbd_len-pos);
 
-    int max = socks[1] > sock ? socks[1] : sock;
+    nbd_len -= pos;
+}
+
+static void nbd_select_loop(struct volume_t *vol, struct sched_t *sched)
+{
     fd_set set;
     int ret;
 
     for (;;)
     {
-	struct timeval *timeout = NULL;
 	struct timeval now;
-	gettimeofday(&now, NULL);
+	struct timeval timeout = sched_timers(sched);
+
+	FD_ZERO(&set);
+	FD_SET(nbd_sock, &set);
+
+	int max = ctl_fdset(&set, engine_fdset(&set));
+	if (nbd_sock > max)
+	    max = nbd_sock;
+
+	if ((ret = _select(max+1, &set, NULL, NULL, &timeout)) < 0)
+	    err(EXIT_FAILURE, "select");
 
-	/* setup select timeout to handle resubmission */
+	if (FD_ISSET(nbd_sock, &set))
 	{
-	    struct outstanding_t *out;
+	    if ((ret = _read(nbd_sock, &nbd_buf[nbd_len], sizeof(nbd_buf)-nbd_len)) <= 0)
+		err(EXIT_FAILURE, "read");
+
+	    nbd_len += ret;
+
+	    nbd_requests(vol, sched);
+	}
+
+	for (int i = 0; i < npaths; i++)
+	{
+	    uint8_t buf[65536];
+
+	    if (!FD_ISSET(paths[i].sock, &set))
+		continue;
+
+	    if ((ret = _recv(paths[i].sock, buf, sizeof(buf), 0)) < 0)
+		err(EXIT_FAILURE, "recv");
+
+	    gettimeofday(&now, NULL);
+
+	    engine_receive(&paths[i], buf, ret, &now);
+	}
+
+	xdp_receive(&set);
+	ctl_receive(&set);
+    }
+}
 
-	    if ((out = TAILQ_FIRST(&outstanding)))
+/* take whatever is ready without blocking, returns whether there was any */
+static int nbd_poll_once(struct volume_t *vol, struct sched_t *sched)
+{
+    struct timeval now;
+    int ret, busy = 0;
+
+    if ((ret = _recv(nbd_sock, &nbd_buf[nbd_len], sizeof(nbd_buf)-nbd_len, MSG_DONTWAIT)) > 0)
+    {
+	nbd_len += ret;
+	busy = 1;
+
+	nbd_requests(vol, sched);
+    }
+    else if (!ret || errno != EAGAIN)
+	err(EXIT_FAILURE, "read");
+
+    for (int i = 0; i < npaths; i++)
+    {
+	uint8_t buf[65536];
+
+	for (int n = 0; n < POLL_BUDGET; n++)
+	{
+	    if ((ret = _recv(paths[i].sock, buf, sizeof(buf), MSG_DONTWAIT)) < 0)
 	    {
-		static struct timeval next_timeout;
-		double diff = tv2dbl(out->timeout) - tv2dbl(now);
-		if (diff < 0.1) diff = 0.1;
-		next_timeout = dbl2tv(diff);
-		timeout = &next_timeout;
+		if (errno != EAGAIN)
+		    err(EXIT_FAILURE, "recv");
+		break;
 	    }
+
+	    gettimeofday(&now, NULL);
+
+	    engine_receive(&paths[i], buf, ret, &now);
+	    busy = 1;
 	}
+    }
 
-	FD_ZERO(&set);
-	FD_SET(socks[1], &set);
-	FD_SET(sock, &set);
+    if (xdp_receive(NULL))
+	busy = 1;
 
-	if ((ret = _select(max+1, &set, NULL, NULL, timeout)) < 0)
-	    err(EXIT_FAILURE, "select");
+    if (ctl_receive(NULL))
+	busy = 1;
+
+    return busy;
+}
+
+/* trade a core for latency: spin on non-blocking receives and only sleep in select()
+ * once idle for a while.  as with halt polling the spin grows when a sleep is cut
+ * short by work and shrinks when it is not, up to -P microseconds
+ */
+static void nbd_poll_loop(struct volume_t *vol, struct sched_t *sched)
+{
+    struct timeval now, idle_since, next_report;
+    double polling = 0, sleeping = 0;
+    unsigned long sleeps = 0, short_sleeps = 0;
+    long window = poll_idle;
+    int busy_poll = POLL_BUSY;
+    fd_set set;
+
+    for (int i = 0; i < npaths; i++)
+	if (setsockopt(paths[i].sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0)
+	    syslog(LOG_WARNING, "%s: setsockopt(SO_BUSY_POLL): %s", path_name(&paths[i]), strerror(errno));
+
+    gettimeofday(&idle_since, NULL);
+    next_report = idle_since;
+    next_report.tv_sec += SCHED_REPORT_INTERVAL;
+
+    for (;;)
+    {
+	struct timeval timeout = sched_timers(sched);
+	struct timeval before;
 
-	if (FD_ISSET(socks[1], &set))
+	gettimeofday(&before, NULL);
+
+	int busy = nbd_poll_once(vol, sched);
+
+	gettimeofday(&now, NULL);
+	polling += tv2dbl(now) - tv2dbl(before);
+
+	if (timercmp(&next_report, &now, <))
 	{
-	    static char buf[65536];
-	    static int len = 0;
+	    syslog(LOG_INFO, "poll loop: %.1fs polling, %.1fs sleeping, %lu sleeps of which %lu cut short, spinning %ldus",
+		polling, sleeping, sleeps, short_sleeps, window);
 
-	    if ((ret = _read(socks[1], &buf[len], sizeof(buf)-len)) <= 0)
-		err(EXIT_FAILURE, "read");
+	    polling = sleeping = 0;
+	    sleeps = short_sleeps = 0;
+	    next_report = now;
+	    next_report.tv_sec += SCHED_REPORT_INTERVAL;
+	}
 
-	    len += ret;
+	if (busy)
+	{
+	    idle_since = now;
+	    continue;
+	}
 
-	    int pos = 0;
+	if ((tv2dbl(now) - tv2dbl(idle_since)) * 1000000 < window)
+	    continue;
 
-	    while (len - pos >= sizeof(struct nbd_request))
-	    {
-		struct nbd_request *nbd = copy(&buf[pos], sizeof(struct nbd_request));
-		nbd->magic = ntohl(nbd->magic);
-		nbd->type = ntohl(nbd->type);
-		nbd->from = ntohll(nbd->from);
-		nbd->len = ntohl(nbd->len);
+	FD_ZERO(&set);
+	FD_SET(nbd_sock, &set);
 
-		/* sanity check the request */
-		if (nbd->magic != 0x25609513)
-		    DIE("wrong MAGIC");
+	int max = ctl_fdset(&set, engine_fdset(&set));
+	if (nbd_sock > max)
+	    max = nbd_sock;
 
-		if (nbd->from & (512-1) || (nbd->from >> 9) >= UINT32_MAX)
-		    DIE("offset must be a 512b sector between 0 and 2TB %llu", nbd->from);
+	if (_select(max+1, &set, NULL, NULL, &timeout) < 0)
+	    err(EXIT_FAILURE, "select");
 
-		if (nbd->len < 512 || nbd->len > 32768 || nbd->len & (nbd->len-1))
-		    DIE("size must be a power of two between 512 and 32768: %u", nbd->len);
+	gettimeofday(&idle_since, NULL);
 
-		uint8_t power = 9;
-		while ((1 << power) < nbd->len)
-		    power++;
+	double slept = tv2dbl(idle_since) - tv2dbl(now);
 
-		void *ptr;
-		int ptr_len = 0;
+	sleeping += slept;
+	sleeps++;
 
-		uint16_t seq = psan_next_seq();
+	/* woken within the window, a longer spin would have caught it */
+	if (slept * 1000000 < poll_idle)
+	{
+	    short_sleeps++;
 
-		if (nbd->type == NBD_CMD_WRITE)
-		{
-		    if (len - pos < nbd->len)
-		    {
-			free(nbd);
-			break;
-		    }
-
-		    struct psan_put_t *put;
-		    ptr_len = sizeof(struct psan_put_t) + nbd->len;
-		    if (!(ptr = put = malloc(ptr_len)))
-			err(EXIT_FAILURE, "malloc");
-		    memset(ptr, 0, sizeof(struct psan_put_t));
-
-		    put->ctrl = (struct psan_ctrl_t){ .cmd = PSAN_PUT, .seq = htons(seq), .len_power = power };
-		    put->sector = htonl((uint32_t)(nbd->from >> 9));
-		    memcpy(put->buffer, &buf[pos+sizeof(struct nbd_request)], nbd->len);
-
-		    pos += sizeof(struct nbd_request) + nbd->len;
-		}
-		else if (nbd->type == NBD_CMD_READ)
-		{
-		    struct psan_get_t *get;
-		    ptr_len = sizeof(struct psan_get_t);
-		    if (!(ptr = get = malloc(ptr_len)))
-			err(EXIT_FAILURE, "malloc");
-		    memset(ptr, 0, sizeof(struct psan_get_t));
+	    if ((window = window ? window * 2 : 1) > poll_idle)
+		window = poll_idle;
+	}
+	else
+	    window /= 2;
+    }
+}
 
-		    get->ctrl = (struct psan_ctrl_t){ .cmd = PSAN_GET, .seq = htons(seq), .len_power = power };
-		    get->sector = htonl((uint32_t)(nbd->from >> 9));
+/* completion tags of the io_uring loop, below them are paths */
+#define TAG_NBD_READ  URING_MAX_RECV
+#define TAG_NBD_REPLY (URING_MAX_RECV + 1)
+#define TAG_CTL       (URING_MAX_RECV + 2)
 
-		    pos += sizeof(struct nbd_request);
-		}
-		else
-		    DIE("unknown operation");
+static struct volume_t *uring_vol;
+static struct sched_t *uring_sched;
 
-		if ((ret = _sendto(sock, ptr, ptr_len, 0, &res->part_addr, sizeof(res->part_addr))) < 0)
-		    err(EXIT_FAILURE, "sendto");
+static void reply_flush(void)
+{
+    if (reply_sending || !replies[reply_fill].len)
+	return;
 
-		record_outstanding(dup_struct(struct outstanding_t,
-		    .nbd      = nbd,
-		    .seq      = seq,
-		    .psan     = ptr,
-		    .psan_len = ptr_len,
-		));
-	    }
+    uring_send(nbd_sock, replies[reply_fill].buf, replies[reply_fill].len, TAG_NBD_REPLY);
+
+    reply_fill = !reply_fill;
+    reply_sending = 1;
+    reply_sent = 0;
+}
+
+static void nbd_completion(uint32_t tag, int res, uint8_t *buf)
+{
+    struct timeval now;
+
+    if (tag < TAG_NBD_READ)
+    {
+	gettimeofday(&now, NULL);
+	engine_receive(&paths[tag], buf, res, &now);
+    }
+    else if (tag == TAG_NBD_READ)
+    {
+	if (res <= 0)
+	{
+	    errno = -res;
+	    err(EXIT_FAILURE, "read");
+	}
+
+	nbd_len += res;
+
+	nbd_requests(uring_vol, uring_sched);
 
-	    /* move leftover fragment to beginning of buffer */
-	    if (pos < len)
-		memmove(&buf[0], &buf[pos], len-pos);
+	uring_read_fixed(nbd_sock, &nbd_buf[nbd_len], sizeof(nbd_buf)-nbd_len, TAG_NBD_READ);
+    }
+    else if (tag == TAG_NBD_REPLY)
+    {
+	struct reply_batch_t *r = &replies[!reply_fill];
 
-	    len -= pos;
+	if (res < 0)
+	{
+	    errno = -res;
+	    err(EXIT_FAILURE, "send");
 	}
 
-	if (FD_ISSET(sock, &set))
+	/* a stream socket may take part of a batch */
+	if ((reply_sent += res) < r->len)
 	{
-	    uint8_t buf[65536];
+	    uring_send(nbd_sock, r->buf + reply_sent, r->len - reply_sent, TAG_NBD_REPLY);
+	    return;
+	}
 
-	    if ((ret = _recv(sock, buf, sizeof(buf), 0)) < 0)
-		err(EXIT_FAILURE, "recv");
+	r->len = 0;
+	reply_sending = 0;
+    }
+    else if (tag == TAG_CTL)
+    {
+	ctl_receive(NULL);
+	uring_poll(nbd_ctl, TAG_CTL);
+    }
+}
 
-	    if (ret < sizeof(struct psan_ctrl_t))
-		continue;
+/* the same loop with one system call per round: packets are received into a pool of
+ * buffers without a recv() each, and sends and replies go out in batches
+ */
+static void nbd_uring_loop(struct volume_t *vol, struct sched_t *sched)
+{
+    uring_vol = vol;
+    uring_sched = sched;
 
-	    struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)buf;
-	    struct outstanding_t *out;
+    engine_sendto = uring_sendto;
 
-	    if (!(out = remove_outstanding(ntohs(ctrl->seq))))
-		continue;
+    for (int i = 0; i < npaths; i++)
+	uring_recv(paths[i].sock, i);
 
-	    int error = 1;
-
-	    if (out->nbd->type == NBD_CMD_READ
-		&& ctrl->cmd == PSAN_GET_RESPONSE
-		&& ret == sizeof(struct psan_get_response_t) + out->nbd->len)
-		error = 0;
-	    else if (out->nbd->type == NBD_CMD_WRITE
-		&& ctrl->cmd == PSAN_PUT_RESPONSE)
-		error = 0;
-
-	    /* XXX: this is a dodgy hack.
-	     * sometimes the SC101 responds with unexpected data,
-	     * i find that waiting a bit and resubmitting the exact same request works.
-	     * perhaps I should be doing some throttling?
-	     */
-	    if (error)
-	    {
-		record_outstanding(out);
-		continue;
-	    }
+    uring_read_fixed(nbd_sock, &nbd_buf[nbd_len], sizeof(nbd_buf)-nbd_len, TAG_NBD_READ);
 
-	    struct nbd_reply reply = {
-		.magic  = htonl(NBD_REPLY_MAGIC),
-		.error  = htonl(error)
-	    };
-	    memcpy(reply.handle, out->nbd->handle, sizeof(out->nbd->handle));
+    if (nbd_ctl >= 0)
+	uring_poll(nbd_ctl, TAG_CTL);
 
-	    struct iovec iov[2];
-	    int iov_len = 0;
+    for (;;)
+    {
+	struct timeval timeout = sched_timers(sched);
 
-	    iov[iov_len++] = (struct iovec){ .iov_base = &reply, .iov_len = sizeof(reply) };
+	reply_flush();
 
-	    if (!error && ctrl->cmd == PSAN_GET_RESPONSE)
-		iov[iov_len++] = (struct iovec){ .iov_base = &buf[sizeof(struct psan_get_response_t)], .iov_len = out->nbd->len };
+	uring_wait(&timeout, nbd_completion);
+    }
+}
+
+void psan_attach_nbd(char **ids, int nids, char *path, struct volume_opts_t *opts)
+{
+    char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
 
-	    struct msghdr msghdr = {
-		.msg_iov     = iov,
-		.msg_iovlen  = iov_len
-	    };
+    /* open NBD device */
+    int nbd_fd;
 
-	    if ((ret = _sendmsg(socks[1], &msghdr, 0)) < 0)
-		err(EXIT_FAILURE, "sendmsg");
+    if ((nbd_fd = open(path, O_RDWR)) < 0)
+	err(EXIT_FAILURE, "open");
 
-	    free(out->nbd);
-	    free(out->psan);
-	    free(out);
-	}
+    /* resolve and size every partition */
+    struct volume_t *vol = volume_open(ids, nids, opts);
+    struct sched_t *sched = sched_open(vol);
+
+    volume_queue_limits(vol, name);
+
+    /* set size info on NBD device */
+    int blocksize_power = 12;
+    uint32_t size = (uint32_t)(vol->size >> blocksize_power);
+
+    if (ioctl(nbd_fd, NBD_SET_BLKSIZE, (unsigned long)(1 << blocksize_power)) < 0)
+	err(EXIT_FAILURE, "ioctl(NBD_SET_BLKSIZE)");
+
+    if (ioctl(nbd_fd, NBD_SET_SIZE_BLOCKS, size) < 0)
+	err(EXIT_FAILURE, "ioctl(NBD_SET_SIZE_BLOCKS)");
 
-	resubmit_outstanding(sock, &res->part_addr);
+    /* setup NBD proxy socket */
+    int socks[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, socks) < 0)
+	err(EXIT_FAILURE, "socketpair");
+
+    if (ioctl(nbd_fd, NBD_SET_SOCK, socks[0]) < 0)
+	err(EXIT_FAILURE, "ioctl(NBD_SET_SOCK)");
+
+    if (!debug)
+	if (daemon(0, 0) < 0)
+	    err(EXIT_FAILURE, "daemon(0, 0)");
+
+    /* fork worker threads */
+    pid_t pid;
+    if ((pid = fork()) < 0)
+	err(EXIT_FAILURE, "fork");
+
+    /* parent */
+    if (pid)
+    {
+	for (int i = 0; i < npaths; i++)
+	    close(paths[i].sock);
+	close(socks[0]);
+	close(socks[1]);
+
+	if (ioctl(nbd_fd, NBD_DO_IT) < 0)
+	    err(EXIT_FAILURE, "ioctl(NBD_DO_IT)");
+
+	if (ioctl(nbd_fd, NBD_CLEAR_QUE) < 0)
+	    warn("ioctl(NBD_CLEAR_QUE)");
+
+	if (ioctl(nbd_fd, NBD_CLEAR_SOCK) < 0)
+	    warn("ioctl(NBD_CLEAR_SOCK)");
+
+	return;
+    }
+
+    /* child */
+    close(socks[0]);
+    close(nbd_fd);
+
+    /* before the loop allocates its buffers, so they come from the node it runs on */
+    if (opts->affinity)
+	volume_affinity(vol, opts);
+
+    nbd_sock = socks[1];
+    nbd_ctl = ctl_open(name, sched);
+
+    if (nbd_loop == LOOP_URING)
+    {
+	if (!uring_init(nbd_buf, sizeof(nbd_buf)))
+	    nbd_uring_loop(vol, sched);
+
+	syslog(LOG_WARNING, "io_uring unavailable, using select: %s", strerror(errno));
+	nbd_loop = LOOP_SELECT;
     }
 
-    return;
+    if (nbd_loop == LOOP_POLL)
+	nbd_poll_loop(vol, sched);
+
+    nbd_select_loop(vol, sched);
 }
 #endif
 
 int main(int argc, char *argv[])
 {
-    char *dev = NULL;
+    char *devs[MAX_INTERFACES];
+    int ndevs = 0;
     char *cmd = NULL;
+    cpu_set_t cpus;
+    struct volume_opts_t opts = {
+	.layout = LAYOUT_STRIPE,
+	.unit   = STRIPE_UNIT
+    };
     int ch;
 
-    while ((ch = getopt(argc, argv, "d:D")) != -1)
+    while ((ch = getopt_long(argc, argv, "b:c:d:De:H:l:P:q:s:t:u:w:x", long_options, NULL)) != -1)
     {
 	switch (ch) {
+	    case 0:
+		break;
+	    case 'A':
+		opts.autotune = 1;
+		opts.scratch = optarg;
+		break;
+	    case 'a':
+		opts.affinity = 1;
+		opts.cpus = optarg && strcmp(optarg, "auto") ? optarg : NULL;
+
+		if (opts.cpus && cpulist_parse(opts.cpus, &cpus) < 0)
+		    errx(EXIT_FAILURE, "bad cpu list, expected auto or one like 0-3,8: %s", optarg);
+		break;
+	    case 'b':
+		if (!strcmp(optarg, "roundrobin"))
+		    path_policy = PATH_ROUND_ROBIN;
+		else if (!strcmp(optarg, "outstanding"))
+		    path_policy = PATH_LEAST_OUTSTANDING;
+		else
+		    usage();
+		break;
+	    case 'c':
+		opts.cache = optarg;
+		break;
 	    case 'd':
-		dev = optarg;
+		/* several interfaces may be given, comma separated or with repeated -d */
+		for (char *dev = strtok(optarg, ","); dev; dev = strtok(NULL, ","))
+		{
+		    if (ndevs == MAX_INTERFACES)
+			errx(EXIT_FAILURE, "too many interfaces, at most %d are supported", MAX_INTERFACES);
+		    devs[ndevs++] = dev;
+		}
 		break;
 	    case 'D':
 		debug = 1;
 		break;
+#if USE_NBD
+	    case 'e':
+		if (!strcmp(optarg, "select"))
+		    nbd_loop = LOOP_SELECT;
+		else if (!strcmp(optarg, "uring"))
+		    nbd_loop = LOOP_URING;
+		else if (!strcmp(optarg, "poll"))
+		    nbd_loop = LOOP_POLL;
+		else
+		    usage();
+		break;
+#endif
+	    case 'H':
+		hedge_percentile = atof(optarg);
+		if (hedge_percentile <= 0 || hedge_percentile >= 100)
+		    errx(EXIT_FAILURE, "hedging percentile must be between 0 and 100: %s", optarg);
+		break;
+	    case 'l':
+		if (!strcmp(optarg, "stripe"))
+		    opts.layout = LAYOUT_STRIPE;
+		else if (!strcmp(optarg, "mirror"))
+		    opts.layout = LAYOUT_MIRROR;
+		else if (!strcmp(optarg, "parity"))
+		    opts.layout = LAYOUT_PARITY;
+		else
+		    usage();
+		break;
+#if USE_NBD
+	    case 'P':
+		if ((poll_idle = atol(optarg)) < 0)
+		    errx(EXIT_FAILURE, "poll time must not be negative: %s", optarg);
+		break;
+#endif
+	    case 'q':
+		opts.quorum = atoi(optarg);
+		break;
+	    case 't':
+		opts.track = optarg;
+		break;
+	    case 'u':
+		opts.unit = atoi(optarg) * 1024;
+		break;
+	    case 'w':
+		opts.bitmap = optarg;
+		break;
+	    case 's':
+		if (psan_add_scan(optarg) < 0)
+		    errx(EXIT_FAILURE, "bad scan range, expected a.b.c.d/16 to /32: %s", optarg);
+		break;
+#if USE_XDP
+	    case 'x':
+		use_xdp = 1;
+		break;
+#endif
 	    case '?':
 	    default:
 		usage();
 	}
     }
 
-    psan_init(dev);
+    psan_init(devs, ndevs);
+
+    for (int i = 0; i < psan_nsocks; i++)
+	path_add(psan_socks[i], psan_devs[i]);
+
+#if USE_XDP
+    /* the io_uring loops receive from the kernel sockets only */
+    if (use_xdp)
+    {
+#if USE_NBD
+	if (nbd_loop == LOOP_URING)
+	    errx(EXIT_FAILURE, "AF_XDP needs the select or poll loop");
+#endif
+#if USE_UBLK
+	if (attach_ublk)
+	    errx(EXIT_FAILURE, "AF_XDP cannot be used with ublk");
+#endif
+
+	for (int i = 0; i < npaths; i++)
+	    xdp_open(&paths[i]);
+    }
+#endif
 
 #define args (argc - optind)
     if (args < 1)
@@ -609,9 +934,27 @@ int main(int argc, char *argv[])
 	psan_read(argv[optind], atoll(argv[optind+1]));
     else if (!strcmp(cmd, "write") && args == 3)
 	psan_write(argv[optind], atoll(argv[optind+1]), argv[optind+2]);
+    else if (!strcmp(cmd, "bench") && (args == 1 || args == 3))
+	psan_bench(argv[optind], args == 3 ? argv[optind+1] : NULL, args == 3 ? argv[optind+2] : NULL);
+    else if (!strcmp(cmd, "checkpoint") && args == 3)
+	psan_checkpoint(argv[optind], argv[optind+1], argv[optind+2]);
+    else if (!strcmp(cmd, "dump") && args >= 2)
+	psan_dump(&argv[optind], args - 1, argv[argc-1], &opts);
+    else if (!strcmp(cmd, "restore") && args >= 2)
+	psan_restore(&argv[optind], args - 1, argv[argc-1], 0, &opts);
+    else if (!strcmp(cmd, "sync") && args >= 2)
+	psan_restore(&argv[optind], args - 1, argv[argc-1], 1, &opts);
+    else if (!strcmp(cmd, "ctl") && args >= 1)
+	psan_ctl(argv[optind], &argv[optind+1], args - 1);
+    else if (!strcmp(cmd, "serve") && args >= 2)
+	psan_serve(argv[optind], &argv[optind+1], args - 1, &opts);
+#if USE_UBLK
+    else if (!strcmp(cmd, "attach") && attach_ublk && args >= 1)
+	psan_attach_ublk(&argv[optind], args, &opts);
+#endif
 #if USE_NBD
-    else if (!strcmp(cmd, "attach") && args == 2)
-	psan_attach_nbd(argv[optind], argv[optind+1]);
+    else if (!strcmp(cmd, "attach") && args >= 2)
+	psan_attach_nbd(&argv[optind], args - 1, argv[argc-1], &opts);
 #endif
     else
 	usage();
@@ -28,6 +28,16 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 
+#ifndef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(expression) expression
+#endif
+
+#define _select(...) TEMP_FAILURE_RETRY(select(__VA_ARGS__))
+#define _read(...) TEMP_FAILURE_RETRY(read(__VA_ARGS__))
+#define _recv(...) TEMP_FAILURE_RETRY(recv(__VA_ARGS__))
+#define _sendmsg(...) TEMP_FAILURE_RETRY(sendmsg(__VA_ARGS__))
+#define _sendto(...) TEMP_FAILURE_RETRY(sendto(__VA_ARGS__))
+
 #define tv2dbl(tv) ((tv).tv_sec + (tv).tv_usec / 1000000.0)
 struct timeval dbl2tv(double d);
 
@@ -0,0 +1,382 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <syslog.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "volume.h"
+#include "cache.h"
+#include "track.h"
+#include "autotune.h"
+#include "psan_wireformat.h"
+
+/* when the kernel combines requests into blocks larger than 8kb, errors increase.
+ * a striped volume splits requests, so let it take 8kb per member, and a parity
+ * volume whole rows so writes need not read anything back.  once autotune has
+ * found the size a member takes well, that replaces the 8kb.
+ */
+uint32_t volume_max_io(struct volume_t *vol)
+{
+    uint32_t row = vol->unit * (vol->nmembers - 1);
+    uint32_t request = vol->request ? vol->request : 8192;
+    uint32_t limit = vol->request ? VOLUME_MAX_IO : PSAN_MAX_LEN;
+
+    switch (vol->layout)
+    {
+	case LAYOUT_STRIPE:
+	    return vol->nmembers * request < limit ? vol->nmembers * request : limit;
+
+	case LAYOUT_PARITY:
+	    if (row <= VOLUME_MAX_IO)
+		return VOLUME_MAX_IO / row * row;
+
+	    return (vol->nmembers - 1) * request < limit ? (vol->nmembers - 1) * request : limit;
+
+	default:
+	    return request;
+    }
+}
+
+struct volume_t *volume_open(char **ids, int nids, struct volume_opts_t *opts)
+{
+    struct volume_t *vol;
+
+    if (nids > MAX_MEMBERS)
+	errx(EXIT_FAILURE, "too many partitions, at most %d are supported", MAX_MEMBERS);
+
+    if (opts->unit < 512 || opts->unit & (opts->unit-1))
+	errx(EXIT_FAILURE, "stripe unit must be a power of two of at least 512 bytes: %u", opts->unit);
+
+    if (opts->layout == LAYOUT_MIRROR && nids < 2)
+	errx(EXIT_FAILURE, "a mirror needs at least two partitions");
+
+    vol = dup_struct(struct volume_t,
+	.layout      = opts->layout,
+	.nmembers    = nids,
+	.unit        = opts->unit,
+	.quorum      = opts->quorum && opts->quorum < nids ? opts->quorum : nids,
+	.member_size = UINT64_MAX
+    );
+
+    for (int i = 0; i < nids; i++)
+    {
+	/* resolve id to IP */
+	struct part_addr_t *res;
+
+	if (!(res = psan_resolve_id(ids[i])))
+	    errx(EXIT_FAILURE, "unable to resolve id: %s", ids[i]);
+
+	/* fetch capacity information */
+	struct part_info_t *part_info;
+
+	if (!(part_info = psan_query_part(&res->part_addr)))
+	    errx(EXIT_FAILURE, "unable to query partition information: %s", ids[i]);
+
+	if (part_info->size < vol->member_size)
+	    vol->member_size = part_info->size;
+
+	vol->members[i] = target_add(ids[i], res);
+
+	free_part_info(part_info);
+	free_part_addr(res);
+    }
+
+    /* PSAN addresses 32 bit sectors, whole ones only */
+    if (vol->member_size > (uint64_t)UINT32_MAX << 9)
+	vol->member_size = (uint64_t)UINT32_MAX << 9;
+
+    vol->member_size &= ~(uint64_t)(512-1);
+
+    switch (vol->layout)
+    {
+	case LAYOUT_STRIPE:
+	    /* members are used up to the smallest one, in whole stripe units */
+	    if (nids > 1)
+		vol->member_size -= vol->member_size % vol->unit;
+
+	    vol->size = vol->member_size * nids;
+	    break;
+
+	case LAYOUT_MIRROR:
+	    vol->size = vol->member_size;
+	    mirror_open(vol, opts->bitmap);
+	    break;
+
+	case LAYOUT_PARITY:
+	    parity_open(vol, opts->bitmap);
+	    break;
+    }
+
+    vol->max_io = volume_max_io(vol);
+
+    if (opts->autotune)
+	volume_autotune(vol, opts);
+
+    if (opts->track)
+	vol->track = track_open(opts->track, vol->size);
+
+    if (opts->cache)
+	vol->cache = cache_open(vol, opts->cache);
+
+    return vol;
+}
+
+/* issue one contiguous piece of an io to a member, in requests the device accepts */
+void volume_issue(struct io_t *io, struct target_t *target, uint64_t member_from, uint32_t offset, uint32_t len)
+{
+    uint8_t cmd = io->type == IO_WRITE ? PSAN_PUT : PSAN_GET;
+
+    while (len)
+    {
+	uint8_t power = volume_power(len, volume_limit(target));
+	struct outstanding_t *out = engine_request(target, cmd, member_from >> 9, power,
+	    io->type == IO_WRITE ? io->buf + offset : NULL);
+
+	out->ctx = io;
+	out->offset = offset;
+	out->done = volume_complete;
+
+	io->pending++;
+	engine_submit(out);
+
+	member_from += 1 << power;
+	offset += 1 << power;
+	len -= 1 << power;
+    }
+}
+
+/* the largest request worth sending a member, as autotune or ut ctl set it and the paths allow */
+uint32_t volume_limit(struct target_t *target)
+{
+    uint32_t limit = engine_max_len();
+
+    return target->max_len && target->max_len < limit ? target->max_len : limit;
+}
+
+/* the largest request that fits in len and does not cross limit, at most PSAN_MAX_LEN */
+uint8_t volume_power(uint32_t len, uint64_t limit)
+{
+    uint8_t power = 9;
+
+    while ((1U << power) < PSAN_MAX_LEN && (2U << power) <= len && (2U << power) <= limit)
+	power++;
+
+    return power;
+}
+
+/* drop one reference to an io, completing it with the last */
+void io_finish(struct io_t *io)
+{
+    if (!--io->pending)
+	io->done(io);
+}
+
+static void stripe_submit(struct volume_t *vol, struct io_t *io)
+{
+    /* a lone partition is never split at stripe boundaries */
+    uint64_t unit = vol->nmembers > 1 ? vol->unit : UINT64_MAX;
+    uint32_t offset = 0;
+
+    while (offset < io->len)
+    {
+	uint64_t from = io->from + offset;
+	uint64_t stripe = from / unit;
+	uint64_t within = from % unit;
+	uint32_t len = io->len - offset;
+
+	if (len > unit - within)
+	    len = unit - within;
+
+	volume_issue(io, vol->members[stripe % vol->nmembers], stripe / vol->nmembers * unit + within, offset, len);
+
+	offset += len;
+    }
+}
+
+void volume_submit(struct volume_t *vol, struct io_t *io)
+{
+    io->vol = vol;
+    io->pending = 0;
+    io->error = 0;
+
+    if (io->len & (512-1) || io->from & (512-1) || io->from + io->len > vol->size)
+    {
+	io->error = EINVAL;
+	io->done(io);
+	return;
+    }
+
+    /* hold off completion until every piece is in flight */
+    io->pending++;
+
+    switch (vol->layout)
+    {
+	case LAYOUT_STRIPE:
+	    stripe_submit(vol, io);
+	    break;
+
+	case LAYOUT_MIRROR:
+	    mirror_submit(vol, io);
+	    break;
+
+	case LAYOUT_PARITY:
+	    parity_submit(vol, io);
+	    break;
+    }
+
+    io_finish(io);
+}
+
+void volume_complete(struct outstanding_t *out, uint8_t *buf, int len)
+{
+    struct io_t *io = out->ctx;
+    struct psan_ctrl_t *ctrl = (struct psan_ctrl_t *)buf;
+
+    if (!buf)
+	io->error = EIO;
+    else if (ctrl->cmd == PSAN_GET_RESPONSE)
+	memcpy(io->buf + out->offset, ((struct psan_get_response_t *)buf)->buffer, len - sizeof(struct psan_get_response_t));
+
+    engine_free(out);
+
+    io_finish(io);
+}
+
+/* per region state of a redundant layout.  given a file, the write-intent bitmap is kept
+ * in it and the regions each member missed in one beside it named after the partition,
+ * so a restart knows which members are current
+ */
+void volume_regions(struct volume_t *vol, char *bitmap)
+{
+    vol->nregions = (vol->member_size + REGION_SIZE - 1) / REGION_SIZE;
+
+    vol->intent = bitmap_open(bitmap, vol->nregions, REGION_SIZE);
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	char path[PATH_MAX];
+
+	if (!bitmap)
+	{
+	    vol->stale[i] = bitmap_open(NULL, vol->nregions, REGION_SIZE);
+	    continue;
+	}
+
+	snprintf(path, sizeof(path), "%s.%s", bitmap, vol->members[i]->id);
+
+	/* without it, writes in flight cannot be told from writes the member missed */
+	if (!bitmap_empty(vol->intent) && access(path, F_OK) < 0)
+	    errx(EXIT_FAILURE, "%s: regions are dirty but %s is missing, which partitions are current is unknown", bitmap, path);
+
+	vol->stale[i] = bitmap_open(path, vol->nregions, REGION_SIZE);
+
+	if (!bitmap_empty(vol->stale[i]))
+	    vol->resync_wanted = 1;
+    }
+
+    if (!(vol->inflight = calloc(vol->nregions, sizeof(*vol->inflight))))
+	err(EXIT_FAILURE, "calloc");
+
+    if (!(vol->generation = calloc(vol->nregions, sizeof(*vol->generation))))
+	err(EXIT_FAILURE, "calloc");
+}
+
+/* a member missed a write to the region, it is brought up to date in the background */
+void volume_mark_stale(struct volume_t *vol, int member, uint64_t region)
+{
+    bitmap_set(vol->stale[member], region);
+    vol->resync_wanted = 1;
+}
+
+/* fail members that stopped answering and restore those that answer again,
+ * returns the members failed by this call
+ */
+uint32_t volume_check_members(struct volume_t *vol)
+{
+    uint32_t failed = 0;
+
+    for (int i = 0; i < vol->nmembers; i++)
+    {
+	struct target_t *target = vol->members[i];
+
+	if (!vol->failed[i] && target->timeouts >= MEMBER_FAIL_TIMEOUTS)
+	{
+	    syslog(LOG_WARNING, "partition %s failed after %u timeouts", target->id, target->timeouts);
+
+	    vol->failed[i] = 1;
+	    failed |= 1 << i;
+
+	    /* owners of requests in flight see them fail and work around the member */
+	    engine_cancel(target);
+	}
+	else if (vol->failed[i] && !target->timeouts)
+	{
+	    syslog(LOG_NOTICE, "partition %s is back, resyncing", target->id);
+
+	    vol->failed[i] = 0;
+	    vol->resync_wanted = 1;
+	}
+    }
+
+    return failed;
+}
+
+/* lazily forget regions every member agrees on */
+void volume_flush_intent(struct volume_t *vol, struct timeval *now)
+{
+    if (timercmp(&vol->next_flush, now, >))
+	return;
+
+    for (uint64_t region = 0; region < vol->nregions; region++)
+    {
+	if (!bitmap_test(vol->intent, region) || vol->inflight[region])
+	    continue;
+
+	int stale = vol->parity_stale && bitmap_test(vol->parity_stale, region);
+
+	for (int i = 0; i < vol->nmembers; i++)
+	    stale |= bitmap_test(vol->stale[i], region);
+
+	if (!stale)
+	    bitmap_clear(vol->intent, region);
+	else
+	    /* regions passed over while busy are retried */
+	    vol->resync_wanted = 1;
+    }
+
+    /* a region leaves the intent only once the members it was stale on are on record as caught up */
+    for (int i = 0; i < vol->nmembers; i++)
+	bitmap_flush(vol->stale[i]);
+
+    bitmap_flush(vol->intent);
+
+    vol->next_flush = *now;
+    vol->next_flush.tv_sec += BITMAP_FLUSH_INTERVAL;
+}
+
+void volume_poll(struct volume_t *vol, struct timeval *now)
+{
+    if (vol->layout == LAYOUT_MIRROR)
+	mirror_poll(vol, now);
+    else if (vol->layout == LAYOUT_PARITY)
+	parity_poll(vol, now);
+
+    if (vol->cache)
+	cache_poll(vol->cache, now);
+}
@@ -0,0 +1,160 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_VOLUME_H__
+#define __PSAN_VOLUME_H__
+
+#include "engine.h"
+#include "bitmap.h"
+
+/* partitions one volume may be built from */
+#define MAX_MEMBERS 16
+
+/* default stripe unit in bytes */
+#define STRIPE_UNIT 65536
+
+/* largest request a PSAN device accepts */
+#define PSAN_MAX_LEN 32768
+
+/* largest request a volume accepts, a parity volume takes whole rows up to this */
+#define VOLUME_MAX_IO 131072
+
+/* size of a mirror region tracked by the write-intent bitmap */
+#define REGION_SIZE (1 << 20)
+
+/* bytes of a region copied at a time while resyncing, so it does not flood the replicas */
+#define RESYNC_STEP 65536
+
+/* steps of a parity rebuild in flight at once, enough to keep the network busy */
+#define REBUILD_DEPTH 4
+
+/* consecutive timeouts before a replica is failed and stops receiving writes */
+#define MEMBER_FAIL_TIMEOUTS 5
+
+/* seconds between lazy clears of the write-intent bitmap */
+#define BITMAP_FLUSH_INTERVAL 5
+
+enum layout_t {
+    LAYOUT_STRIPE,
+    LAYOUT_MIRROR,
+    LAYOUT_PARITY
+};
+
+enum io_type_t {
+    IO_READ,
+    IO_WRITE
+};
+
+struct sched_t;
+
+/* one request against the volume, split into PSAN requests to its members */
+struct io_t {
+    enum io_type_t type;
+    uint64_t from;
+    uint32_t len;
+    uint8_t *buf;
+    unsigned pending;
+    int error;
+    struct volume_t *vol;
+    void *ctx;
+    void (*done)(struct io_t *io);
+
+    /* while it passes through the scheduler */
+    struct sched_t *sched;
+    unsigned long order;
+    void (*complete)(struct io_t *io);
+    struct timeval queued;
+    struct timeval started;
+    int indexed;
+    int unshared;
+    TAILQ_HEAD(io_waiters, io_t) waiters;
+    TAILQ_ENTRY(io_t) entries;
+};
+
+struct volume_opts_t {
+    enum layout_t layout;
+    uint32_t unit;
+    unsigned quorum;
+    char *bitmap;
+    char *cache;
+    char *track;
+    int autotune;
+    char *scratch;
+    int affinity;
+    char *cpus;
+};
+
+struct resync_t;
+struct cache_t;
+struct track_t;
+
+struct volume_t {
+    enum layout_t layout;
+    unsigned nmembers;
+    struct target_t *members[MAX_MEMBERS];
+    uint32_t unit;
+    uint64_t member_size;
+    uint64_t size;
+    uint32_t max_io;
+    struct cache_t *cache;
+    struct track_t *track;
+
+    /* set by autotune, the largest request sent to a member and volume requests kept in flight */
+    uint32_t request;
+    unsigned depth;
+
+    /* mirror and parity */
+    unsigned quorum;
+    int failed[MAX_MEMBERS];
+    uint64_t nregions;
+    struct bitmap_t *intent;
+    struct bitmap_t *stale[MAX_MEMBERS];
+    struct bitmap_t *parity_stale;
+    uint16_t *inflight;
+    uint32_t *generation;
+    struct resync_t *resync;
+    uint64_t resync_cursor;
+    int resync_wanted;
+    struct timeval next_flush;
+};
+
+struct volume_t *volume_open(char **ids, int nids, struct volume_opts_t *opts);
+void volume_submit(struct volume_t *vol, struct io_t *io);
+void volume_poll(struct volume_t *vol, struct timeval *now);
+
+uint32_t volume_max_io(struct volume_t *vol);
+uint32_t volume_limit(struct target_t *target);
+uint8_t volume_power(uint32_t len, uint64_t limit);
+void volume_issue(struct io_t *io, struct target_t *target, uint64_t member_from, uint32_t offset, uint32_t len);
+void volume_complete(struct outstanding_t *out, uint8_t *buf, int len);
+void io_finish(struct io_t *io);
+
+void volume_regions(struct volume_t *vol, char *bitmap);
+void volume_mark_stale(struct volume_t *vol, int member, uint64_t region);
+uint32_t volume_check_members(struct volume_t *vol);
+void volume_flush_intent(struct volume_t *vol, struct timeval *now);
+
+void mirror_open(struct volume_t *vol, char *bitmap);
+void mirror_submit(struct volume_t *vol, struct io_t *io);
+void mirror_poll(struct volume_t *vol, struct timeval *now);
+
+void parity_open(struct volume_t *vol, char *bitmap);
+void parity_submit(struct volume_t *vol, struct io_t *io);
+void parity_poll(struct volume_t *vol, struct timeval *now);
+
+#endif /* __PSAN_VOLUME_H__ */
@@ -0,0 +1,644 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <err.h>
+#include <errno.h>
+
+#include "xdp.h"
+#include "util.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define UDP_HLEN 8
+
+/* one ring shared with the kernel, we produce on the fill and tx rings and consume the others */
+struct ring_t {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *desc;
+};
+
+struct neighbour_t {
+    uint32_t addr;
+    uint8_t mac[ETH_ALEN];
+    time_t expires;
+};
+
+/* a datagram that arrived in fragments, with a bit for each 8 bytes received */
+struct reassembly_t {
+    int used;
+    uint32_t saddr;
+    uint16_t id;
+    uint32_t total;
+    uint32_t received;
+    struct timeval started;
+    uint8_t have[65536 / 8 / 8];
+    uint8_t buf[65536];
+};
+
+struct xsk_t {
+    struct path_t *path;
+    int fd;
+    int ifindex;
+    uint8_t mac[ETH_ALEN];
+    uint32_t addr;
+    uint16_t port;
+    unsigned mtu;
+    uint16_t ip_id;
+    uint8_t *umem;
+    struct ring_t rx, tx, fill, comp;
+    uint64_t free[XDP_FRAMES / 2];
+    unsigned nfree;
+    struct neighbour_t neighbours[XDP_NEIGHBOURS];
+    unsigned nneighbours;
+    time_t neighbours_read;
+    struct reassembly_t *reassembly;
+};
+
+static struct xsk_t *xsks[MAX_PATHS];
+static int nxsks;
+
+/* addresses of the partitions in use, shared by the programs of every interface */
+static int addr_map = -1;
+
+static ssize_t xdp_sendto(int sock, const void *buf, size_t len, const struct sockaddr_in *to);
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c, dst, src, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (dst), .src_reg = (src), .off = (o), .imm = (i) })
+#define LD_MAP(dst, fd) INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+
+/* pass everything to the kernel except PSAN answers from the partitions in use to
+ * our port, and fragments of them, which go to the socket of the receive queue.
+ * jump offsets count from the next instruction.
+ */
+static int xdp_program(int xsk_map, uint16_t port)
+{
+    enum { LOOKUP = 19, PASS = 33 };
+    struct bpf_insn prog[] = {
+	/*  0 */ INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+	/*  1 */ INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0),
+	/*  2 */ INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0),
+	/*  3 */ INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+	/*  4 */ INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN + sizeof(struct ip) + UDP_HLEN),
+	/*  5 */ INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, PASS - 6, 0),
+	/*  6 */ INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0),
+	/*  7 */ INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 8, htons(ETH_P_IP)),
+	/*  8 */ INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN, 0),
+	/*  9 */ INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 10, 0x45),
+	/* 10 */ INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct ip, ip_p), 0),
+	/* 11 */ INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 12, IPPROTO_UDP),
+	/* 12 */ INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct ip, ip_off), 0),
+	/* 13 */ INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(IP_OFFMASK)),
+	/* 14 */ INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, LOOKUP - 15, 0),
+	/* 15 */ INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + sizeof(struct ip), 0),
+	/* 16 */ INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 17, htons(PSAN_PORT)),
+	/* 17 */ INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + sizeof(struct ip) + 2, 0),
+	/* 18 */ INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, PASS - 19, port),
+	/* 19 */ INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, ETH_HLEN + offsetof(struct ip, ip_src), 0),
+	/* 20 */ INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_5, -4, 0),
+	/* 21 */ LD_MAP(BPF_REG_1, addr_map),
+	/* 23 */ INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+	/* 24 */ INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+	/* 25 */ INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+	/* 26 */ INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, PASS - 27, 0),
+	/* 27 */ INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0),
+	/* 28 */ LD_MAP(BPF_REG_1, xsk_map),
+	/* 30 */ INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+	/* 31 */ INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+	/* 32 */ INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	/* 33 */ INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+	/* 34 */ INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+    static char log[65536];
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uintptr_t)"GPL";
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+
+    if ((fd = bpf(BPF_PROG_LOAD, &attr)) < 0)
+	err(EXIT_FAILURE, "bpf(BPF_PROG_LOAD): %s", log);
+
+    return fd;
+}
+
+static int map_create(int type, unsigned key_size, unsigned value_size, unsigned entries)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = entries;
+
+    if ((fd = bpf(BPF_MAP_CREATE, &attr)) < 0)
+	err(EXIT_FAILURE, "bpf(BPF_MAP_CREATE)");
+
+    return fd;
+}
+
+static int map_update(int fd, void *key, void *value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uintptr_t)key;
+    attr.value = (uintptr_t)value;
+
+    return bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void ring_map(int fd, off_t pgoff, struct xdp_ring_offset *off, size_t desc_size, struct ring_t *ring)
+{
+    uint8_t *map = mmap(NULL, off->desc + XDP_RING_SIZE * desc_size, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, fd, pgoff);
+
+    if (map == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(xdp ring)");
+
+    ring->producer = (uint32_t *)(map + off->producer);
+    ring->consumer = (uint32_t *)(map + off->consumer);
+    ring->desc = map + off->desc;
+}
+
+static void fill(struct xsk_t *xsk, uint64_t addr)
+{
+    uint32_t idx = *xsk->fill.producer;
+
+    ((uint64_t *)xsk->fill.desc)[idx & (XDP_RING_SIZE-1)] = addr & ~(uint64_t)(XDP_FRAME_SIZE-1);
+    __atomic_store_n(xsk->fill.producer, idx + 1, __ATOMIC_RELEASE);
+}
+
+/* frames the kernel has finished sending may be used again */
+static void reclaim(struct xsk_t *xsk)
+{
+    uint32_t cons = *xsk->comp.consumer;
+    uint32_t prod = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE);
+
+    for (; cons != prod; cons++)
+	xsk->free[xsk->nfree++] = ((uint64_t *)xsk->comp.desc)[cons & (XDP_RING_SIZE-1)];
+
+    __atomic_store_n(xsk->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+static void ifreq_get(int sock, char *dev, unsigned long req, struct ifreq *ifr, char *what)
+{
+    memset(ifr, 0, sizeof(*ifr));
+    strncpy(ifr->ifr_name, dev, IFNAMSIZ-1);
+
+    if (ioctl(sock, req, ifr) < 0)
+	err(EXIT_FAILURE, "ioctl(%s, %s)", dev, what);
+}
+
+/* receive PSAN answers arriving on the first queue of a path's interface through an
+ * AF_XDP socket in copy mode, and send requests through it, which works on any
+ * driver including veth.  everything else still goes through the kernel.
+ */
+void xdp_open(struct path_t *path)
+{
+    struct xsk_t *xsk;
+    struct ifreq ifr;
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    int size = XDP_RING_SIZE;
+
+    if (!path->dev)
+	errx(EXIT_FAILURE, "AF_XDP needs the interface to be named with -d");
+
+    if (getsockname(path->sock, (struct sockaddr *)&local, &local_len) < 0 || !local.sin_port)
+	errx(EXIT_FAILURE, "AF_XDP needs the PSAN socket on %s bound to a port", path->dev);
+
+    if (!(xsk = calloc(1, sizeof(*xsk))) || !(xsk->reassembly = calloc(XDP_REASSEMBLY_SLOTS, sizeof(*xsk->reassembly))))
+	err(EXIT_FAILURE, "calloc");
+
+    xsk->path = path;
+    xsk->port = local.sin_port;
+
+    if (!(xsk->ifindex = if_nametoindex(path->dev)))
+	err(EXIT_FAILURE, "if_nametoindex(%s)", path->dev);
+
+    ifreq_get(path->sock, path->dev, SIOCGIFHWADDR, &ifr, "SIOCGIFHWADDR");
+    memcpy(xsk->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    ifreq_get(path->sock, path->dev, SIOCGIFADDR, &ifr, "SIOCGIFADDR");
+    xsk->addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+
+    ifreq_get(path->sock, path->dev, SIOCGIFMTU, &ifr, "SIOCGIFMTU");
+    xsk->mtu = ifr.ifr_mtu;
+
+    /* the frames shared with the kernel */
+    if ((xsk->umem = mmap(NULL, (size_t)XDP_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	err(EXIT_FAILURE, "mmap(umem)");
+
+    if ((xsk->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+	err(EXIT_FAILURE, "socket(AF_XDP)");
+
+    struct xdp_umem_reg reg = {
+	.addr       = (uintptr_t)xsk->umem,
+	.len        = (uint64_t)XDP_FRAMES * XDP_FRAME_SIZE,
+	.chunk_size = XDP_FRAME_SIZE
+    };
+
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+	err(EXIT_FAILURE, "setsockopt(XDP_UMEM_REG)");
+
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0
+	|| setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0
+	|| setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0
+	|| setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+	err(EXIT_FAILURE, "setsockopt(xdp rings)");
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) < 0)
+	err(EXIT_FAILURE, "getsockopt(XDP_MMAP_OFFSETS)");
+
+    ring_map(xsk->fd, XDP_PGOFF_RX_RING, &off.rx, sizeof(struct xdp_desc), &xsk->rx);
+    ring_map(xsk->fd, XDP_PGOFF_TX_RING, &off.tx, sizeof(struct xdp_desc), &xsk->tx);
+    ring_map(xsk->fd, XDP_UMEM_PGOFF_FILL_RING, &off.fr, sizeof(uint64_t), &xsk->fill);
+    ring_map(xsk->fd, XDP_UMEM_PGOFF_COMPLETION_RING, &off.cr, sizeof(uint64_t), &xsk->comp);
+
+    /* the first half is received into, the second sent from */
+    for (unsigned i = 0; i < XDP_FRAMES / 2; i++)
+	fill(xsk, (uint64_t)i * XDP_FRAME_SIZE);
+
+    for (unsigned i = XDP_FRAMES / 2; i < XDP_FRAMES; i++)
+	xsk->free[xsk->nfree++] = (uint64_t)i * XDP_FRAME_SIZE;
+
+    struct sockaddr_xdp sxdp = {
+	.sxdp_family   = AF_XDP,
+	.sxdp_flags    = XDP_COPY,
+	.sxdp_ifindex  = xsk->ifindex,
+	.sxdp_queue_id = 0
+    };
+
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+	err(EXIT_FAILURE, "bind(AF_XDP, %s)", path->dev);
+
+    /* steer answers to it, the link is dropped with the process */
+    if (addr_map < 0)
+	addr_map = map_create(BPF_MAP_TYPE_HASH, sizeof(uint32_t), 1, 256);
+
+    int xsk_map = map_create(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(int), 1);
+    uint32_t queue = 0;
+
+    if (map_update(xsk_map, &queue, &xsk->fd) < 0)
+	err(EXIT_FAILURE, "bpf(BPF_MAP_UPDATE_ELEM, xsk)");
+
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp_program(xsk_map, xsk->port);
+    attr.link_create.target_ifindex = xsk->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+
+    if (bpf(BPF_LINK_CREATE, &attr) < 0)
+	err(EXIT_FAILURE, "attaching XDP program to %s", path->dev);
+
+    xsks[nxsks++] = xsk;
+    engine_sendto = xdp_sendto;
+
+    syslog(LOG_INFO, "%s: PSAN answers received through AF_XDP", path->dev);
+}
+
+/* answers from this address are taken from the AF_XDP sockets from now on */
+void xdp_watch(struct sockaddr_in *addr)
+{
+    uint8_t one = 1;
+
+    if (addr_map < 0)
+	return;
+
+    if (map_update(addr_map, &addr->sin_addr.s_addr, &one) < 0)
+	syslog(LOG_WARNING, "bpf(BPF_MAP_UPDATE_ELEM, %s): %s", inet_ntoa(addr->sin_addr), strerror(errno));
+}
+
+/* the hardware address of a directly connected host from the kernel's neighbour table,
+ * read again at most once a second while one is missing
+ */
+static uint8_t *neighbour(struct xsk_t *xsk, uint32_t addr, time_t now)
+{
+    struct neighbour_t *n;
+    char line[256], ip[64], mac[64], mask[64], dev[64];
+    unsigned type, flags;
+    FILE *f;
+
+    for (unsigned i = 0; i < xsk->nneighbours; i++)
+	if (xsk->neighbours[i].addr == addr && now < xsk->neighbours[i].expires)
+	    return xsk->neighbours[i].mac;
+
+    if (now == xsk->neighbours_read || !(f = fopen("/proc/net/arp", "r")))
+	return NULL;
+
+    xsk->neighbours_read = now;
+    n = NULL;
+
+    while (!n && fgets(line, sizeof(line), f))
+    {
+	struct in_addr in;
+	unsigned m[ETH_ALEN];
+
+	if (sscanf(line, "%63s 0x%x 0x%x %63s %63s %63s", ip, &type, &flags, mac, mask, dev) != 6
+	    || strcmp(dev, xsk->path->dev) || !(flags & 0x2) || !inet_aton(ip, &in) || in.s_addr != addr
+	    || sscanf(mac, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != ETH_ALEN)
+	    continue;
+
+	/* replace the entry for the address, else a free one, else the first */
+	for (unsigned i = 0; !n && i < xsk->nneighbours; i++)
+	    if (xsk->neighbours[i].addr == addr)
+		n = &xsk->neighbours[i];
+
+	if (!n)
+	    n = &xsk->neighbours[xsk->nneighbours < XDP_NEIGHBOURS ? xsk->nneighbours++ : 0];
+
+	n->addr = addr;
+	n->expires = now + XDP_NEIGHBOUR_TTL;
+
+	for (int i = 0; i < ETH_ALEN; i++)
+	    n->mac[i] = m[i];
+    }
+
+    fclose(f);
+
+    return n ? n->mac : NULL;
+}
+
+static uint16_t ip_checksum(void *hdr, int len)
+{
+    uint16_t *p = hdr;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+	sum += *p++;
+
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/* build the datagram straight into frames, in IP fragments when it exceeds the MTU.
+ * anything that cannot go this way, for want of a neighbour or free frames, is sent
+ * by the kernel instead.
+ */
+static ssize_t xdp_sendto(int sock, const void *buf, size_t len, const struct sockaddr_in *to)
+{
+    struct xsk_t *xsk = NULL;
+    uint8_t *mac;
+    uint8_t udp[UDP_HLEN];
+    size_t total = UDP_HLEN + len;
+    unsigned max;
+
+    for (int i = 0; i < nxsks; i++)
+	if (xsks[i]->path->sock == sock)
+	    xsk = xsks[i];
+
+    if (!xsk || total > 65535 - sizeof(struct ip) || !(mac = neighbour(xsk, to->sin_addr.s_addr, time(NULL))))
+	return _sendto(sock, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
+
+    /* fragments carry a multiple of 8 bytes, all but the last as many as fit */
+    max = xsk->mtu < XDP_FRAME_SIZE - ETH_HLEN ? xsk->mtu : XDP_FRAME_SIZE - ETH_HLEN;
+    max = (max - sizeof(struct ip)) & ~7U;
+
+    unsigned nfrags = (total + max - 1) / max;
+    uint32_t prod = *xsk->tx.producer;
+
+    reclaim(xsk);
+
+    if (xsk->nfree < nfrags || prod - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) + nfrags > XDP_RING_SIZE)
+	return _sendto(sock, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
+
+    *(uint16_t *)&udp[0] = xsk->port;
+    *(uint16_t *)&udp[2] = to->sin_port;
+    *(uint16_t *)&udp[4] = htons(total);
+    *(uint16_t *)&udp[6] = 0;
+
+    uint16_t id = htons(xsk->ip_id++);
+
+    for (size_t offset = 0; offset < total; offset += max)
+    {
+	uint64_t addr = xsk->free[--xsk->nfree];
+	uint8_t *frame = xsk->umem + addr;
+	struct ip *ip = (struct ip *)(frame + ETH_HLEN);
+	uint8_t *data = (uint8_t *)(ip + 1);
+	size_t n = total - offset < max ? total - offset : max;
+
+	memcpy(frame, mac, ETH_ALEN);
+	memcpy(frame + ETH_ALEN, xsk->mac, ETH_ALEN);
+	*(uint16_t *)(frame + 2 * ETH_ALEN) = htons(ETH_P_IP);
+
+	*ip = (struct ip){
+	    .ip_v   = 4,
+	    .ip_hl  = sizeof(struct ip) / 4,
+	    .ip_len = htons(sizeof(struct ip) + n),
+	    .ip_id  = id,
+	    .ip_off = htons(offset / 8 | (offset + n < total ? IP_MF : 0)),
+	    .ip_ttl = 64,
+	    .ip_p   = IPPROTO_UDP,
+	    .ip_src = { xsk->addr },
+	    .ip_dst = to->sin_addr
+	};
+	ip->ip_sum = ip_checksum(ip, sizeof(struct ip));
+
+	/* the UDP header only leads the first fragment */
+	if (!offset)
+	{
+	    memcpy(data, udp, UDP_HLEN);
+	    memcpy(data + UDP_HLEN, buf, n - UDP_HLEN);
+	}
+	else
+	    memcpy(data, (uint8_t *)buf + offset - UDP_HLEN, n);
+
+	struct xdp_desc *desc = &((struct xdp_desc *)xsk->tx.desc)[prod++ & (XDP_RING_SIZE-1)];
+	desc->addr = addr;
+	desc->len = ETH_HLEN + sizeof(struct ip) + n;
+	desc->options = 0;
+    }
+
+    __atomic_store_n(xsk->tx.producer, prod, __ATOMIC_RELEASE);
+
+    /* copy mode sends from the system call */
+    if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+	syslog(LOG_WARNING, "sendto(AF_XDP): %s", strerror(errno));
+
+    return len;
+}
+
+/* collect a fragment, handing the datagram on once every byte of it has arrived */
+static void reassemble(struct xsk_t *xsk, struct ip *ip, uint8_t *data, unsigned len, struct timeval *now)
+{
+    unsigned frag = ntohs(ip->ip_off);
+    unsigned offset = (frag & IP_OFFMASK) * 8;
+    struct reassembly_t *slot = NULL, *victim = NULL;
+
+    if (offset + len > 65535 || (frag & IP_MF && len & 7) || !len)
+	return;
+
+    for (int i = 0; i < XDP_REASSEMBLY_SLOTS; i++)
+    {
+	struct reassembly_t *r = &xsk->reassembly[i];
+
+	if (r->used && tv2dbl(*now) - tv2dbl(r->started) > XDP_REASSEMBLY_TIMEOUT)
+	    r->used = 0;
+
+	if (r->used && r->saddr == ip->ip_src.s_addr && r->id == ip->ip_id)
+	{
+	    slot = r;
+	    break;
+	}
+
+	/* a free slot, else the oldest */
+	if (!victim || (victim->used && (!r->used || timercmp(&r->started, &victim->started, <))))
+	    victim = r;
+    }
+
+    if (!slot)
+    {
+	slot = victim;
+	slot->used = 1;
+	slot->saddr = ip->ip_src.s_addr;
+	slot->id = ip->ip_id;
+	slot->total = 0;
+	slot->received = 0;
+	slot->started = *now;
+	memset(slot->have, 0, sizeof(slot->have));
+    }
+
+    /* a duplicate is dropped whole */
+    for (unsigned u = offset / 8; u < (offset + len + 7) / 8; u++)
+	if (slot->have[u / 8] & 1 << u % 8)
+	    return;
+
+    for (unsigned u = offset / 8; u < (offset + len + 7) / 8; u++)
+	slot->have[u / 8] |= 1 << u % 8;
+
+    memcpy(slot->buf + offset, data, len);
+    slot->received += len;
+
+    if (!(frag & IP_MF))
+	slot->total = offset + len;
+
+    if (!slot->total || slot->received != slot->total)
+	return;
+
+    slot->used = 0;
+
+    if (slot->total > UDP_HLEN)
+	engine_receive(xsk->path, slot->buf + UDP_HLEN, slot->total - UDP_HLEN, now);
+}
+
+static void frame(struct xsk_t *xsk, uint8_t *buf, uint32_t len, struct timeval *now)
+{
+    struct ip *ip = (struct ip *)(buf + ETH_HLEN);
+    unsigned hlen, total;
+
+    if (len < ETH_HLEN + sizeof(struct ip))
+	return;
+
+    hlen = ip->ip_hl * 4;
+    total = ntohs(ip->ip_len);
+
+    if (hlen < sizeof(struct ip) || total < hlen || ETH_HLEN + total > len)
+	return;
+
+    if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK))
+	reassemble(xsk, ip, (uint8_t *)ip + hlen, total - hlen, now);
+    else if (total - hlen > UDP_HLEN)
+	engine_receive(xsk->path, (uint8_t *)ip + hlen + UDP_HLEN, total - hlen - UDP_HLEN, now);
+}
+
+int xdp_fdset(fd_set *set, int max)
+{
+    for (int i = 0; i < nxsks; i++)
+    {
+	FD_SET(xsks[i]->fd, set);
+
+	if (xsks[i]->fd > max)
+	    max = xsks[i]->fd;
+    }
+
+    return max;
+}
+
+/* hand on everything received by the sockets ready in set, or by all of them without
+ * one, returning the frames taken
+ */
+int xdp_receive(fd_set *set)
+{
+    struct timeval now;
+    int frames = 0;
+
+    gettimeofday(&now, NULL);
+
+    for (int i = 0; i < nxsks; i++)
+    {
+	struct xsk_t *xsk = xsks[i];
+
+	if (set && !FD_ISSET(xsk->fd, set))
+	    continue;
+
+	uint32_t cons = *xsk->rx.consumer;
+	uint32_t prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+
+	for (; cons != prod; cons++, frames++)
+	{
+	    struct xdp_desc *desc = &((struct xdp_desc *)xsk->rx.desc)[cons & (XDP_RING_SIZE-1)];
+
+	    frame(xsk, xsk->umem + desc->addr, desc->len, &now);
+	    fill(xsk, desc->addr);
+	}
+
+	__atomic_store_n(xsk->rx.consumer, cons, __ATOMIC_RELEASE);
+    }
+
+    return frames;
+}
@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_XDP_H__
+#define __PSAN_XDP_H__
+
+#include <sys/select.h>
+
+#include "engine.h"
+
+/* the port SC101 devices answer from */
+#define PSAN_PORT 20001
+
+/* frames of the memory shared with the kernel, half received into and half sent from,
+ * each holds one ethernet frame
+ */
+#define XDP_FRAMES 4096
+#define XDP_FRAME_SIZE 4096
+
+/* descriptors of each ring */
+#define XDP_RING_SIZE 2048
+
+/* datagrams being reassembled from fragments at once, and seconds one may take */
+#define XDP_REASSEMBLY_SLOTS 16
+#define XDP_REASSEMBLY_TIMEOUT 1
+
+/* seconds a neighbour's hardware address is trusted before it is looked up again */
+#define XDP_NEIGHBOUR_TTL 60
+
+/* neighbours remembered per interface */
+#define XDP_NEIGHBOURS 64
+
+#if USE_XDP
+void xdp_open(struct path_t *path);
+void xdp_watch(struct sockaddr_in *addr);
+int xdp_fdset(fd_set *set, int max);
+int xdp_receive(fd_set *set);
+#else
+static inline void xdp_watch(struct sockaddr_in *addr) { (void)addr; }
+static inline int xdp_fdset(fd_set *set, int max) { (void)set; return max; }
+static inline int xdp_receive(fd_set *set) { (void)set; return 0; }
+#endif
+
+#endif /* __PSAN_XDP_H__ */
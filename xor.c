@@ -0,0 +1,183 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "xor.h"
+
+static void xor_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+	uint64_t a, b;
+
+	memcpy(&a, dst + i, sizeof(a));
+	memcpy(&b, src + i, sizeof(b));
+	a ^= b;
+	memcpy(dst + i, &a, sizeof(a));
+    }
+
+    for (; i < len; i++)
+	dst[i] ^= src[i];
+}
+
+static int zero_scalar(const uint8_t *buf, size_t len)
+{
+    uint64_t acc = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+	uint64_t a;
+
+	memcpy(&a, buf + i, sizeof(a));
+	acc |= a;
+    }
+
+    for (; i < len; i++)
+	acc |= buf[i];
+
+    return !acc;
+}
+
+#if HAVE_X86
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+    /* four registers per iteration keep both load ports busy */
+    for (; i + 64 <= len; i += 64)
+    {
+	__m128i a0 = _mm_loadu_si128((const __m128i *)(dst + i));
+	__m128i a1 = _mm_loadu_si128((const __m128i *)(dst + i + 16));
+	__m128i a2 = _mm_loadu_si128((const __m128i *)(dst + i + 32));
+	__m128i a3 = _mm_loadu_si128((const __m128i *)(dst + i + 48));
+
+	a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(src + i)));
+	a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(src + i + 16)));
+	a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(src + i + 32)));
+	a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(src + i + 48)));
+
+	_mm_storeu_si128((__m128i *)(dst + i), a0);
+	_mm_storeu_si128((__m128i *)(dst + i + 16), a1);
+	_mm_storeu_si128((__m128i *)(dst + i + 32), a2);
+	_mm_storeu_si128((__m128i *)(dst + i + 48), a3);
+    }
+
+    xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128)
+    {
+	__m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+	__m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+	__m256i a2 = _mm256_loadu_si256((const __m256i *)(dst + i + 64));
+	__m256i a3 = _mm256_loadu_si256((const __m256i *)(dst + i + 96));
+
+	a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(src + i)));
+	a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(src + i + 32)));
+	a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(src + i + 64)));
+	a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(src + i + 96)));
+
+	_mm256_storeu_si256((__m256i *)(dst + i), a0);
+	_mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+	_mm256_storeu_si256((__m256i *)(dst + i + 64), a2);
+	_mm256_storeu_si256((__m256i *)(dst + i + 96), a3);
+    }
+
+    xor_sse2(dst + i, src + i, len - i);
+}
+
+/* or a block together and test once, a data block usually fails on its first line */
+__attribute__((target("sse2")))
+static int zero_sse2(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+	__m128i a = _mm_or_si128(
+	    _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)), _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+	    _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)), _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) != 0xffff)
+	    return 0;
+    }
+
+    return zero_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int zero_avx2(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128)
+    {
+	__m256i a = _mm256_or_si256(
+	    _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)), _mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+	    _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)), _mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+
+	if (!_mm256_testz_si256(a, a))
+	    return 0;
+    }
+
+    return zero_sse2(buf + i, len - i);
+}
+#endif
+
+void (*xor_into)(uint8_t *dst, const uint8_t *src, size_t len) = xor_scalar;
+int (*is_zero)(const uint8_t *buf, size_t len) = zero_scalar;
+
+const char *xor_init(void)
+{
+#if HAVE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+	xor_into = xor_avx2;
+	is_zero = zero_avx2;
+	return "avx2";
+    }
+
+    if (__builtin_cpu_supports("sse2"))
+    {
+	xor_into = xor_sse2;
+	is_zero = zero_sse2;
+	return "sse2";
+    }
+#endif
+
+    xor_into = xor_scalar;
+    is_zero = zero_scalar;
+    return "scalar";
+}
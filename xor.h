@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2007  Iain Wade <iwade@optusnet.com.au>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PSAN_XOR_H__
+#define __PSAN_XOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* dst ^= src over len bytes */
+extern void (*xor_into)(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* whether len bytes are all zero */
+extern int (*is_zero)(const uint8_t *buf, size_t len);
+
+/* pick the widest kernel the CPU supports, returns its name */
+const char *xor_init(void);
+
+#endif /* __PSAN_XOR_H__ */